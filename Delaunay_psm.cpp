@@ -9439,8 +9439,9 @@ namespace GEO {
         //(random_shuffle is deprecated in C++17, and they call this 
         // progess...)
         //std::random_shuffle(sorted_indices.begin(), sorted_indices.end()); 
-        std::random_device rng;
-        std::mt19937 urng(rng());
+        // A fixed seed, like the std::rand of random_shuffle, so that the
+        // same points give the same triangulation.
+        std::mt19937 urng;
         std::shuffle(sorted_indices.begin(), sorted_indices.end(), urng);
 
         compute_BRIO_order_recursive(
@@ -9590,8 +9591,9 @@ namespace GEO {
         //(random_shuffle is deprecated in C++17, and they call this 
         // progress...)
         // std::random_shuffle(b,e);
-        std::random_device rng;
-        std::mt19937 urng(rng());
+        // A fixed seed, like the std::rand of random_shuffle, so that the
+        // same points give the same triangulation.
+        std::mt19937 urng;
         std::shuffle(b,e, urng);
 
 	PeriodicVertexMesh3d M(nb_vertices, vertices, stride, period);
@@ -0,0 +1,97 @@
+// Reports the construction time of the acceleration structure and its phases (BuildStats), the median of a few
+// builds per mesh, and the time to save it to a file and load it back. The meshes are scaled to the unit cube.
+//
+// usage: mantis_build_benchmark [repetitions [mesh.obj...]]
+#include "mantis.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+void load_obj(const std::string &path, std::vector<std::array<float, 3>> &points,
+              std::vector<std::array<uint32_t, 3>> &triangles) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string prefix;
+        iss >> prefix;
+        if (prefix == "v") {
+            std::array<float, 3> p;
+            iss >> p[0] >> p[1] >> p[2];
+            points.push_back(p);
+        } else if (prefix == "f") {
+            std::array<uint32_t, 3> t;
+            iss >> t[0] >> t[1] >> t[2];
+            triangles.push_back({t[0] - 1, t[1] - 1, t[2] - 1});
+        }
+    }
+
+    // scale to the unit cube
+    std::array<float, 3> lo = points[0], hi = points[0];
+    for (const auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            lo[d] = std::min(lo[d], p[d]);
+            hi[d] = std::max(hi[d], p[d]);
+        }
+    }
+    float scale = 1.f / std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    for (auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            p[d] = (p[d] - 0.5f * (lo[d] + hi[d])) * scale;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int repetitions = argc > 1 ? std::max(1, std::atoi(argv[1])) : 5;
+    std::vector<std::string> meshes(argv + std::min(argc, 2), argv + argc);
+    if (meshes.empty()) {
+        meshes = {"bunny.obj", "fandisk.obj"};
+    }
+
+    for (const auto &mesh: meshes) {
+        std::vector<std::array<float, 3>> points;
+        std::vector<std::array<uint32_t, 3>> triangles;
+        load_obj(std::string(ASSETS_DIR) + mesh, points, triangles);
+
+        // the stats of the build with the median time
+        std::vector<std::pair<double, mantis::BuildStats>> builds;
+        double save_ms = 0.0, load_ms = 0.0;
+        std::string file = (std::filesystem::temp_directory_path() / (mesh + ".mantis")).string();
+        for (int r = 0; r < repetitions; ++r) {
+            auto start = std::chrono::high_resolution_clock::now();
+            mantis::AccelerationStructure accelerator(points, triangles);
+            auto end = std::chrono::high_resolution_clock::now();
+            builds.emplace_back(std::chrono::duration<double, std::milli>(end - start).count(), accelerator.stats());
+            if (r == repetitions - 1) {
+                start = std::chrono::high_resolution_clock::now();
+                accelerator.save(file);
+                end = std::chrono::high_resolution_clock::now();
+                save_ms = std::chrono::duration<double, std::milli>(end - start).count();
+                start = std::chrono::high_resolution_clock::now();
+                auto loaded = mantis::AccelerationStructure::load(file);
+                end = std::chrono::high_resolution_clock::now();
+                load_ms = std::chrono::duration<double, std::milli>(end - start).count();
+            }
+        }
+        size_t file_bytes = std::filesystem::file_size(file);
+        std::filesystem::remove(file);
+        std::sort(builds.begin(), builds.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+        const auto &[build_ms, stats] = builds[builds.size() / 2];
+
+        printf("%s: %zu faces, %zu threads, build %.0f ms (min %.0f, max %.0f)\n", mesh.c_str(), triangles.size(),
+               stats.num_threads, build_ms, builds.front().first, builds.back().first);
+        printf("    delaunay %.1f ms, voronoi cells %.1f ms, faces %.1f ms, edges %.1f ms, packing %.1f ms\n",
+               stats.delaunay_ms, stats.voronoi_cells_ms, stats.face_interceptions_ms, stats.edge_interceptions_ms,
+               stats.packing_ms);
+        printf("    save %.1f ms, load %.1f ms, %.1f MB file\n", save_ms, load_ms, file_bytes / 1e6);
+    }
+}
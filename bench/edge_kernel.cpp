@@ -0,0 +1,31 @@
+// Micro-benchmark of the edge kernel alone. It is compiled together with mantis.cpp so it can reach
+// the internal packet types and kernels. The benchmark itself lives in edge_kernel.inl, which
+// mantis_simd.inl includes next to the kernels of every instruction set mantis is compiled for.
+#include <random>
+#include <chrono>
+
+#define MANTIS_SIMD_EXTENSION "bench/edge_kernel.inl"
+#include "../mantis.cpp"
+
+using namespace mantis;
+
+int main(int, char **) {
+#ifdef MANTIS_KERNELS_NEON
+    neon::benchmark_edge_kernel("NEON");
+#endif
+#ifdef MANTIS_KERNELS_SSE
+    if (is_supported(InstructionSet::SSE)) {
+        sse::benchmark_edge_kernel("SSE");
+    }
+#endif
+#ifdef MANTIS_KERNELS_AVX2
+    if (is_supported(InstructionSet::AVX2)) {
+        avx2::benchmark_edge_kernel("AVX2");
+    }
+#endif
+#ifdef MANTIS_KERNELS_AVX512
+    if (is_supported(InstructionSet::AVX512)) {
+        avx512::benchmark_edge_kernel("AVX512");
+    }
+#endif
+}
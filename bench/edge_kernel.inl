@@ -0,0 +1,102 @@
+// Body of the edge kernel micro-benchmark. Included by mantis_simd.inl once per instruction set, see
+// edge_kernel.cpp.
+
+// The kernel before the reciprocal was precomputed, kept as a baseline.
+inline void closest_edge_div(const PackedEdge<> &pack, float32xN_t dir_len_squared, float32xN_t qx, float32xN_t qy,
+                             float32xN_t qz, float32xN_t &best_d2, int32xN_t &best_idx) {
+    float32xN_t apx = sub(qx, pack.start[0]);
+    float32xN_t apy = sub(qy, pack.start[1]);
+    float32xN_t apz = sub(qz, pack.start[2]);
+
+    float32xN_t t = div(dot(apx, apy, apz, pack.dir[0], pack.dir[1], pack.dir[2]), dir_len_squared);
+
+    maskN_t mask = logical_and(leq(dupf32(0.0f), t), leq(t, dupf32(1.0f)));
+
+    float32xN_t projectedx = fma(t, pack.dir[0], pack.start[0]);
+    float32xN_t projectedy = fma(t, pack.dir[1], pack.start[1]);
+    float32xN_t projectedz = fma(t, pack.dir[2], pack.start[2]);
+
+    float32xN_t d2_line = distance_squared(qx, qy, qz, projectedx, projectedy, projectedz);
+
+    mask = logical_and(mask, leq(d2_line, best_d2));
+    best_d2 = select_float(mask, d2_line, best_d2);
+    best_idx = select_int(mask, pack.primitive_idx, best_idx);
+}
+
+// wrapped in a struct, so std::vector respects the alignment of the simd type
+struct alignas(SimdAlignment) DirLenSquared {
+    float32xN_t value;
+};
+
+// Runs all queries against all packets and returns the elapsed nanoseconds. Written without lambdas
+// taking simd arguments, since those do not pick up the target of the surrounding code on all compilers.
+template<bool Division>
+double time_edge_kernel(const std::vector<PackedEdge<>> &packets, const std::vector<DirLenSquared> &dir_len_squared,
+                        const std::vector<std::array<float, 3>> &queries, float &checksum) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto &q: queries) {
+        float32xN_t qx = dupf32(q[0]);
+        float32xN_t qy = dupf32(q[1]);
+        float32xN_t qz = dupf32(q[2]);
+        float32xN_t best_d2 = dupf32(FLT_MAX);
+        int32xN_t best_idx = dupi32(-1);
+        for (size_t i = 0; i < packets.size(); ++i) {
+            if constexpr (Division) {
+                closest_edge_div(packets[i], dir_len_squared[i].value, qx, qy, qz, best_d2, best_idx);
+            } else {
+                closest_edge(packets[i], qx, qy, qz, best_d2, best_idx);
+            }
+        }
+        checksum += get(best_d2, 0) + float(get(best_idx, SimdWidth - 1));
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void benchmark_edge_kernel(const char *name) {
+    // small enough to stay in L1, so only the arithmetic is measured
+    constexpr size_t num_packets = 32;
+    constexpr size_t num_queries = 1'000'000;
+
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+
+    std::vector<PackedEdge<>> packets(num_packets);
+    std::vector<DirLenSquared> dir_len_squared(num_packets);
+    for (size_t i = 0; i < num_packets; ++i) {
+        for (size_t j = 0; j < SimdWidth; ++j) {
+            float len2 = 0.f;
+            for (size_t d = 0; d < 3; ++d) {
+                float start = dist(gen);
+                float dir = dist(gen);
+                set(packets[i].start[d], j, start);
+                set(packets[i].dir[d], j, dir);
+                len2 += dir * dir;
+            }
+            set(packets[i].inv_dir_len_squared, j, 1.f / len2);
+            set(dir_len_squared[i].value, j, len2);
+            set(packets[i].primitive_idx, j, int(i * SimdWidth + j));
+        }
+    }
+
+    std::vector<std::array<float, 3>> queries(num_queries);
+    for (auto &q: queries) {
+        q = {dist(gen), dist(gen), dist(gen)};
+    }
+
+    printf("%s, simd width: %zu\n", name, SimdWidth);
+#if defined(MANTIS_HAS_FMA) || defined(MANTIS_HAS_AVX512) || defined(MANTIS_HAS_NEON)
+    printf("fused multiply add: yes\n");
+#else
+    printf("fused multiply add: no\n");
+#endif
+
+    const char *kernel_names[2] = {"reciprocal", "division"};
+    for (bool division: {true, false}) {
+        float checksum = 0.f;
+        double ns = division ? time_edge_kernel<true>(packets, dir_len_squared, queries, checksum)
+                             : time_edge_kernel<false>(packets, dir_len_squared, queries, checksum);
+        printf("%s: %f ns per packet, %f ns per edge (checksum %f)\n", kernel_names[division],
+               ns / (num_queries * num_packets), ns / (num_queries * num_packets * SimdWidth), checksum);
+    }
+}
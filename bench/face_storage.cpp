@@ -0,0 +1,104 @@
+// Compares the memory usage and query throughput of the face storages (BuildOptions::face_storage) for every
+// instruction set the cpu supports.
+#include "mantis.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+void load_obj(const std::string &path, std::vector<std::array<float, 3>> &points,
+              std::vector<std::array<uint32_t, 3>> &triangles) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string prefix;
+        iss >> prefix;
+        if (prefix == "v") {
+            std::array<float, 3> p;
+            iss >> p[0] >> p[1] >> p[2];
+            points.push_back(p);
+        } else if (prefix == "f") {
+            std::array<uint32_t, 3> t;
+            iss >> t[0] >> t[1] >> t[2];
+            triangles.push_back({t[0] - 1, t[1] - 1, t[2] - 1});
+        }
+    }
+
+    // scale to the unit cube
+    std::array<float, 3> lo = points[0], hi = points[0];
+    for (const auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            lo[d] = std::min(lo[d], p[d]);
+            hi[d] = std::max(hi[d], p[d]);
+        }
+    }
+    float scale = 1.f / std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    for (auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            p[d] = (p[d] - 0.5f * (lo[d] + hi[d])) * scale;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> meshes = {"bunny.obj", "fandisk.obj", "dragon.obj"};
+    if (argc > 1) {
+        meshes.assign(argv + 1, argv + argc);
+    }
+
+    const size_t n = 1'000'000;
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+    std::vector<std::array<float, 3>> queries(n);
+    for (auto &q: queries) {
+        q = {dist(gen), dist(gen), dist(gen)};
+    }
+
+    const std::pair<mantis::InstructionSet, const char *> instruction_sets[] = {
+            {mantis::InstructionSet::NEON, "NEON"},
+            {mantis::InstructionSet::SSE, "SSE"},
+            {mantis::InstructionSet::AVX2, "AVX2"},
+            {mantis::InstructionSet::AVX512, "AVX512"}};
+
+    const std::pair<mantis::FaceStorage, const char *> face_storages[] = {
+            {mantis::FaceStorage::Packed, "packed"},
+            {mantis::FaceStorage::Shared, "shared"},
+            {mantis::FaceStorage::Compressed, "compressed"}};
+
+    for (const auto &mesh: meshes) {
+        std::vector<std::array<float, 3>> points;
+        std::vector<std::array<uint32_t, 3>> triangles;
+        load_obj(std::string(ASSETS_DIR) + mesh, points, triangles);
+
+        for (auto [instruction_set, name]: instruction_sets) {
+            if (!mantis::is_supported(instruction_set)) {
+                continue;
+            }
+            for (auto [face_storage, storage_name]: face_storages) {
+                mantis::BuildOptions options;
+                options.instruction_set = instruction_set;
+                options.face_storage = face_storage;
+                options.compact = true;
+                mantis::AccelerationStructure accelerator(points, triangles, options);
+
+                float checksum = 0.f;
+                auto start = std::chrono::high_resolution_clock::now();
+                for (const auto &q: queries) {
+                    checksum += accelerator.calc_closest_point(q).distance_squared;
+                }
+                auto end = std::chrono::high_resolution_clock::now();
+                double ns = std::chrono::duration<double, std::nano>(end - start).count() / n;
+
+                printf("%s, %s, %s faces: %.1f MB, %.1f ns per query (checksum %f)\n", mesh.c_str(), name,
+                       storage_name, accelerator.memory_usage() / 1e6, ns, checksum);
+            }
+        }
+    }
+}
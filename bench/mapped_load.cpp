@@ -0,0 +1,158 @@
+// Compares loading a saved acceleration structure (AccelerationStructure::load) with mapping it
+// (AccelerationStructure::map) in several processes at once, like query workers on a host: the startup time of
+// every process and the memory of all processes together. The proportional set size (pss) splits the pages
+// shared by several processes among them, so its sum is the memory the processes occupy together, while the sum
+// of the resident set sizes (rss) counts shared pages once per process.
+//
+// usage: mantis_mapped_load_benchmark [mesh.obj [processes]]
+#include "mantis.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+void load_obj(const std::string &path, std::vector<std::array<float, 3>> &points,
+              std::vector<std::array<uint32_t, 3>> &triangles) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string prefix;
+        iss >> prefix;
+        if (prefix == "v") {
+            std::array<float, 3> p;
+            iss >> p[0] >> p[1] >> p[2];
+            points.push_back(p);
+        } else if (prefix == "f") {
+            std::array<uint32_t, 3> t;
+            iss >> t[0] >> t[1] >> t[2];
+            triangles.push_back({t[0] - 1, t[1] - 1, t[2] - 1});
+        }
+    }
+
+    // scale to the unit cube
+    std::array<float, 3> lo = points[0], hi = points[0];
+    for (const auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            lo[d] = std::min(lo[d], p[d]);
+            hi[d] = std::max(hi[d], p[d]);
+        }
+    }
+    float scale = 1.f / std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    for (auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            p[d] = (p[d] - 0.5f * (lo[d] + hi[d])) * scale;
+        }
+    }
+}
+
+// the rss and pss of a process in kB
+std::pair<size_t, size_t> process_memory(pid_t pid) {
+    std::ifstream file("/proc/" + std::to_string(pid) + "/smaps_rollup");
+    std::string line;
+    size_t rss = 0, pss = 0;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string key;
+        size_t kb = 0;
+        iss >> key >> kb;
+        if (key == "Rss:") {
+            rss = kb;
+        } else if (key == "Pss:") {
+            pss = kb;
+        }
+    }
+    return {rss, pss};
+}
+
+int main(int argc, char **argv) {
+    std::string mesh = argc > 1 ? argv[1] : "fandisk.obj";
+    int num_processes = argc > 2 ? std::max(1, std::atoi(argv[2])) : 8;
+    std::string file = (std::filesystem::temp_directory_path() / (mesh + ".mantis")).string();
+
+    // Built in a child process, forking a process that started the threads of the construction is not safe
+    pid_t builder = fork();
+    if (builder == 0) {
+        std::vector<std::array<float, 3>> points;
+        std::vector<std::array<uint32_t, 3>> triangles;
+        load_obj(std::string(ASSETS_DIR) + mesh, points, triangles);
+        mantis::BuildOptions options;
+        options.compact = true;
+        mantis::AccelerationStructure(points, triangles, options).save(file);
+        _exit(0);
+    }
+    waitpid(builder, nullptr, 0);
+    printf("%s: %.1f MB file, %d processes\n", mesh.c_str(), std::filesystem::file_size(file) / 1e6,
+           num_processes);
+
+    for (bool map: {false, true}) {
+        // the processes report their startup time once their queries ran, then wait until the parent measured
+        // their memory and closes the pipe
+        int ready[2], done[2];
+        if (pipe(ready) != 0 || pipe(done) != 0) {
+            return 1;
+        }
+        std::vector<pid_t> workers;
+        for (int i = 0; i < num_processes; ++i) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(ready[0]);
+                close(done[1]);
+                auto start = std::chrono::high_resolution_clock::now();
+                auto accelerator = map ? mantis::AccelerationStructure::map(file)
+                                       : mantis::AccelerationStructure::load(file);
+                auto end = std::chrono::high_resolution_clock::now();
+                double startup_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+                std::default_random_engine gen(i);
+                std::uniform_real_distribution<float> dist(-0.6f, 0.6f);
+                float checksum = 0.f;
+                for (int q = 0; q < 100'000; ++q) {
+                    checksum += accelerator.calc_closest_point(dist(gen), dist(gen), dist(gen)).distance_squared;
+                }
+                if (checksum < 0.f) {
+                    startup_ms = -1.0;
+                }
+                (void) !write(ready[1], &startup_ms, sizeof(startup_ms));
+                char byte;
+                (void) !read(done[0], &byte, 1);
+                _exit(0);
+            }
+            workers.push_back(pid);
+        }
+        close(ready[1]);
+        close(done[0]);
+
+        std::vector<double> startup_ms(num_processes);
+        for (double &ms: startup_ms) {
+            (void) !read(ready[0], &ms, sizeof(ms));
+        }
+        size_t rss = 0, pss = 0;
+        for (pid_t pid: workers) {
+            auto [process_rss, process_pss] = process_memory(pid);
+            rss += process_rss;
+            pss += process_pss;
+        }
+        close(done[1]);
+        close(ready[0]);
+        for (pid_t pid: workers) {
+            waitpid(pid, nullptr, 0);
+        }
+
+        std::sort(startup_ms.begin(), startup_ms.end());
+        printf("%s: startup median %.2f ms, max %.2f ms, total rss %.1f MB, total pss %.1f MB\n",
+               map ? "map " : "load", startup_ms[startup_ms.size() / 2], startup_ms.back(), rss / 1e3, pss / 1e3);
+    }
+    std::filesystem::remove(file);
+}
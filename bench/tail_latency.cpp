@@ -0,0 +1,138 @@
+// Reports the distribution of the query time, in particular its tail percentiles, and the packets scanned per
+// query with and without the options for long interception lists: steiner sites
+// (BuildOptions::max_interceptions), box trees (BuildOptions::local_tree_threshold) and ordering the lists by
+// volume (BuildOptions::list_order), as well as removing dominated primitives (BuildOptions::remove_dominated).
+//
+// usage: mantis_tail_latency_benchmark [mesh.obj [steiner=<max_interceptions>|tree=<local_tree_threshold>|
+//                                                 order=volume|dominated...]]
+#include "mantis.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+void load_obj(const std::string &path, std::vector<std::array<float, 3>> &points,
+              std::vector<std::array<uint32_t, 3>> &triangles) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string prefix;
+        iss >> prefix;
+        if (prefix == "v") {
+            std::array<float, 3> p;
+            iss >> p[0] >> p[1] >> p[2];
+            points.push_back(p);
+        } else if (prefix == "f") {
+            std::array<uint32_t, 3> t;
+            iss >> t[0] >> t[1] >> t[2];
+            triangles.push_back({t[0] - 1, t[1] - 1, t[2] - 1});
+        }
+    }
+
+    // scale to the unit cube
+    std::array<float, 3> lo = points[0], hi = points[0];
+    for (const auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            lo[d] = std::min(lo[d], p[d]);
+            hi[d] = std::max(hi[d], p[d]);
+        }
+    }
+    float scale = 1.f / std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    for (auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            p[d] = (p[d] - 0.5f * (lo[d] + hi[d])) * scale;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string mesh = argc > 1 ? argv[1] : "fandisk.obj";
+    // the first configuration uses the default options
+    std::vector<mantis::BuildOptions> configurations(1);
+    configurations[0].compact = true;
+    std::vector<std::string> names = {"default"};
+    std::vector<std::string> args(argv + std::min(argc, 2), argv + argc);
+    if (args.empty()) {
+        args = {"steiner=128", "tree=64", "order=volume", "dominated"};
+    }
+    for (const auto &arg: args) {
+        mantis::BuildOptions options = configurations[0];
+        size_t value = std::strtoul(arg.c_str() + arg.find('=') + 1, nullptr, 10);
+        if (arg.rfind("steiner=", 0) == 0) {
+            options.max_interceptions = value;
+        } else if (arg.rfind("tree=", 0) == 0) {
+            options.local_tree_threshold = value;
+        } else if (arg == "order=volume") {
+            options.list_order = mantis::ListOrder::Volume;
+        } else if (arg == "dominated") {
+            options.remove_dominated = true;
+        } else {
+            fprintf(stderr, "unknown configuration %s\n", arg.c_str());
+            return 1;
+        }
+        configurations.push_back(options);
+        names.push_back(arg);
+    }
+
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_obj(std::string(ASSETS_DIR) + mesh, points, triangles);
+
+    // queries close to the surface hit the long lists more often than queries in the whole bounding box
+    const size_t n = 200'000;
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> dist(-0.6f, 0.6f);
+    std::vector<std::array<float, 3>> queries(n);
+    for (auto &q: queries) {
+        q = {dist(gen), dist(gen), dist(gen)};
+    }
+
+    for (size_t c = 0; c < configurations.size(); ++c) {
+        const mantis::BuildOptions &options = configurations[c];
+        auto start = std::chrono::high_resolution_clock::now();
+        mantis::AccelerationStructure accelerator(points, triangles, options);
+        auto end = std::chrono::high_resolution_clock::now();
+        double build_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        // warm up, then time every query on its own
+        float checksum = 0.f;
+        for (size_t i = 0; i < n / 10; ++i) {
+            checksum += accelerator.calc_closest_point(queries[i]).distance_squared;
+        }
+        std::vector<double> ns(n);
+        for (size_t i = 0; i < n; ++i) {
+            start = std::chrono::high_resolution_clock::now();
+            checksum += accelerator.calc_closest_point(queries[i]).distance_squared;
+            end = std::chrono::high_resolution_clock::now();
+            ns[i] = std::chrono::duration<double, std::nano>(end - start).count();
+        }
+        double mean = 0.0;
+        for (double t: ns) {
+            mean += t / n;
+        }
+        std::sort(ns.begin(), ns.end());
+        auto percentile = [&ns](double p) {
+            return ns[std::min(ns.size() - 1, size_t(p * ns.size()))];
+        };
+
+        const mantis::BuildStats &stats = accelerator.stats();
+        mantis::QueryStats query_stats = accelerator.query_stats(queries);
+        printf("%s, %s: build %.0f ms, %zu steiner sites, longest list %zu, %zu interceptions (%zu dominated), "
+               "%zu box trees, %.1f MB\n",
+               mesh.c_str(), names[c].c_str(), build_ms, stats.num_steiner_sites, stats.max_list_length,
+               stats.num_edge_interceptions + stats.num_face_interceptions, stats.num_dominated_interceptions,
+               stats.num_local_tree_sites, accelerator.memory_usage() / 1e6);
+        printf("    ns per query: mean %.0f, p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, p99.99 %.0f (checksum %f)\n",
+               mean, percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), percentile(0.9999),
+               checksum);
+        printf("    %.2f packets scanned per query\n", query_stats.packets_scanned_per_query);
+    }
+}
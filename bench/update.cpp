@@ -0,0 +1,120 @@
+// Compares updating the acceleration structure after moving a patch of vertices (update_positions) with
+// recomputing it, for growing fractions of moved vertices. The patch is the vertices closest to a random vertex,
+// every step moves them by up to 0.2% of the unit cube.
+//
+// usage: mantis_update_benchmark [mesh.obj [fraction...]]
+#include "mantis.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+void load_obj(const std::string &path, std::vector<std::array<float, 3>> &points,
+              std::vector<std::array<uint32_t, 3>> &triangles) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string prefix;
+        iss >> prefix;
+        if (prefix == "v") {
+            std::array<float, 3> p;
+            iss >> p[0] >> p[1] >> p[2];
+            points.push_back(p);
+        } else if (prefix == "f") {
+            std::array<uint32_t, 3> t;
+            iss >> t[0] >> t[1] >> t[2];
+            triangles.push_back({t[0] - 1, t[1] - 1, t[2] - 1});
+        }
+    }
+
+    // scale to the unit cube
+    std::array<float, 3> lo = points[0], hi = points[0];
+    for (const auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            lo[d] = std::min(lo[d], p[d]);
+            hi[d] = std::max(hi[d], p[d]);
+        }
+    }
+    float scale = 1.f / std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    for (auto &p: points) {
+        for (int d = 0; d < 3; ++d) {
+            p[d] = (p[d] - 0.5f * (lo[d] + hi[d])) * scale;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string mesh = argc > 1 ? argv[1] : "fandisk.obj";
+    std::vector<double> fractions;
+    for (int i = 2; i < argc; ++i) {
+        fractions.push_back(std::strtod(argv[i], nullptr));
+    }
+    if (fractions.empty()) {
+        fractions = {0.001, 0.01, 0.05, 0.1, 0.25, 0.5};
+    }
+
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_obj(std::string(ASSETS_DIR) + mesh, points, triangles);
+
+    // the same updates done incrementally and by recomputing everything
+    mantis::BuildOptions incremental;
+    incremental.keep_update_data = true;
+    incremental.max_update_fraction = 1.f;
+    mantis::BuildOptions rebuild;
+    mantis::AccelerationStructure incremental_accelerator(points, triangles, incremental);
+    mantis::AccelerationStructure rebuild_accelerator(points, triangles, rebuild);
+    const std::vector<std::array<float, 3>> positions = incremental_accelerator.get_positions();
+    const size_t num_vertices = positions.size();
+    printf("%s: %zu vertices, %zu faces\n", mesh.c_str(), num_vertices, triangles.size());
+
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> offset(-2e-3f, 2e-3f);
+    const int steps = 3;
+    for (double fraction: fractions) {
+        size_t num_moved = std::max<size_t>(1, std::min(num_vertices, size_t(fraction * num_vertices)));
+        const std::array<float, 3> center = positions[gen() % num_vertices];
+        auto distance_squared = [&center](const std::array<float, 3> &p) {
+            return (p[0] - center[0]) * (p[0] - center[0]) + (p[1] - center[1]) * (p[1] - center[1]) +
+                   (p[2] - center[2]) * (p[2] - center[2]);
+        };
+        std::vector<uint32_t> patch(num_vertices);
+        std::iota(patch.begin(), patch.end(), 0);
+        std::partial_sort(patch.begin(), patch.begin() + (long) num_moved, patch.end(), [&](uint32_t a, uint32_t b) {
+            return distance_squared(positions[a]) < distance_squared(positions[b]);
+        });
+        patch.resize(num_moved);
+
+        // the mean over a few steps
+        mantis::UpdateStats update, recompute;
+        for (int step = 0; step < steps; ++step) {
+            std::vector<std::array<float, 3>> moved;
+            for (uint32_t v: patch) {
+                const std::array<float, 3> &p = incremental_accelerator.get_positions()[v];
+                moved.push_back({p[0] + offset(gen), p[1] + offset(gen), p[2] + offset(gen)});
+            }
+            mantis::UpdateStats u = incremental_accelerator.update_positions(patch, moved);
+            mantis::UpdateStats r = rebuild_accelerator.update_positions(patch, moved);
+            update.num_changed_cells += u.num_changed_cells;
+            update.num_recomputed_faces += u.num_recomputed_faces;
+            update.total_ms += u.total_ms / steps;
+            update.delaunay_ms += u.delaunay_ms / steps;
+            update.interceptions_ms += u.interceptions_ms / steps;
+            update.packing_ms += u.packing_ms / steps;
+            recompute.total_ms += r.total_ms / steps;
+        }
+        printf("%6.3f moved (%zu vertices): %5.1f%% changed cells, %zu faces searched, update %.1f ms "
+               "(delaunay %.1f, interceptions %.1f, packing %.1f), rebuild %.1f ms, speedup %.2fx\n",
+               fraction, num_moved, 100.0 * double(update.num_changed_cells) / double(steps * num_vertices),
+               update.num_recomputed_faces / steps, update.total_ms, update.delaunay_ms, update.interceptions_ms,
+               update.packing_ms, recompute.total_ms, recompute.total_ms / update.total_ms);
+    }
+}
@@ -1,106 +1,206 @@
 #include "mantis.h"
 #include "Delaunay_psm.h"
 
-#include <queue>
+#include <deque>
+#include <list>
+#include <map>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
 #include <numeric>
 #include <thread>
-
-#if defined(__ARM_NEON) || defined(__ARM_NEON__)
-#define MANTIS_HAS_NEON
-#elif defined(__AVX__)
-#define MANTIS_HAS_AVX
-#ifdef __AVX512F__
-#define MANTIS_HAS_AVX512
-#endif
-#else
-#error "Mantis: No SIMD support detected, platform not supported."
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
 #endif
 
-#ifdef MANTIS_HAS_NEON
-#include <arm_neon.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MANTIS_HAS_MMAP
 #endif
 
-#ifdef MANTIS_HAS_AVX
-#include <immintrin.h>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MANTIS_X86
 #endif
 
-//#define DEBUG_MANTIS
+// With MANTIS_RUNTIME_DISPATCH the kernels are compiled for SSE4.1, AVX2 + FMA and AVX512 and the best
+// one supported by the cpu is picked when an acceleration structure is built. Otherwise only the
+// instruction set the compiler targets is used.
+#if defined(MANTIS_RUNTIME_DISPATCH) && defined(MANTIS_X86)
+#define MANTIS_KERNELS_SSE
+#define MANTIS_KERNELS_AVX2
+#define MANTIS_KERNELS_AVX512
+#elif defined(MANTIS_RUNTIME_DISPATCH)
+#undef MANTIS_RUNTIME_DISPATCH
+#endif
 
-#ifdef MANTIS_HAS_NEON
-// float32x4_t and int32x4_t are already defined in arm_neon.h
-using mask4_t = uint32x4_t;
+#ifndef MANTIS_RUNTIME_DISPATCH
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MANTIS_KERNELS_NEON
+#elif defined(__AVX512F__)
+#define MANTIS_KERNELS_AVX512
+#elif defined(__AVX2__)
+#define MANTIS_KERNELS_AVX2
+#elif defined(__AVX__) || defined(__SSE4_1__)
+#define MANTIS_KERNELS_SSE
+#else
+#error "Mantis: No SIMD support detected, platform not supported."
+#endif
 #endif
 
-#ifdef MANTIS_HAS_AVX
-using float32x4_t = __m128;
-using int32x4_t = __m128i;
-using mask4_t = __m128i;
+#ifdef MANTIS_KERNELS_NEON
+#include <arm_neon.h>
 #endif
 
-#ifdef MANTIS_HAS_AVX512
-using float32x16_t = __m512;
-using int32x16_t = __m512i;
-using mask16_t = __mmask16;
+#ifdef MANTIS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #endif
 
-#ifdef MANTIS_HAS_AVX512
-constexpr size_t SimdWidth = 16;
-using float32xN_t = float32x16_t;
-using int32xN_t = int32x16_t;
-using maskN_t = mask16_t;
+// Switches the code generation target for the kernels of an instruction set. MSVC allows intrinsics of
+// any instruction set without changing the target, so there the macros are empty.
+#if defined(MANTIS_RUNTIME_DISPATCH) && defined(__clang__)
+#define MANTIS_BEGIN_TARGET_SSE _Pragma("clang attribute push(__attribute__((target(\"sse4.1\"))), apply_to = function)")
+#define MANTIS_BEGIN_TARGET_AVX2 _Pragma("clang attribute push(__attribute__((target(\"avx2,fma\"))), apply_to = function)")
+#define MANTIS_BEGIN_TARGET_AVX512 _Pragma("clang attribute push(__attribute__((target(\"avx512f,avx2,fma\"))), apply_to = function)")
+#define MANTIS_END_TARGET _Pragma("clang attribute pop")
+#elif defined(MANTIS_RUNTIME_DISPATCH) && defined(__GNUC__)
+#define MANTIS_BEGIN_TARGET_SSE _Pragma("GCC push_options") _Pragma("GCC target(\"sse4.1\")")
+#define MANTIS_BEGIN_TARGET_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2,fma\")")
+#define MANTIS_BEGIN_TARGET_AVX512 _Pragma("GCC push_options") _Pragma("GCC target(\"avx512f,avx2,fma\")")
+#define MANTIS_END_TARGET _Pragma("GCC pop_options")
 #else
-// For both SSE, AVX and NEON
-constexpr size_t SimdWidth = 4;
-using float32xN_t = float32x4_t;
-using int32xN_t = int32x4_t;
-using maskN_t = mask4_t;
+#define MANTIS_BEGIN_TARGET_SSE
+#define MANTIS_BEGIN_TARGET_AVX2
+#define MANTIS_BEGIN_TARGET_AVX512
+#define MANTIS_END_TARGET
 #endif
 
+//#define DEBUG_MANTIS
+
 namespace mantis {
 
 using index_t = GEO::index_t;
 
 // ============================= MISC STRUCTS ===============================
 
-struct PackedEdge {
-    float32xN_t min_x;
-    float32xN_t start[3];
-    float32xN_t dir[3];
-    float32xN_t dir_len_squared;
-    int32xN_t primitive_idx;
+// Single precision bounding box that conservatively contains the interception regions of
+// all primitives in a packet.
+struct PacketBox {
+    float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    void extend(const GEO::vec3 &lo, const GEO::vec3 &hi) {
+        for (int d = 0; d < 3; ++d) {
+            // round outwards, so the box stays conservative
+            lower[d] = std::min(lower[d], std::nextafter((float) lo[d], -FLT_MAX));
+            upper[d] = std::max(upper[d], std::nextafter((float) hi[d], FLT_MAX));
+        }
+    }
+
+    void extend(const GEO::vec3 &p) {
+        extend(p, p);
+    }
+
+    bool contains(float x, float y, float z) const {
+        return x >= lower[0] && y >= lower[1] && z >= lower[2] &&
+               x <= upper[0] && y <= upper[1] && z <= upper[2];
+    }
+
+    // squared distance between q and the box, zero inside
+    float distance_squared(const float q[3]) const {
+        float d2 = 0.f;
+        for (int d = 0; d < 3; ++d) {
+            float t = std::max({lower[d] - q[d], q[d] - upper[d], 0.f});
+            d2 += t * t;
+        }
+        return d2;
+    }
+};
+
+
+// Location of the interception list of a single vertex
+struct PacketRange {
+    // offset of the first edge packet in units of simd vectors
+    size_t offset = 0;
+    // full width packets and 4 lane packets holding the rest of the lists, packed so the range stays
+    // 16 bytes
+    uint32_t num_edge_packets : 24;
+    uint32_t num_edge_tails : 8;
+    uint32_t num_face_packets : 24;
+    uint32_t num_face_tails : 8;
 };
 
-struct PackedFace {
-    float32xN_t min_x;
-    float32xN_t face_plane[4];
-    float32xN_t edge_plane0[4];
-    float32xN_t edge_plane1[4];
-    float32xN_t edge_plane2[4];
-    int32xN_t primitive_idx;
+// Row of the shared face table (FaceStorage::Shared): the face plane followed by the three edge
+// planes bounding the face region. A row fills exactly one cache line.
+struct alignas(64) SharedFace {
+    float planes[4][4];
 };
 
+static_assert(sizeof(SharedFace) == 16 * sizeof(float));
+
+// Converts x, |x| <= 1, to half precision with round to nearest even. Values too small for a normal half are
+// flushed to zero, so decoding never has to deal with denormals. Either way the absolute error is at most 2^-12.
+inline uint16_t float_to_half(float x) {
+    assert(std::abs(x) <= 1.f);
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(float));
+    uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+    if (std::abs(x) < 6.103515625e-05f) {
+        return sign;
+    }
+    uint32_t magnitude = bits & 0x7fffffff;
+    // round away the 13 low bits of the mantissa, a carry correctly propagates into the exponent
+    magnitude += 0xfff + ((magnitude >> 13) & 1);
+    return uint16_t(sign | ((magnitude >> 13) - ((127 - 15) << 10)));
+}
+
 struct FaceData {
     // Plane coefficients of the face plane. Normal is of unit length.
     GEO::vec4 face_plane;
+};
+
+// Planes bounding the region of space whose closest point on the face plane lies inside the face.
+// Only needed during construction.
+struct FaceRegion {
     // Edge plane at index i is the plane that contains the edge opposite to vertex i.
     // Note that edge planes have to be oriented inwards, i.e. the normal is pointing to the
     // inside of the triangle.
     GEO::vec4 clipping_planes[3];
-
-    GEO::vec3 pt_on_plane;
 };
 
 struct EdgeData {
     uint32_t start = uint32_t(-1), end = uint32_t(-1);
+};
+
+// Planes bounding the region of space whose closest point on the edge lies in the interior of the edge.
+// Only needed during construction.
+struct EdgeRegion {
     GEO::vec4 clipping_planes[4];
     int num_planes = 0;
 };
 
 struct BoundingBox {
-    GEO::vec3 lower = GEO::vec3{std::numeric_limits<double>::max()};
-    GEO::vec3 upper = GEO::vec3{-std::numeric_limits<double>::max()};
+    // all three coordinates have to be given, the initializer list constructor of GEO::vec3 leaves
+    // missing ones uninitialized
+    GEO::vec3 lower = GEO::vec3{DBL_MAX, DBL_MAX, DBL_MAX};
+    GEO::vec3 upper = GEO::vec3{-DBL_MAX, -DBL_MAX, -DBL_MAX};
 
     void extend(const GEO::vec3 &pt) {
         lower = {std::min(lower.x, pt.x), std::min(lower.y, pt.y), std::min(lower.z, pt.z)};
@@ -111,592 +211,710 @@ struct BoundingBox {
         extend(box.lower);
         extend(box.upper);
     }
-};
 
-struct Node {
-    float32x4_t minCorners[3]; // x, y, z minimum corners for 4 boxes
-    float32x4_t maxCorners[3]; // x, y, z maximum corners for 4 boxes
-    int32x4_t children;
+    // the boxes of unbounded cells can reach infinity, so the center is clamped to the cube [-limit, limit]^3
+    GEO::vec3 clamped_center(double limit) const {
+        GEO::vec3 center = 0.5 * (lower + upper);
+        for (index_t d = 0; d < 3; ++d) {
+            center[d] = std::isfinite(center[d]) ? std::clamp(center[d], -limit, limit) : 0.0;
+        }
+        return center;
+    }
 };
 
-// ============================= SIMD ===============================
-
-#ifdef MANTIS_HAS_NEON
-
-// a*b + c
-float32x4_t fma(float32x4_t a, float32x4_t b, float32x4_t c) {
-    return vmlaq_f32(c, a, b);
-}
+// A primitive intercepted by a vertex together with the bounding box of the region
+// in which the primitive is closer than the vertex.
+struct Interception {
+    index_t primitive;
+    BoundingBox box;
+    // volume of the voronoi cell clipped to the region of the primitive, which contains the region in
+    // which the primitive is closer
+    double volume = 0.0;
+};
 
-float32x4_t min(float32x4_t a, float32x4_t b) {
-    return vminq_f32(a, b);
-}
+// ============================= UTILS ==================================
 
-float32x4_t max(float32x4_t a, float32x4_t b) {
-    return vmaxq_f32(a, b);
+// Cpus of a NUMA node, read from sysfs. Empty if unknown.
+inline std::vector<int> numa_node_cpus(int node) {
+    std::vector<int> cpus;
+#ifdef __linux__
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string range;
+    // a comma separated list of cpus and ranges of cpus, e.g. 0-3,8-11
+    while (std::getline(file, range, ',')) {
+        int first = 0, last = 0;
+        char dash = 0;
+        std::istringstream iss(range);
+        if (!(iss >> first)) {
+            continue;
+        }
+        last = iss >> dash >> last ? last : first;
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+#else
+    (void) node;
+#endif
+    return cpus;
 }
 
-float32x4_t sub(float32x4_t a, float32x4_t b) {
-    return vsubq_f32(a, b);
+// The cpus the threads of a construction may run on, empty for no restriction
+inline std::vector<int> build_cpus(const BuildOptions &options) {
+    std::vector<int> cpus = options.cpu_affinity;
+    std::sort(cpus.begin(), cpus.end());
+    if (options.numa_node >= 0) {
+        std::vector<int> node_cpus = numa_node_cpus(options.numa_node);
+        if (node_cpus.empty()) {
+            throw std::runtime_error("Mantis: the cpus of the requested NUMA node are unknown.");
+        }
+        if (!cpus.empty()) {
+            std::vector<int> both;
+            std::set_intersection(cpus.begin(), cpus.end(), node_cpus.begin(), node_cpus.end(),
+                                  std::back_inserter(both));
+            node_cpus = both;
+        }
+        if (node_cpus.empty()) {
+            throw std::runtime_error("Mantis: the cpu affinity does not contain cpus of the requested NUMA node.");
+        }
+        cpus = node_cpus;
+    }
+    return cpus;
 }
 
-float32x4_t add(float32x4_t a, float32x4_t b) {
-    return vaddq_f32(a, b);
+// Restricts the calling thread to the cpus, an empty set does not change the affinity. Returns the previous
+// affinity, empty if it was not changed.
+inline std::vector<int> set_thread_affinity(const std::vector<int> &cpus) {
+    std::vector<int> previous;
+    if (cpus.empty()) {
+        return previous;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                previous.push_back(cpu);
+            }
+        }
+    }
+    CPU_ZERO(&set);
+    for (int cpu: cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        throw std::runtime_error("Mantis: the cpu affinity could not be set.");
+    }
+#else
+    throw std::runtime_error("Mantis: cpu affinities are only supported on Linux.");
+#endif
+    return previous;
 }
 
-float32x4_t mul(float32x4_t a, float32x4_t b) {
-    return vmulq_f32(a, b);
-}
+// Restricts the calling thread to the cpus while in scope. Threads started meanwhile inherit the affinity,
+// including the threads of geogram.
+class ScopedAffinity {
+public:
+    explicit ScopedAffinity(const std::vector<int> &cpus) : previous(set_thread_affinity(cpus)) {}
 
-float32x4_t div(float32x4_t a, float32x4_t b) {
-    return vdivq_f32(a, b);
-}
+    ~ScopedAffinity() {
+        set_thread_affinity(previous);
+    }
 
-uint32x4_t leq(float32x4_t a, float32x4_t b) {
-    return vcleq_f32(a, b);
-}
+    ScopedAffinity(const ScopedAffinity &) = delete;
+    ScopedAffinity &operator=(const ScopedAffinity &) = delete;
 
-uint32x4_t geq(float32x4_t a, float32x4_t b) {
-    return vcgeq_f32(a, b);
-}
+private:
+    std::vector<int> previous;
+};
 
-uint32x4_t logical_and(uint32x4_t a, uint32x4_t b) {
-    return vandq_u32(a, b);
-}
+// Work stealing pool behind default_executor(). The chunks of a loop are dealt out in consecutive runs to the
+// queues of the threads, so nearby indices stay on one thread. Every thread works off its own queue from the
+// front and then steals from the back of the other queues, so a few expensive chunks do not stall the loop.
+// Loops started by several threads at once share the queues, every chunk points to the loop it belongs to.
+class ThreadPool final : public Executor {
+public:
+    // The threads of the pool run on the given cpus, if any. The pool leaves the affinity of the calling thread of a
+    // loop alone, the construction and the updates restrict it to the same cpus with ScopedAffinity.
+    explicit ThreadPool(size_t num_threads, const std::vector<int> &cpus = {}) {
+        for (size_t i = 0; i < std::max<size_t>(num_threads, 1); ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        // the calling thread takes the first queue
+        ScopedAffinity affinity(cpus);
+        for (size_t i = 1; i < queues.size(); ++i) {
+            threads.emplace_back([this, i] { work(i); });
+        }
+    }
 
-int32x4_t select_int(int32x4_t condition, int32x4_t trueValue, int32x4_t falseValue) {
-    return vbslq_s32(condition, trueValue, falseValue);
-}
+    ~ThreadPool() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    }
 
-float32x4_t select_float(uint32x4_t condition, float32x4_t trueValue, float32x4_t falseValue) {
-    return vbslq_f32(condition, trueValue, falseValue);
-}
+    void parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t)> &f) override {
+        // loops nested in a loop of this pool and loops of a single chunk run on the calling thread
+        grain = std::max<size_t>(grain, 1);
+        if (current_pool == this || queues.size() == 1 || n <= grain) {
+            if (n > 0) {
+                f(0, n);
+            }
+            return;
+        }
 
-template<int N = SimdWidth>
-float32x4_t dupf32(float x) {
-    static_assert(N == 4);
-    return vdupq_n_f32(x);
-}
+        const ThreadPool *outer_pool = current_pool;
+        current_pool = this;
+        size_t num_chunks = (n + grain - 1) / grain;
+        size_t chunks_per_queue = (num_chunks + queues.size() - 1) / queues.size();
+        Loop loop;
+        loop.body = &f;
+        loop.remaining = num_chunks;
+        for (size_t q = 0; q < queues.size(); ++q) {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            for (size_t c = q * chunks_per_queue; c < std::min((q + 1) * chunks_per_queue, num_chunks); ++c) {
+                queues[q]->chunks.push_back({&loop, c * grain, std::min((c + 1) * grain, n)});
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+        }
+        wake.notify_all();
 
-template<int N = SimdWidth>
-int32x4_t dupi32(int32_t x) {
-    static_assert(N == 4);
-    return vdupq_n_s32(x);
-}
+        // the calling thread works off the queues until its loop is done, chunks of other loops included
+        while (loop.remaining > 0 && run_chunk(0)) {
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&loop] { return loop.remaining == 0; });
+        }
+        current_pool = outer_pool;
+        if (loop.error) {
+            std::rethrow_exception(loop.error);
+        }
+    }
 
-#endif
+    size_t num_threads() const override {
+        return queues.size();
+    }
 
-#ifdef MANTIS_HAS_AVX
+private:
+    // A parallel_for call, which lives on the stack of its calling thread until all its chunks ran
+    struct Loop {
+        const std::function<void(size_t, size_t)> *body = nullptr;
+        std::exception_ptr error;
+        std::atomic<size_t> remaining{0};
+    };
 
-float32x4_t fma(float32x4_t a, float32x4_t b, float32x4_t c) {
-    return _mm_add_ps(_mm_mul_ps(a, b), c); // TODO: check for fma
-}
+    struct Chunk {
+        Loop *loop;
+        size_t begin;
+        size_t end;
+    };
 
-float32x4_t min(float32x4_t a, float32x4_t b) {
-    return _mm_min_ps(a, b);
-}
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
 
-float32x4_t max(float32x4_t a, float32x4_t b) {
-    return _mm_max_ps(a, b);
-}
+    void work(size_t index) {
+        current_pool = this;
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this, seen] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            while (run_chunk(index)) {
+            }
+        }
+    }
 
-float32x4_t sub(float32x4_t a, float32x4_t b) {
-    return _mm_sub_ps(a, b);
-}
+    // Runs a chunk of the own queue, or one stolen from another queue. Returns false if all queues are empty.
+    bool run_chunk(size_t index) {
+        Chunk chunk{};
+        bool found = false;
+        for (size_t i = 0; i < queues.size() && !found; ++i) {
+            Queue &queue = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.chunks.empty()) {
+                if (i == 0) {
+                    chunk = queue.chunks.front();
+                    queue.chunks.pop_front();
+                } else {
+                    chunk = queue.chunks.back();
+                    queue.chunks.pop_back();
+                }
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
 
-float32x4_t add(float32x4_t a, float32x4_t b) {
-    return _mm_add_ps(a, b);
-}
+        Loop &loop = *chunk.loop;
+        try {
+            (*loop.body)(chunk.begin, chunk.end);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!loop.error) {
+                loop.error = std::current_exception();
+            }
+        }
+        // the loop may return as soon as the count drops to zero, so the chunk no longer touches it afterwards
+        if (loop.remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done.notify_all();
+        }
+        return true;
+    }
 
-float32x4_t mul(float32x4_t a, float32x4_t b) {
-    return _mm_mul_ps(a, b);
-}
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
 
-float32x4_t div(float32x4_t a, float32x4_t b) {
-    return _mm_div_ps(a, b);
-}
+    // guards generation and stopping, which wake the threads, and the exceptions of the loops
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    size_t generation = 0;
+    bool stopping = false;
 
-mask4_t leq(float32x4_t a, float32x4_t b) {
-    return _mm_castps_si128(_mm_cmple_ps(a, b)); // Cast result to integer type
-}
+    // the pool whose loop the thread runs: set on the threads of a pool and on a thread waiting for a loop of it.
+    // A loop of another pool still runs in parallel.
+    static thread_local const ThreadPool *current_pool;
+};
 
-mask4_t geq(float32x4_t a, float32x4_t b) {
-    return _mm_castps_si128(_mm_cmpge_ps(a, b)); // Cast result to integer type
-}
+thread_local const ThreadPool *ThreadPool::current_pool = nullptr;
 
-mask4_t logical_and(mask4_t a, mask4_t b) {
-    return _mm_and_si128(a, b);
+Executor &default_executor() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
 }
 
-int32x4_t select_int(int32x4_t condition, int32x4_t trueValue, int32x4_t falseValue) {
-    return _mm_blendv_epi8(falseValue, trueValue, condition);
+std::unique_ptr<Executor> create_thread_pool(size_t num_threads) {
+    return std::make_unique<ThreadPool>(num_threads);
 }
 
-float32x4_t select_float(mask4_t condition, float32x4_t trueValue, float32x4_t falseValue) {
-    __m128 conditionAsFloat = _mm_castsi128_ps(condition);
-    return _mm_blendv_ps(falseValue, trueValue, conditionAsFloat);
+// Calls f(chunk_begin, chunk_end) on chunks of about grain indices covering [begin, end), so every call can set
+// up scratch space for its chunk.
+template<class F>
+void parallel_for_chunks(Executor &executor, size_t begin, size_t end, size_t grain, F f) {
+    if (end <= begin) {
+        return;
+    }
+    executor.parallel_for(end - begin, grain, [begin, &f](size_t chunk_begin, size_t chunk_end) {
+        f(begin + chunk_begin, begin + chunk_end);
+    });
 }
 
-#ifndef MANTIS_HAS_AVX512
-template<int N = SimdWidth>
-auto dupf32(float x) {
-    static_assert(N == 4);
-    return _mm_set1_ps(x);
-}
+template<class F>
+void parallel_for(Executor &executor, size_t begin, size_t end, F f) {
+    // serial implementation
+    //for(size_t i = begin; i < end; ++i) {
+    //    f(i);
+    //}
+    //return;
 
-template<int N = SimdWidth>
-auto dupi32(int32_t x) {
-    static_assert(N == 4);
-    return _mm_set1_epi32(x);
+    // small chunks balance the load, the costs of the indices can differ by orders of magnitude
+    size_t grain = std::max<size_t>(1, (end - begin) / (64 * executor.num_threads()));
+    parallel_for_chunks(executor, begin, end, grain, [&f](size_t chunk_begin, size_t chunk_end) {
+        for (size_t j = chunk_begin; j < chunk_end; ++j) {
+            f(j);
+        }
+    });
 }
-#endif
 
-#endif
-
-#ifdef MANTIS_HAS_AVX512
-
-float32x16_t fma(float32x16_t a, float32x16_t b, float32x16_t c) {
-    return _mm512_fmadd_ps(a, b, c);
-}
+// Sorts the keys and permutes the values along, keeping the order of equal keys. A least significant digit
+// radix sort on bytes, the histograms and the scatters of every pass run in parallel on fixed chunks of the
+// keys. Bytes that are the same in all keys are skipped.
+inline void radix_sort(Executor &executor, std::vector<uint64_t> &keys, std::vector<uint32_t> &values) {
+    const size_t n = keys.size();
+    const size_t num_chunks = std::clamp<size_t>(n / 4096, 1, 4 * executor.num_threads());
+    auto chunk_begin = [n, num_chunks](size_t c) {
+        return n * c / num_chunks;
+    };
 
-float32x16_t min(float32x16_t a, float32x16_t b) {
-    return _mm512_min_ps(a, b);
-}
+    uint64_t key_or = 0, key_and = ~uint64_t(0);
+    for (uint64_t key: keys) {
+        key_or |= key;
+        key_and &= key;
+    }
 
-float32x16_t max(float32x16_t a, float32x16_t b) {
-    return _mm512_max_ps(a, b);
+    std::vector<uint64_t> sorted_keys(n);
+    std::vector<uint32_t> sorted_values(n);
+    std::vector<std::array<size_t, 256>> offsets(num_chunks);
+    for (int shift = 0; shift < 64; shift += 8) {
+        if ((((key_or ^ key_and) >> shift) & 0xff) == 0) {
+            continue;
+        }
+        parallel_for(executor, 0, num_chunks, [&](size_t c) {
+            offsets[c].fill(0);
+            for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i) {
+                ++offsets[c][(keys[i] >> shift) & 0xff];
+            }
+        });
+        // every chunk scatters into its own range of each bucket, after the ranges of the previous chunks
+        size_t offset = 0;
+        for (size_t digit = 0; digit < 256; ++digit) {
+            for (size_t c = 0; c < num_chunks; ++c) {
+                size_t count = offsets[c][digit];
+                offsets[c][digit] = offset;
+                offset += count;
+            }
+        }
+        parallel_for(executor, 0, num_chunks, [&](size_t c) {
+            for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i) {
+                size_t j = offsets[c][(keys[i] >> shift) & 0xff]++;
+                sorted_keys[j] = keys[i];
+                sorted_values[j] = values[i];
+            }
+        });
+        keys.swap(sorted_keys);
+        values.swap(sorted_values);
+    }
 }
 
-float32x16_t sub(float32x16_t a, float32x16_t b) {
-    return _mm512_sub_ps(a, b);
+inline double milliseconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
-float32x16_t add(float32x16_t a, float32x16_t b) {
-    return _mm512_add_ps(a, b);
-}
+// ============================= SERIALIZATION ===============================
 
-float32x16_t mul(float32x16_t a, float32x16_t b) {
-    return _mm512_mul_ps(a, b);
-}
+// Binary files written by AccelerationStructure::save start with a FileHeader, followed by the build options and
+// the mesh, which suffice to rebuild the structure, and then the arrays of the built structure. Every array is
+// its element count followed by its bytes, which start at a multiple of FileAlignment.
+constexpr char FileMagic[8] = {'M', 'A', 'N', 'T', 'I', 'S', '\0', '\0'};
+constexpr uint32_t FileVersion = 2;
+constexpr uint32_t FileByteOrder = 0x01020304;
+constexpr size_t FileAlignment = 64;
 
-float32x16_t div(float32x16_t a, float32x16_t b) {
-    return _mm512_div_ps(a, b);
-}
+struct FileHeader {
+    char magic[8];
+    // FileByteOrder in the byte order of the machine that wrote the file
+    uint32_t byte_order;
+    uint32_t version;
+    // the packed lists depend on the instruction set and the width of the packets, the other arrays on the size
+    // of size_t
+    uint32_t instruction_set;
+    uint32_t simd_width;
+    uint32_t size_t_bytes;
+    uint32_t reserved = 0;
+};
 
-mask16_t leq(float32x16_t a, float32x16_t b) {
-    return _mm512_cmp_ps_mask(a, b, _CMP_LE_OS);
-}
+// A std::vector that can view an array of a memory mapped file instead of owning its elements, see
+// AccelerationStructure::map. The mapping is read only, so the functions modifying the array must not be called
+// on a view. The element pointer is kept up to date, so reading an element costs the same as with std::vector.
+template<class T>
+class MappableVector {
+public:
+    MappableVector() = default;
 
-mask16_t geq(float32x16_t a, float32x16_t b) {
-    return _mm512_cmp_ps_mask(a, b, _CMP_GE_OS);
-}
+    MappableVector(MappableVector &&other) noexcept {
+        *this = std::move(other);
+    }
 
-mask16_t logical_and(mask16_t a, mask16_t b) {
-    return _mm512_kand(a, b);
-}
+    MappableVector &operator=(MappableVector &&other) noexcept {
+        storage = std::move(other.storage);
+        mapping = std::move(other.mapping);
+        elements = mapping ? other.elements : storage.data();
+        count = other.count;
+        other.elements = other.storage.data();
+        other.count = other.storage.size();
+        return *this;
+    }
 
-int32x16_t select_int(mask16_t condition, int32x16_t trueValue, int32x16_t falseValue) {
-    return _mm512_mask_blend_epi32(condition, falseValue, trueValue);
-}
+    // Views n elements at data, mapping keeps them alive
+    void view(const T *data, size_t n, std::shared_ptr<const void> owner) {
+        std::vector<T>().swap(storage);
+        mapping = std::move(owner);
+        elements = const_cast<T *>(data);
+        count = n;
+    }
 
-float32x16_t select_float(mask16_t condition, float32x16_t trueValue, float32x16_t falseValue) {
-    return _mm512_mask_blend_ps(condition, falseValue, trueValue);
-}
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // only owned elements occupy heap memory
+    size_t capacity() const { return storage.capacity(); }
 
-template<int N = SimdWidth>
-auto dupf32(float x) {
+    const T *data() const { return elements; }
+    const T &operator[](size_t i) const { return elements[i]; }
+    const T *begin() const { return elements; }
+    const T *end() const { return elements + count; }
 
-    if constexpr(N == 4) {
-        return _mm_set1_ps(x);
-    } else if constexpr(N == 16) {
-        return _mm512_set1_ps(x);
+    T *data() {
+        assert(!mapping);
+        return elements;
     }
-}
 
-template<int N = SimdWidth>
-auto dupi32(int32_t x) {
-    if constexpr(N == 4) {
-        return _mm_set1_epi32(x);
-    } else if constexpr(N == 16) {
-        return _mm512_set1_epi32(x);
+    T &operator[](size_t i) {
+        assert(!mapping);
+        return elements[i];
     }
-}
 
-void set(float32x16_t &v, size_t i, float x) {
-    assert(i < 16);
-    auto ptr = (float *) &v;
-    ptr[i] = x;
-}
-
-void set(int32x16_t &v, size_t i, int x) {
-    assert(i < 16);
-    auto ptr = (int *) &v;
-    ptr[i] = x;
-}
+    void resize(size_t n) {
+        modify([n](std::vector<T> &v) { v.resize(n); });
+    }
 
-float get(const float32x16_t &v, size_t i) {
-    assert(i < 16);
-    auto ptr = (const float *) &v;
-    return ptr[i];
-}
+    void assign(size_t n, const T &value) {
+        modify([n, &value](std::vector<T> &v) { v.assign(n, value); });
+    }
 
-int get(const int32x16_t &v, size_t i) {
-    assert(i < 16);
-    auto ptr = (const int *) &v;
-    return ptr[i];
-}
+    void clear() {
+        modify([](std::vector<T> &v) { v.clear(); });
+    }
 
-#endif
+    void push_back(const T &value) {
+        modify([&value](std::vector<T> &v) { v.push_back(value); });
+    }
 
-// ============================= SIMD MATH UTILS ===============================
+    template<class... Args>
+    void emplace_back(Args &&... args) {
+        modify([&args...](std::vector<T> &v) { v.emplace_back(std::forward<Args>(args)...); });
+    }
 
-void set(float32x4_t &v, size_t i, float x) {
-    auto ptr = (float *) &v;
-    ptr[i] = x;
-}
+private:
+    template<class F>
+    void modify(F f) {
+        assert(!mapping);
+        f(storage);
+        elements = storage.data();
+        count = storage.size();
+    }
 
-void set(int32x4_t &v, size_t i, int x) {
-    auto ptr = (int *) &v;
-    ptr[i] = x;
-}
+    std::vector<T> storage;
+    std::shared_ptr<const void> mapping;
+    T *elements = nullptr;
+    size_t count = 0;
+};
 
-float get(const float32x4_t &v, size_t i) {
-    auto ptr = (const float *) &v;
-    return ptr[i];
-}
+class BinaryWriter {
+public:
+    explicit BinaryWriter(const std::string &path) : path(path), file(path, std::ios::binary) {
+        if (!file) {
+            throw std::runtime_error("Mantis: cannot open " + path + " for writing.");
+        }
+    }
 
-int get(const int32x4_t &v, size_t i) {
-    auto ptr = (const int *) &v;
-    return ptr[i];
-}
+    void write_bytes(const void *data, size_t size) {
+        file.write(static_cast<const char *>(data), std::streamsize(size));
+        offset += size;
+    }
 
-template<class T>
-T dot(T ax, T ay, T az, T bx, T by, T bz) {
-    T result = mul(ax, bx);
-    result = fma(ay, by, result);
-    result = fma(az, bz, result);
-    return result;
-}
+    template<class T>
+    void write(const T &value) {
+        write_bytes(&value, sizeof(T));
+    }
 
-template<class T>
-T length_squared(T x, T y, T z) {
-    T result = mul(x, x);
-    result = fma(y, y, result);
-    result = fma(z, z, result);
-    return result;
-}
+    // the element count, then the elements starting at a multiple of FileAlignment
+    template<class Vector>
+    void write_array(const Vector &values) {
+        write(uint64_t(values.size()));
+        static const char zeros[FileAlignment] = {};
+        write_bytes(zeros, (FileAlignment - offset % FileAlignment) % FileAlignment);
+        write_bytes(values.data(), values.size() * sizeof(values[0]));
+    }
 
-template<class T>
-T distance_squared(T ax, T ay, T az, T bx, T by, T bz) {
-    T dx = sub(ax, bx);
-    T dy = sub(ay, by);
-    T dz = sub(az, bz);
-    return length_squared(dx, dy, dz);
-}
+    void finish() {
+        file.flush();
+        if (!file) {
+            throw std::runtime_error("Mantis: writing " + path + " failed.");
+        }
+    }
 
-template<class T>
-T eval_plane(T px, T py, T pz, T plane_x, T plane_y, T plane_z, T plane_w) {
-    T result = mul(px, plane_x);
-    result = fma(py, plane_y, result);
-    result = fma(pz, plane_z, result);
-    return add(result, plane_w);
-}
-
-inline float32x4_t p2bbox(const Node &node, const float32x4_t qx, const float32x4_t qy, const float32x4_t qz) {
-    // Compute distances in x, y, z directions and clamp them to zero if they are negative
-    float32x4_t dx = max(sub(node.minCorners[0], qx), sub(qx, node.maxCorners[0]));
-    dx = max(dx, dupf32<4>(0.0f));
-    float32x4_t dy = max(sub(node.minCorners[1], qy), sub(qy, node.maxCorners[1]));
-    dy = max(dy, dupf32<4>(0.0f));
-    float32x4_t dz = max(sub(node.minCorners[2], qz), sub(qz, node.maxCorners[2]));
-    dz = max(dz, dupf32<4>(0.0f));
-    // Compute squared distances for each box
-    float32x4_t squaredDist = length_squared(dx, dy, dz);
-    return squaredDist;
-}
-
-// ============================= BVH ===============================
-
-struct LeafNode {
-    float32xN_t x_coords = dupf32(FLT_MAX);
-    float32xN_t y_coords = dupf32(FLT_MAX);
-    float32xN_t z_coords = dupf32(FLT_MAX);
-    int32xN_t indices = dupi32(-1);
+private:
+    std::string path;
+    std::ofstream file;
+    size_t offset = 0;
 };
 
-#define cmin(a, b) get(distances,a) > get(distances,b) ? b : a
-#define cmax(a, b) get(distances,a) > get(distances,b) ? a : b
-
-#define cswap(a, b)  \
-    {int tmp = a;    \
-    a = cmax(a,b);   \
-    b = cmin(tmp, b);}
-
-#define nsort4(a, b, c, d) \
-    do                     \
-    {                      \
-        cswap(a, b);       \
-        cswap(c, d);       \
-        cswap(a, c);       \
-        cswap(b, d);       \
-        cswap(b, c);       \
-    } while (0)
-
-
-constexpr static long long NUM_PACKETS = 8;
-
-class Bvh {
+// Reads a file written by BinaryWriter, from a stream or, if map is set and the system supports it, from a read
+// only memory mapping of the whole file
+class BinaryReader {
 public:
-    void updateClosestPoint(const float32xN_t &pt_x,
-                            const float32xN_t &pt_y,
-                            const float32xN_t &pt_z,
-                            size_t firstPacket,
-                            size_t numPackets,
-                            float &bestDistSq,
-                            int &bestIdx) const {
-        float32xN_t minDist = dupf32(bestDistSq);
-        int32xN_t minIdx = dupi32(bestIdx);
-
-        for (size_t i = firstPacket; i < firstPacket + numPackets; ++i) {
-            // Compute squared distances for a batch of SimdWidth points
-            const auto &leaf = m_leaves[i];
-            float32xN_t dx = sub(pt_x, leaf.x_coords);
-            float32xN_t dy = sub(pt_y, leaf.y_coords);
-            float32xN_t dz = sub(pt_z, leaf.z_coords);
-            float32xN_t distSq = length_squared(dx, dy, dz);
-
-            // Comparison mask for distances
-            // if distSq >= minDist => keep minDist
-            maskN_t keepMinDist = geq(distSq, minDist);
-            minDist = min(minDist, distSq);
-
-            // Update the indices
-            minIdx = select_int(keepMinDist, minIdx, leaf.indices);
-        }
-
-        // Find overall minimum distance and index
-        for (int j = 0; j < SimdWidth; ++j) {
-            if (get(minDist, j) < bestDistSq) {
-                bestDistSq = get(minDist, j);
-                bestIdx = get(minIdx, j);
+    explicit BinaryReader(const std::string &path, bool map = false) : path(path) {
+#ifdef MANTIS_HAS_MMAP
+        if (map) {
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat status{};
+            if (fd < 0 || fstat(fd, &status) != 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                throw std::runtime_error("Mantis: cannot open " + path + ".");
             }
+            size = size_t(status.st_size);
+            void *data = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+            check(data != MAP_FAILED);
+            size_t mapped_size = size;
+            mapping = std::shared_ptr<const char>(static_cast<const char *>(data), [mapped_size](const char *p) {
+                munmap(const_cast<char *>(p), mapped_size);
+            });
+            return;
+        }
+#endif
+        (void) map;
+        file.open(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Mantis: cannot open " + path + ".");
         }
+        file.seekg(0, std::ios::end);
+        size = size_t(file.tellg());
+        file.seekg(0);
     }
 
-    explicit Bvh(const std::vector<GEO::vec3> &points) {
-        // Initialize the original_points vector
-        original_points.resize(points.size());
-        for (size_t i = 0; i < points.size(); ++i) {
-            original_points[i] = points[i];
+    // Throws unless the condition holds, for checking the values read
+    void check(bool condition) const {
+        if (!condition) {
+            throw std::runtime_error("Mantis: " + path + " is not a valid acceleration structure file.");
         }
-
-        // Create an index array for all points
-        std::vector<int> indices(points.size());
-        std::iota(indices.begin(), indices.end(), 0);
-
-        // Build the KD-tree
-        BoundingBox box;
-        int node_idx = constructTree(indices, 0, indices.size(), 0, box);
-        assert(node_idx == 0 || node_idx < 0);
     }
 
-    std::pair<int, float> closestPoint(const GEO::vec3 &q) const {
-        constexpr int MAX_STACK_SIZE = 64;
-        struct StackNode {
-            int nodeIndex;
-            float minDistSq;
-        };
-        StackNode stack[MAX_STACK_SIZE];
-        int stackSize = 0;
-
-        float bestDistSq = std::numeric_limits<float>::max();
-        int bestIdx = -1;
-
-        // Broadcast query point coordinates to SIMD size
-        float32x4_t q_x4 = dupf32<4>(q.x);
-        float32x4_t q_y4 = dupf32<4>(q.y);
-        float32x4_t q_z4 = dupf32<4>(q.z);
-
-        float32xN_t q_xN = dupf32(q.x);
-        float32xN_t q_yN = dupf32(q.y);
-        float32xN_t q_zN = dupf32(q.z);
-
-        // Start with the root node
-        stack[stackSize++] = {0, 0.0f};
-        if (m_nodes.empty()) {
-            stack[0].nodeIndex = -1;
+    void read_bytes(void *data, size_t n) {
+        check(n <= size - offset);
+        if (mapping) {
+            std::memcpy(data, mapping.get() + offset, n);
+        } else {
+            file.read(static_cast<char *>(data), std::streamsize(n));
+            check(bool(file));
         }
+        offset += n;
+    }
 
-        while (stackSize > 0) {
-            StackNode current = stack[--stackSize];
-            if (current.minDistSq >= bestDistSq) {
-                continue;  // Skip nodes that can't possibly contain a closer point
-            }
-            if (current.nodeIndex < 0) {
-                auto [begin, numPackets] = m_leafRange[-(current.nodeIndex + 1)];
-                updateClosestPoint(q_xN, q_yN, q_zN, begin, numPackets, bestDistSq, bestIdx);
-                continue;
-            }
-
-            const Node &node = m_nodes[current.nodeIndex];
-
-            // Compute distances to each child
-            float32x4_t distances = p2bbox(node, q_x4, q_y4, q_z4);
-            int childIndices[4] = {0, 1, 2, 3};
+    // Reads a scalar, swapping its bytes if the file was written with the other byte order
+    template<class T>
+    T read() {
+        T value;
+        read_bytes(&value, sizeof(T));
+        swap(&value, sizeof(T), sizeof(T));
+        return value;
+    }
 
-            // Sort children by distance
-            nsort4(childIndices[0], childIndices[1], childIndices[2], childIndices[3]);
+    // Reads an array written by BinaryWriter::write_array. The bytes of the elements are swapped in units of
+    // Scalar if the file was written with the other byte order, the default char leaves them as they are.
+    template<class Scalar = char, class Vector>
+    void read_array(Vector &values) {
+        size_t n = begin_array(sizeof(values[0]));
+        values.resize(n);
+        read_bytes(values.data(), n * sizeof(values[0]));
+        swap(values.data(), n * sizeof(values[0]), sizeof(Scalar));
+    }
 
-            // push children that are internal
-            for (int idx: childIndices) {
-                int childIdx = get(node.children, idx);
-                float childDist = get(distances, idx);
-                if (childDist < bestDistSq) {
-                    assert(stackSize + 1 < MAX_STACK_SIZE);
-                    stack[stackSize++] = {childIdx, childDist};
-                }
-            }
+    // Like read_array, but a mapped file is not copied, the array views it instead
+    template<class T>
+    void map_array(MappableVector<T> &values) {
+        if (!mapping) {
+            read_array(values);
+            return;
         }
-
-        return {bestIdx, bestDistSq};
+        check(!swap_bytes);
+        size_t n = begin_array(sizeof(T));
+        const char *data = mapping.get() + offset;
+        check(reinterpret_cast<uintptr_t>(data) % alignof(T) == 0);
+        values.view(reinterpret_cast<const T *>(data), n, mapping);
+        offset += n * sizeof(T);
     }
 
-private:
-    std::vector<GEO::vec3> original_points;
+    // the file was written on a machine with the other byte order
+    bool swap_bytes = false;
 
-    std::vector<Node> m_nodes;
-    std::vector<LeafNode> m_leaves;
-    std::vector<std::pair<int, int>> m_leafRange;
+    const std::string path;
 
-    int constructTree(std::vector<int> &indices, size_t begin, size_t end, size_t depth, BoundingBox &box) {
-        if (end - begin <= NUM_PACKETS * SimdWidth) {
-            // Update the bounding box for this leaf node
-            box = BoundingBox();
-            for (size_t i = begin; i < end; ++i) {
-                int idx = indices[i];
-                box.extend(original_points[idx]);
-            }
+private:
+    // reads the element count of an array and skips to its elements
+    size_t begin_array(size_t element_size) {
+        uint64_t n = read<uint64_t>();
+        check(n <= (size - offset) / element_size);
+        skip((FileAlignment - offset % FileAlignment) % FileAlignment);
+        check(n <= (size - offset) / element_size);
+        return size_t(n);
+    }
 
-            int leafIdx = int(m_leafRange.size());
-            auto firstLeaf = int(m_leaves.size());
-            auto numPackets = int((end - begin + SimdWidth - 1) / SimdWidth);
-            m_leafRange.emplace_back(firstLeaf, numPackets);
-
-            for (int i = 0; i < numPackets; ++i) {
-                LeafNode leaf{};
-                for (size_t j = 0; j < SimdWidth; ++j) {
-                    size_t k = i * SimdWidth + j;
-                    if (k < end - begin) {
-                        set(leaf.x_coords, j, (float) original_points[indices[begin + k]].x);
-                        set(leaf.y_coords, j, (float) original_points[indices[begin + k]].y);
-                        set(leaf.z_coords, j, (float) original_points[indices[begin + k]].z);
-                        set(leaf.indices, j, (int) indices[begin + k]);
-                    }
-                }
-                m_leaves.push_back(leaf);
-            }
+    void skip(size_t n) {
+        check(n <= size - offset);
+        if (!mapping) {
+            file.seekg(std::streamoff(n), std::ios::cur);
+        }
+        offset += n;
+    }
 
-            // Return negative index to indicate leaf node
-            return -(leafIdx + 1);
+    void swap(void *data, size_t num_bytes, size_t scalar_size) const {
+        if (!swap_bytes || scalar_size == 1) {
+            return;
         }
+        auto *bytes = static_cast<char *>(data);
+        for (size_t i = 0; i + scalar_size <= num_bytes; i += scalar_size) {
+            std::reverse(bytes + i, bytes + i + scalar_size);
+        }
+    }
 
-        Node node{};
+    std::ifstream file;
+    std::shared_ptr<const char> mapping;
+    size_t size = 0;
+    size_t offset = 0;
+};
 
-        // Split dimensions: Choose different dimensions for each split
-        size_t primaryDim = depth % 3;
-        size_t secondaryDim = (primaryDim + 1) % 3; // Choose next dimension for secondary split
+void write_file_header(BinaryWriter &out, InstructionSet instruction_set, size_t simd_width) {
+    FileHeader header{};
+    std::memcpy(header.magic, FileMagic, sizeof(FileMagic));
+    header.byte_order = FileByteOrder;
+    header.version = FileVersion;
+    header.instruction_set = uint32_t(instruction_set);
+    header.simd_width = uint32_t(simd_width);
+    header.size_t_bytes = sizeof(size_t);
+    out.write(header);
+}
+
+// The options needed to rebuild the structure, without the threads to build it with
+void write_build_options(BinaryWriter &out, const BuildOptions &options) {
+    out.write(double(options.limit_cube_len));
+    out.write(uint32_t(options.compact));
+    out.write(uint32_t(options.face_storage));
+    out.write(uint64_t(options.max_interceptions));
+    out.write(int32_t(options.max_steiner_rounds));
+    out.write(uint64_t(options.local_tree_threshold));
+    out.write(uint32_t(options.list_order));
+    out.write(uint32_t(options.remove_dominated));
+    out.write(uint64_t(options.cell_memory_budget));
+    out.write(uint32_t(options.vertex_centric_build));
+    out.write(uint32_t(options.keep_update_data));
+    out.write(double(options.max_update_fraction));
+}
+
+void read_build_options(BinaryReader &in, BuildOptions &options) {
+    options.limit_cube_len = float(in.read<double>());
+    options.compact = in.read<uint32_t>();
+    options.face_storage = FaceStorage(in.read<uint32_t>());
+    options.max_interceptions = in.read<uint64_t>();
+    options.max_steiner_rounds = in.read<int32_t>();
+    options.local_tree_threshold = in.read<uint64_t>();
+    options.list_order = ListOrder(in.read<uint32_t>());
+    options.remove_dominated = in.read<uint32_t>();
+    options.cell_memory_budget = in.read<uint64_t>();
+    options.vertex_centric_build = in.read<uint32_t>();
+    options.keep_update_data = in.read<uint32_t>();
+    options.max_update_fraction = float(in.read<double>());
+    in.check(options.face_storage <= FaceStorage::Compressed && options.list_order <= ListOrder::Volume);
+}
 
-        // Primary split
-        size_t primarySplit = (begin + end) / 2;
-        std::nth_element(indices.begin() + (long) begin, indices.begin() + (long) primarySplit,
-                         indices.begin() + (long) end,
-                         [primaryDim, this](int i1, int i2) {
-                             return original_points[i1][primaryDim] < original_points[i2][primaryDim];
-                         });
+// ============================= GEOMETRY UTILS ===============================
 
-        // Secondary splits
-        size_t secondarySplit1 = (begin + primarySplit) / 2;
-        size_t secondarySplit2 = (primarySplit + end) / 2;
-
-        std::nth_element(indices.begin() + (long) begin, indices.begin() + (long) secondarySplit1,
-                         indices.begin() + (long) primarySplit,
-                         [secondaryDim, this](int i1, int i2) {
-                             return original_points[i1][secondaryDim] < original_points[i2][secondaryDim];
-                         });
-
-        std::nth_element(indices.begin() + (long) primarySplit, indices.begin() + (long) secondarySplit2,
-                         indices.begin() + (long) end,
-                         [secondaryDim, this](int i1, int i2) {
-                             return original_points[i1][secondaryDim] < original_points[i2][secondaryDim];
-                         });
-
-        BoundingBox childBoxes[4] = {};
-
-        auto node_idx = int(m_nodes.size());
-        m_nodes.emplace_back();
-
-        set(node.children, 0, constructTree(indices, begin, secondarySplit1, depth + 2, childBoxes[0]));
-        set(node.children, 1, constructTree(indices, secondarySplit1, primarySplit, depth + 2, childBoxes[1]));
-        set(node.children, 2, constructTree(indices, primarySplit, secondarySplit2, depth + 2, childBoxes[2]));
-        set(node.children, 3, constructTree(indices, secondarySplit2, end, depth + 2, childBoxes[3]));
-
-        // set bounding boxes of node
-        for (int i = 0; i < 3; ++i) {
-            for (int j = 0; j < 4; ++j) {
-                set(node.minCorners[i], j, (float) childBoxes[j].lower[i]);
-                set(node.maxCorners[i], j, (float) childBoxes[j].upper[i]);
-            }
-        }
-
-        // Combine bounding boxes from children
-        box = childBoxes[0];
-        for (int i = 1; i < 4; ++i) {
-            box.extend(childBoxes[i]);
-        }
-
-        m_nodes[node_idx] = node;
-        return node_idx;
-    }
-};
-
-// ============================= UTILS ==================================
-
-template<class F>
-void parallel_for(size_t begin, size_t end, F f) {
-    // serial implementation
-    //for(size_t i = begin; i < end; ++i) {
-    //    f(i);
-    //}
-    //return;
-
-    size_t num_threads = std::thread::hardware_concurrency();
-
-    std::vector<std::thread> threads;
-    threads.reserve(num_threads);
-
-    size_t chunk_size = (end - begin + num_threads - 1) / num_threads;
-
-    for (size_t i = 0; i < num_threads; ++i) {
-        size_t thread_begin = begin + i * chunk_size;
-        size_t thread_end = std::min(thread_begin + chunk_size, end);
-
-        threads.emplace_back([thread_begin, thread_end, &f]() {
-            for (size_t j = thread_begin; j < thread_end; ++j) {
-                f(j);
-            }
-        });
-    }
-
-    for (auto &thread: threads) {
-        thread.join();
-    }
-}
-
-// ============================= GEOMETRY UTILS ===============================
-
-GEO::vec4 to_vec4(GEO::vec3 v, double w) {
-    return {v.x, v.y, v.z, w};
-}
+GEO::vec4 to_vec4(GEO::vec3 v, double w) {
+    return {v.x, v.y, v.z, w};
+}
 
 GEO::vec3 to_vec3(GEO::vec4 v) {
     return {v.x, v.y, v.z};
@@ -721,10 +939,10 @@ double distance_to_plane_squared(GEO::vec3 p, GEO::vec4 plane) {
     return d * d;
 }
 
+// assumes the plane normal is unit length
 GEO::vec3 project_plane(GEO::vec3 p, const FaceData &face) {
     GEO::vec3 normal = to_vec3(face.face_plane);
-    GEO::vec3 pt_on_plane = face.pt_on_plane;
-    return p - GEO::dot(normal, p - pt_on_plane) * normal;
+    return p - eval_plane(face.face_plane, p) * normal;
 }
 
 GEO::vec3 project_line(GEO::vec3 p, GEO::vec3 a, GEO::vec3 b) {
@@ -733,8 +951,29 @@ GEO::vec3 project_line(GEO::vec3 p, GEO::vec3 a, GEO::vec3 b) {
     return a + ab * (GEO::dot(ap, ab) / GEO::dot(ab, ab));
 }
 
+double distance_to_segment_squared(GEO::vec3 p, GEO::vec3 a, GEO::vec3 b) {
+    GEO::vec3 ab = b - a;
+    double t = std::clamp(GEO::dot(p - a, ab) / GEO::dot(ab, ab), 0.0, 1.0);
+    return GEO::distance2(p, a + t * ab);
+}
+
+// squared distance between p and the triangle abc, including its edges and vertices
+double distance_to_triangle_squared(GEO::vec3 p, GEO::vec3 a, GEO::vec3 b, GEO::vec3 c) {
+    GEO::vec3 n = GEO::cross(b - a, c - a);
+    double n2 = GEO::dot(n, n);
+    if (n2 > 0.0 && GEO::dot(GEO::cross(b - a, p - a), n) >= 0.0 && GEO::dot(GEO::cross(c - b, p - b), n) >= 0.0 &&
+        GEO::dot(GEO::cross(a - c, p - c), n) >= 0.0) {
+        double d = GEO::dot(p - a, n);
+        return d * d / n2;
+    }
+    return std::min({distance_to_segment_squared(p, a, b), distance_to_segment_squared(p, b, c),
+                     distance_to_segment_squared(p, c, a)});
+}
+
+// Returns the point where the segment from A (closer to the element than to p) to B (closer to p) crosses the
+// bisector of p and the element, by bisection up to a tolerance of 1e-5
 template<class F>
-inline GEO::vec3 intersect(GEO::vec3 A, GEO::vec3 B, GEO::vec3 p, F dist_to_element_squared) {
+inline GEO::vec3 intersect_by_bisection(GEO::vec3 A, GEO::vec3 B, GEO::vec3 p, F dist_to_element_squared) {
     const double tol = 1e-5;
     double l(0), r(1), m;
     GEO::vec3 cur;
@@ -749,6 +988,44 @@ inline GEO::vec3 intersect(GEO::vec3 A, GEO::vec3 B, GEO::vec3 p, F dist_to_elem
     return (1 - l) * B + l * A;
 }
 
+// Like intersect_by_bisection, but in closed form. The squared distances to the planes and lines of the
+// primitives are quadratic, so along the segment the difference of the squared distances to p and to the
+// element is a quadratic polynomial in the segment parameter, which is recovered from three samples. Falls back
+// to bisection if no root is found in the segment due to rounding.
+template<class F>
+inline GEO::vec3 intersect(GEO::vec3 A, GEO::vec3 B, GEO::vec3 p, F dist_to_element_squared) {
+    auto g = [&](GEO::vec3 x) {
+        return GEO::distance2(x, p) - dist_to_element_squared(x);
+    };
+    // g(B + t (A - B)) = a t^2 + b t + c with c <= 0 and a + b + c > 0
+    double g0 = g(B), g_half = g(0.5 * (A + B)), g1 = g(A);
+    // A lies on the bisector up to rounding, or the segment runs along it. Then any point is a crossing, and A
+    // keeps the box tight.
+    if (g1 <= 1e-12 * (GEO::distance2(A, p) + GEO::distance2(B, p))) {
+        return A;
+    }
+    double a = 2.0 * (g0 + g1) - 4.0 * g_half;
+    double b = g1 - g0 - a;
+    double c = g0;
+
+    // the numerically stable roots q / a and c / q
+    double t = -1.0;
+    double discriminant = b * b - 4.0 * a * c;
+    if (discriminant >= 0.0) {
+        double q = -0.5 * (b + std::copysign(std::sqrt(discriminant), b));
+        for (double root: {q != 0.0 ? c / q : -1.0, a != 0.0 ? q / a : -1.0}) {
+            if (root >= 0.0 && root <= 1.0) {
+                t = root;
+                break;
+            }
+        }
+    }
+    if (t < 0.0) {
+        return intersect_by_bisection(A, B, p, dist_to_element_squared);
+    }
+    return (1 - t) * B + t * A;
+}
+
 // squared distance between a point and the straight line of an edge
 inline double dis2_p2e(const GEO::vec3 &p, const EdgeData &e, const std::vector<GEO::vec3> &points) {
     GEO::vec3 dir = GEO::normalize(points[e.end] - points[e.start]);
@@ -757,8 +1034,7 @@ inline double dis2_p2e(const GEO::vec3 &p, const EdgeData &e, const std::vector<
 
 // squared distance between a point and the plane of a face
 inline double dis2_p2f(const GEO::vec3 &p, const FaceData &f) {
-    //double d = f.n.dot(points[f.verts.x()] - p);
-    double d = GEO::dot(to_vec3(f.face_plane), f.pt_on_plane - p);
+    double d = eval_plane(f.face_plane, p);
     return d * d;
 }
 
@@ -829,32 +1105,381 @@ bool check_and_create_bounding_box(
 
 // ============================= DISTANCE TO MESH ===============================
 
+// Interception lists of all vertices, stored back to back. The lists of vertex v are
+// edges[edge_offsets[v], edge_offsets[v + 1]) and faces[face_offsets[v], face_offsets[v + 1]), each
+// sorted by the lower x coordinate of the bounding boxes. Only needed during construction.
+struct InterceptionLists {
+    std::vector<size_t> edge_offsets;
+    std::vector<size_t> face_offsets;
+    std::vector<Interception> edges;
+    std::vector<Interception> faces;
+};
+
+// Sorts the lists of site v by the lower x coordinate of the boxes, so queries can stop scanning early. Many boxes
+// start at the limit cube, the primitive index breaks the ties so the order does not depend on the build.
+inline void sort_site_lists(InterceptionLists &lists, index_t v) {
+    auto by_min_x = [](const Interception &a, const Interception &b) {
+        return a.box.lower.x < b.box.lower.x || (a.box.lower.x == b.box.lower.x && a.primitive < b.primitive);
+    };
+    std::sort(lists.edges.begin() + (long) lists.edge_offsets[v],
+              lists.edges.begin() + (long) lists.edge_offsets[v + 1], by_min_x);
+    std::sort(lists.faces.begin() + (long) lists.face_offsets[v],
+              lists.faces.begin() + (long) lists.face_offsets[v + 1], by_min_x);
+}
+
+// Reorders a list so that every consecutive group of group_size interceptions covers a small region: the list
+// is split recursively along the widest extent of the box centers, always at a multiple of group_size.
+inline void sort_spatially(Interception *list, size_t n, size_t group_size, double limit) {
+    if (n <= group_size) {
+        return;
+    }
+    BoundingBox centers;
+    for (size_t i = 0; i < n; ++i) {
+        centers.extend(list[i].box.clamped_center(limit));
+    }
+    GEO::vec3 extent = centers.upper - centers.lower;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+    size_t mid = (n / group_size + 1) / 2 * group_size;
+    std::nth_element(list, list + mid, list + n, [axis, limit](const Interception &a, const Interception &b) {
+        return a.box.clamped_center(limit)[axis] < b.box.clamped_center(limit)[axis];
+    });
+    sort_spatially(list, mid, group_size, limit);
+    sort_spatially(list + mid, n - mid, group_size, limit);
+}
+
+// Reorders the indices of the points so that consecutive points are close to each other, splitting them
+// recursively at the median of their widest extent.
+inline void sort_spatially(index_t *order, size_t n, const std::vector<GEO::vec3> &points) {
+    if (n <= 1) {
+        return;
+    }
+    BoundingBox box;
+    for (size_t i = 0; i < n; ++i) {
+        box.extend(points[order[i]]);
+    }
+    GEO::vec3 extent = box.upper - box.lower;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+    size_t mid = n / 2;
+    std::nth_element(order, order + mid, order + n, [axis, &points](index_t a, index_t b) {
+        return points[a][axis] < points[b][axis];
+    });
+    sort_spatially(order, mid, points);
+    sort_spatially(order + mid, n - mid, points);
+}
+
+// approximate heap memory of a convex cell
+inline size_t convex_cell_bytes(const GEO::ConvexCell &C) {
+    return sizeof(GEO::ConvexCell) +
+           C.max_t() * (sizeof(VBW::TriangleWithFlags) + sizeof(VBW::Triangle) + sizeof(GEO::vec3) + 1) +
+           C.max_v() * (sizeof(GEO::vec4) + sizeof(VBW::ushort) + 1 + sizeof(VBW::global_index_t));
+}
+
+// The voronoi cells of one thread, computed on demand from the delaunay triangulation. The least recently
+// used cells are evicted once the cached cells exceed the budget, but at least min_cells are kept: the searches
+// of neighboring primitives share far more cells than a small budget holds, and would recompute them over and
+// over.
+class CellCache {
+public:
+    static constexpr size_t min_cells = 1024;
+
+    CellCache(const GEO::PeriodicDelaunay3d &delaunay, size_t budget) : delaunay(delaunay), budget(budget) {}
+
+    // The returned cell stays valid until the next call
+    const GEO::ConvexCell &get(index_t site) {
+        auto it = index.find(site);
+        if (it != index.end()) {
+            cells.splice(cells.begin(), cells, it->second);
+            return cells.front().cell;
+        }
+
+        cells.emplace_front();
+        Entry &entry = cells.front();
+        entry.site = site;
+        delaunay.copy_Laguerre_cell_from_Delaunay(site, entry.cell, W);
+        entry.cell.compute_geometry();
+        entry.bytes = convex_cell_bytes(entry.cell);
+        index[site] = cells.begin();
+        bytes += entry.bytes;
+        num_computed++;
+
+        while (bytes > budget && cells.size() > min_cells) {
+            bytes -= cells.back().bytes;
+            index.erase(cells.back().site);
+            cells.pop_back();
+        }
+        peak_bytes = std::max(peak_bytes, bytes);
+        return cells.front().cell;
+    }
+
+    size_t peak_bytes = 0;
+    size_t num_computed = 0;
+
+private:
+    struct Entry {
+        index_t site = 0;
+        GEO::ConvexCell cell;
+        size_t bytes = 0;
+    };
+
+    const GEO::PeriodicDelaunay3d &delaunay;
+    size_t budget;
+    size_t bytes = 0;
+    // most recently used first
+    std::list<Entry> cells;
+    std::unordered_map<index_t, std::list<Entry>::iterator> index;
+    GEO::PeriodicDelaunay3d::IncidentTetrahedra W;
+};
+
+// Scratch space of the searches for the sites intercepting a primitive, reused by the searches of a thread so
+// they do not allocate.
+struct SearchScratch {
+    // the sites with visited[v] == epoch are visited by the current search
+    std::vector<uint32_t> visited;
+    uint32_t epoch = 0;
+    // the queue of the breadth first search, sites before head are popped
+    std::vector<index_t> queue;
+    size_t head = 0;
+    GEO::vector<index_t> neighbors;
+    // the copy of a voronoi cell that is clipped, keeps the capacity of its buffers between copies
+    GEO::ConvexCell cell;
+    // the primitives a site tests in a round of the vertex centric build
+    std::vector<index_t> candidates;
+
+    void begin_search(size_t nb_sites) {
+        if (visited.size() < nb_sites) {
+            visited.assign(nb_sites, 0);
+            epoch = 0;
+        }
+        if (++epoch == 0) {
+            std::fill(visited.begin(), visited.end(), 0);
+            epoch = 1;
+        }
+        queue.clear();
+        head = 0;
+    }
+
+    // adds the site to the queue unless the search visited it already
+    void visit(index_t v) {
+        if (visited[v] != epoch) {
+            visited[v] = epoch;
+            queue.push_back(v);
+        }
+    }
+};
+
+// Keeps the candidates that are not in tested, sorted and without duplicates, and adds them to tested.
+// tested is sorted and stays sorted.
+inline void take_untested(std::vector<index_t> &candidates, std::vector<index_t> &tested) {
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                    [&tested](index_t primitive) {
+                                        return std::binary_search(tested.begin(), tested.end(), primitive);
+                                    }),
+                     candidates.end());
+
+    // merge from the back so that tested does not need a second buffer
+    size_t i = tested.size(), j = candidates.size();
+    tested.resize(i + j);
+    for (size_t k = tested.size(); j > 0;) {
+        tested[--k] = i > 0 && tested[i - 1] > candidates[j - 1] ? tested[--i] : candidates[--j];
+    }
+}
+
+// Mesh data and construction of the interception lists, which do not depend on the simd instruction set.
+// The packed interception lists and the query are implemented by the subclasses in mantis_simd.inl.
 struct Impl {
 
-    Impl(const std::vector<GEO::vec3> &points, const std::vector<std::array<uint32_t, 3>> &triangles,
-         double limit_cube_len);
+    Impl(std::vector<GEO::vec3> points, std::vector<std::array<uint32_t, 3>> triangles,
+         const BuildOptions &options);
 
-    // for each voronoi cell, check every face of the mesh if the vertex corresponding to the cell
+    // Reads the tables written by save_tables, the build options and the mesh are read already
+    Impl(std::vector<GEO::vec3> points, std::vector<std::array<uint32_t, 3>> triangles,
+         const BuildOptions &options, BinaryReader &in);
+
+    virtual ~Impl() = default;
+
+    // Starts the threads of the build options for a construction or an update, see BuildOptions::num_threads
+    void acquire_build_pool();
+
+    // Stops the threads of acquire_build_pool, so that the structure does not keep idle threads. The batch
+    // queries run on the executor of the build options or the default one.
+    void release_build_pool();
+
+    // Computes the interception lists of all voronoi sites. If they are too long, steiner sites are inserted
+    // and the lists are recomputed, see BuildOptions::max_interceptions.
+    InterceptionLists compute_interception_list();
+
+    // for each voronoi cell, check every face of the mesh if the site corresponding to the cell
     // "intercepts" the face. This means that after trimming the cell by the face's edge planes, it is
     // contained in the convex region that is closer
-    void compute_interception_list();
+    InterceptionLists compute_site_interceptions();
+
+    // Delaunay triangulation of the voronoi sites and the corners of twice the limit cube. The triangulation
+    // refers to the coordinates of vertices, which have to outlive it.
+    GEO::SmartPointer<GEO::PeriodicDelaunay3d> triangulate_sites(std::vector<GEO::vec3> &vertices);
+
+    // Computes the interceptions of the given faces and edges, or of all of them if both are null, with the
+    // voronoi cells of the triangulation. The lists are not sorted.
+    InterceptionLists intercept_primitives(const GEO::PeriodicDelaunay3d &delaunay,
+                                           const std::vector<index_t> *searched_faces,
+                                           const std::vector<index_t> *searched_edges);
+
+    // Calls handle(i, cell_of, scratch) for all i in [0, n), primitives or sites, where cell_of(v) returns the
+    // voronoi cell of site v. The cells are taken from voronoi_cells unless it is empty. Then every chunk
+    // computes them on demand and caches them within its share of the cell memory budget, while processing i in
+    // the spatial order of center_of(i).
+    template<class Center, class Handle>
+    void for_each_primitive(const GEO::PeriodicDelaunay3d &delaunay,
+                            const std::vector<GEO::ConvexCell> &voronoi_cells, index_t n, Center center_of,
+                            Handle handle);
+
+    // Searches the sites intercepting the given faces and edges, starting from the sites on the primitive and
+    // continuing with the delaunay neighbors of intercepting sites, then transposes the results into per site
+    // lists. for_each_primitive(n, center_of, handle) calls handle(i, cell_of) for all i < n, where cell_of(v)
+    // returns the voronoi cell of site v.
+    template<class ForEach>
+    InterceptionLists search_primitive_interceptions(const GEO::PeriodicDelaunay3d &delaunay,
+                                                     ForEach &for_each_primitive,
+                                                     const std::vector<index_t> &searched_faces,
+                                                     const std::vector<index_t> &searched_edges);
+
+    // The same interceptions computed site by site, see BuildOptions::vertex_centric_build
+    template<class ForEach>
+    InterceptionLists propagate_site_interceptions(const GEO::PeriodicDelaunay3d &delaunay,
+                                                   ForEach &for_each_primitive);
+
+    // Inserts steiner sites on the faces intercepted by the sites whose lists are longer than
+    // max_interceptions. Returns false if no list is too long.
+    bool insert_steiner_sites(const InterceptionLists &lists);
+
+    // Removes the interceptions whose primitive is farther away than another primitive of the same list
+    // everywhere in their bounding box. Returns the number of removed interceptions.
+    size_t remove_dominated_interceptions(InterceptionLists &lists) const;
+
+    // Whether update_positions can update the structure incrementally. The data of the update is only kept on
+    // request, the steiner sites and the removal of dominated primitives depend on all lists, and compact()
+    // releases the data of the update.
+    bool supports_update() const {
+        return keep_update_data && max_interceptions == 0 && !remove_dominated;
+    }
+
+    bool can_update() const {
+        return supports_update() && interception_lists.edge_offsets.size() == num_sites() + 1 &&
+               neighbor_offsets.size() == num_sites() + 1 && face_regions.size() == triangles.size();
+    }
+
+    // Moves the vertices and recomputes the interception lists of update_positions, see
+    // AccelerationStructure::update_positions. Returns true if all lists were recomputed.
+    bool update_interception_lists(const uint32_t *indices, size_t num_indices, const float *positions,
+                                   UpdateStats &update);
+
+    // Stores the delaunay neighbors of all sites, sorted, for the next update
+    void store_site_neighbors(const GEO::PeriodicDelaunay3d &delaunay);
+
+    // Computes the plane and the region of face f, and the end planes of the region of edge e
+    void compute_face_geometry(index_t f);
+    void compute_edge_end_planes(index_t e);
+
+    // distance between q and the edge or the face, including its boundary
+    double primitive_distance(index_t primitive, bool is_face, GEO::vec3 q) const;
+
+    // Clips the voronoi cell C of site v to the region of the face or edge. Returns true if the site intercepts
+    // it, then the interception is filled in.
+    bool intercept_face(index_t v, index_t f, GEO::ConvexCell &C, Interception &interception) const;
+    bool intercept_edge(index_t v, index_t e, GEO::ConvexCell &C, Interception &interception) const;
+
+    // The voronoi sites are the vertices of the mesh followed by the steiner sites
+    size_t num_sites() const {
+        return points.size() + steiner_sites.size();
+    }
+
+    GEO::vec3 site(index_t s) const {
+        return s < points.size() ? points[s] : steiner_sites[s - points.size()];
+    }
+
+    // Index of the primitive the site lies on, a steiner site lies on a face
+    int site_primitive(index_t s) const {
+        return s < points.size() ? int(s) : steiner_primitives[s - points.size()];
+    }
+
+    // releases all data that is only needed during construction
+    void compact();
+
+    virtual size_t memory_usage() const;
 
-    Result calc_closest_point(GEO::vec3 q);
+    virtual Result calc_closest_point(GEO::vec3 q) const = 0;
 
-    Bvh bvh;
+    // Like calc_closest_point, but adds the number of packets whose primitives were tested to num_packets_scanned
+    virtual Result calc_closest_point(GEO::vec3 q, size_t &num_packets_scanned) const = 0;
+
+    virtual InstructionSet instruction_set() const = 0;
+
+    // Moves the vertices and updates the structure incrementally, requires can_update()
+    virtual UpdateStats update_positions(const uint32_t *indices, size_t num_indices, const float *positions) = 0;
+
+    // The options the structure was built with, including its threads
+    virtual BuildOptions build_options() const = 0;
+
+    // Writes the file read by AccelerationStructure::load
+    virtual void save(BinaryWriter &out) const = 0;
+
+    // Writes the mesh data and the build only data, unless it was released by compact()
+    void save_tables(BinaryWriter &out) const;
+
+    // Fills in the closest point and type of the closest primitive found by a query. The primitive index
+    // counts vertices first, then edges and then faces.
+    Result make_result(GEO::vec3 q, float distance_squared, int primitive) const;
+
+    // Returns the squared distance of q to the plane of face f if q lies inside the region of the face,
+    // otherwise infinity. Computed in double precision from the mesh, so it also works on compact structures.
+    double face_distance_squared(index_t f, GEO::vec3 q) const;
 
     std::vector<GEO::vec3> points;
     std::vector<std::array<uint32_t, 3>> triangles;
 
     double limit_cube_len = 0;
 
+    size_t max_interceptions = 0;
+    int max_steiner_rounds = 0;
+    bool remove_dominated = false;
+    size_t cell_memory_budget = 0;
+    bool vertex_centric_build = false;
+    bool keep_update_data = false;
+    double max_update_fraction = 0;
+
+    // runs the parallel loops of the construction, of the updates and of the batch queries: own_executor during
+    // a construction or an update if the build options ask for specific threads, otherwise the executor of the
+    // build options or the default one
+    Executor *executor = nullptr;
+    Executor *options_executor = nullptr;
+    std::unique_ptr<Executor> own_executor;
+    size_t num_threads = 0;
+    std::vector<int> cpus;
+
+    BuildStats stats;
+
+    std::vector<GEO::vec3> steiner_sites;
+    std::vector<int> steiner_primitives;
+
     std::vector<EdgeData> edges;
     std::vector<FaceData> faces;
 
-    std::vector<std::vector<PackedEdge>> intercepted_edges_packed;
-    std::vector<std::vector<PackedFace>> intercepted_faces_packed;
+    // build only data, released by compact()
+    std::vector<EdgeRegion> edge_regions;
+    std::vector<FaceRegion> face_regions;
 
-    std::map<std::pair<index_t, index_t>, size_t> edge_index;
+    // the edges of every face, edge i of a face connects its vertices i and i + 1
+    std::vector<std::array<index_t, 3>> face_edges;
+
+    // data of update_positions, only kept with BuildOptions::keep_update_data and released by compact(): the
+    // interception lists before packing and the sorted delaunay neighbors of every site,
+    // neighbors[neighbor_offsets[s], neighbor_offsets[s + 1])
+    InterceptionLists interception_lists;
+    std::vector<size_t> neighbor_offsets;
+    std::vector<index_t> neighbors;
 
 #ifdef DEBUG_MANTIS
     std::map<std::pair<index_t, index_t>, GEO::ConvexCell> vertex_edge_cells;
@@ -865,6 +1490,20 @@ struct Impl {
 #endif
 };
 
+// Runs the parallel loops of a scope on the threads of the build options, see Impl::acquire_build_pool
+class ScopedBuildPool {
+public:
+    explicit ScopedBuildPool(Impl &impl) : impl(impl) { impl.acquire_build_pool(); }
+
+    ~ScopedBuildPool() { impl.release_build_pool(); }
+
+    ScopedBuildPool(const ScopedBuildPool &) = delete;
+    ScopedBuildPool &operator=(const ScopedBuildPool &) = delete;
+
+private:
+    Impl &impl;
+};
+
 struct PointEq {
     bool operator()(const GEO::vec3 &a, const GEO::vec3 &b) const {
         return a.x == b.x && a.y == b.y && a.z == b.z;
@@ -939,9 +1578,19 @@ void deduplicate_points(std::vector<GEO::vec3>& points, std::vector<std::array<u
     }
 }
 
-Impl::Impl(const std::vector<GEO::vec3> &points, const std::vector<std::array<index_t, 3>> &triangles,
-           double limit_cube_len)
-        : points(points), triangles(triangles), bvh(points), limit_cube_len(limit_cube_len) {
+Impl::Impl(std::vector<GEO::vec3> points_, std::vector<std::array<index_t, 3>> triangles_,
+           const BuildOptions &options)
+        : points(std::move(points_)), triangles(std::move(triangles_)),
+          limit_cube_len(options.limit_cube_len), max_interceptions(options.max_interceptions),
+          max_steiner_rounds(options.max_steiner_rounds), remove_dominated(options.remove_dominated),
+          cell_memory_budget(options.cell_memory_budget), vertex_centric_build(options.vertex_centric_build),
+          keep_update_data(options.keep_update_data), max_update_fraction(options.max_update_fraction),
+          executor(options.executor ? options.executor : &default_executor()), options_executor(options.executor),
+          cpus(build_cpus(options)) {
+
+    num_threads = options.num_threads ? options.num_threads : cpus.size();
+    acquire_build_pool();
+    stats.num_threads = executor->num_threads();
 
     assert(check_points(points));
 
@@ -951,447 +1600,1226 @@ Impl::Impl(const std::vector<GEO::vec3> &points, const std::vector<std::array<in
     }();
     (void) init_geogram;
 
-    std::map<std::pair<index_t, index_t>, EdgeData> edge_map;
+    const index_t nb_faces = triangles.size();
 
-    for (auto t: triangles) {
+    // Sorting the corners of the faces by the vertex pair of the edge that starts there groups the corners of
+    // each edge, in the order of the faces. The edges end up ordered by their vertices.
+    std::vector<uint64_t> edge_keys(3 * size_t(nb_faces));
+    std::vector<uint32_t> corners(3 * size_t(nb_faces));
+    parallel_for(*executor, 0, nb_faces, [&](index_t f) {
         for (int i = 0; i < 3; ++i) {
-            index_t v0 = t[i];
-            index_t v1 = t[(i + 1) % 3];
-            if (v0 > v1) {
-                std::swap(v0, v1);
-            }
-            auto [it, inserted] = edge_map.emplace(std::pair{v0, v1}, EdgeData{v0, v1});
-            if (inserted) {
-                // populate end planes of edge
-                GEO::vec3 start_pt = points[v0];
-                GEO::vec3 end_pt = points[v1];
-
-                GEO::vec3 n1 = GEO::normalize(end_pt - start_pt);
-                GEO::vec3 n2 = GEO::normalize(start_pt - end_pt);
-                auto &ed = it->second;
-                ed.clipping_planes[ed.num_planes++] = to_vec4(n1, -GEO::dot(n1, start_pt));
-                ed.clipping_planes[ed.num_planes++] = to_vec4(n2, -GEO::dot(n2, end_pt));
-            }
+            auto [v0, v1] = std::minmax(triangles[f][i], triangles[f][(i + 1) % 3]);
+            edge_keys[3 * f + i] = uint64_t(v0) << 32 | v1;
+            corners[3 * f + i] = 3 * f + i;
+        }
+    });
+    radix_sort(*executor, edge_keys, corners);
+
+    // the corners where edge e starts are corners[edge_corner_offsets[e], edge_corner_offsets[e + 1]), corner c
+    // belongs to face c / 3
+    std::vector<size_t> edge_corner_offsets;
+    face_edges.resize(nb_faces);
+    for (size_t i = 0; i < corners.size(); ++i) {
+        if (i == 0 || edge_keys[i] != edge_keys[i - 1]) {
+            edges.push_back({uint32_t(edge_keys[i] >> 32), uint32_t(edge_keys[i])});
+            edge_corner_offsets.push_back(i);
+        }
+        face_edges[corners[i] / 3][corners[i] % 3] = edges.size() - 1;
+    }
+    edge_corner_offsets.push_back(corners.size());
+
+    faces.resize(nb_faces);
+    face_regions.resize(nb_faces);
+    parallel_for(*executor, 0, nb_faces, [this](index_t f) {
+        compute_face_geometry(f);
+    });
+
+    edge_regions.resize(edges.size());
+    parallel_for(*executor, 0, edges.size(), [&](index_t e) {
+        compute_edge_end_planes(e);
+
+        // the flipped edge planes of the first two adjacent faces
+        EdgeRegion &ed = edge_regions[e];
+        for (size_t i = edge_corner_offsets[e]; i < edge_corner_offsets[e + 1] && ed.num_planes < 4; ++i) {
+            // the edge starting at corner j of a face is opposite to its vertex j + 2
+            index_t f = corners[i] / 3, j = corners[i] % 3;
+            ed.clipping_planes[ed.num_planes++] = -face_regions[f].clipping_planes[(j + 2) % 3];
+        }
+    });
+}
+
+Impl::Impl(std::vector<GEO::vec3> points_, std::vector<std::array<index_t, 3>> triangles_,
+           const BuildOptions &options, BinaryReader &in)
+        : points(std::move(points_)), triangles(std::move(triangles_)),
+          limit_cube_len(options.limit_cube_len), max_interceptions(options.max_interceptions),
+          max_steiner_rounds(options.max_steiner_rounds), remove_dominated(options.remove_dominated),
+          cell_memory_budget(options.cell_memory_budget), vertex_centric_build(options.vertex_centric_build),
+          keep_update_data(options.keep_update_data), max_update_fraction(options.max_update_fraction),
+          executor(options.executor ? options.executor : &default_executor()), options_executor(options.executor),
+          cpus(build_cpus(options)) {
+
+    num_threads = options.num_threads ? options.num_threads : cpus.size();
+
+    in.read_bytes(&stats, sizeof(BuildStats));
+    in.read_array(steiner_sites);
+    in.read_array(steiner_primitives);
+    in.read_array(edges);
+    in.read_array(faces);
+    in.read_array(face_edges);
+    in.read_array(edge_regions);
+    in.read_array(face_regions);
+
+    in.check(steiner_primitives.size() == steiner_sites.size() && faces.size() == triangles.size() &&
+             face_edges.size() == triangles.size());
+    in.check(edge_regions.empty() || edge_regions.size() == edges.size());
+    in.check(face_regions.empty() || face_regions.size() == triangles.size());
+    for (const auto &t: triangles) {
+        in.check(t[0] < points.size() && t[1] < points.size() && t[2] < points.size());
+    }
+    for (const EdgeData &e: edges) {
+        in.check(e.start < points.size() && e.end < points.size());
+    }
+    for (const auto &f: face_edges) {
+        in.check(f[0] < edges.size() && f[1] < edges.size() && f[2] < edges.size());
+    }
+    for (int primitive: steiner_primitives) {
+        in.check(primitive >= 0 && size_t(primitive) < points.size() + edges.size() + triangles.size());
+    }
+}
+
+void Impl::compute_face_geometry(index_t f) {
+    auto [v0, v1, v2] = triangles[f];
+    GEO::vec3 p0 = points[v0];
+    GEO::vec3 p1 = points[v1];
+    GEO::vec3 p2 = points[v2];
+
+    GEO::vec3 n = GEO::normalize(GEO::cross(p1 - p0, p2 - p0));
+
+    GEO::vec3 n0 = GEO::normalize(GEO::cross(p2 - p1, n));
+    GEO::vec3 n1 = GEO::normalize(GEO::cross(p0 - p2, n));
+    GEO::vec3 n2 = GEO::normalize(GEO::cross(p1 - p0, n));
+
+    GEO::vec4 plane0 = to_vec4(-n0, GEO::dot(n0, p1));
+    GEO::vec4 plane1 = to_vec4(-n1, GEO::dot(n1, p2));
+    GEO::vec4 plane2 = to_vec4(-n2, GEO::dot(n2, p0));
+
+    faces[f].face_plane = to_vec4(n, -GEO::dot(n, p0));
+    face_regions[f].clipping_planes[0] = plane0;
+    face_regions[f].clipping_planes[1] = plane1;
+    face_regions[f].clipping_planes[2] = plane2;
+}
+
+void Impl::compute_edge_end_planes(index_t e) {
+    GEO::vec3 start_pt = points[edges[e].start];
+    GEO::vec3 end_pt = points[edges[e].end];
+
+    GEO::vec3 n1 = GEO::normalize(end_pt - start_pt);
+    GEO::vec3 n2 = GEO::normalize(start_pt - end_pt);
+    EdgeRegion &ed = edge_regions[e];
+    ed.num_planes = 0;
+    ed.clipping_planes[ed.num_planes++] = to_vec4(n1, -GEO::dot(n1, start_pt));
+    ed.clipping_planes[ed.num_planes++] = to_vec4(n2, -GEO::dot(n2, end_pt));
+}
+
+void Impl::acquire_build_pool() {
+    if (num_threads > 0 && !options_executor) {
+        own_executor = std::make_unique<ThreadPool>(num_threads, cpus);
+        executor = own_executor.get();
+    }
+}
+
+void Impl::release_build_pool() {
+    executor = options_executor ? options_executor : &default_executor();
+    own_executor.reset();
+}
+
+void Impl::save_tables(BinaryWriter &out) const {
+    out.write(stats);
+    out.write_array(steiner_sites);
+    out.write_array(steiner_primitives);
+    out.write_array(edges);
+    out.write_array(faces);
+    out.write_array(face_edges);
+    out.write_array(edge_regions);
+    out.write_array(face_regions);
+}
+
+void Impl::compact() {
+    decltype(edge_regions)().swap(edge_regions);
+    decltype(face_regions)().swap(face_regions);
+    interception_lists = InterceptionLists();
+    decltype(neighbor_offsets)().swap(neighbor_offsets);
+    decltype(neighbors)().swap(neighbors);
+}
+
+size_t Impl::memory_usage() const {
+    size_t bytes = points.capacity() * sizeof(GEO::vec3);
+    bytes += triangles.capacity() * sizeof(std::array<uint32_t, 3>);
+    bytes += edges.capacity() * sizeof(EdgeData);
+    bytes += faces.capacity() * sizeof(FaceData);
+    bytes += edge_regions.capacity() * sizeof(EdgeRegion);
+    bytes += face_regions.capacity() * sizeof(FaceRegion);
+    bytes += steiner_sites.capacity() * sizeof(GEO::vec3);
+    bytes += steiner_primitives.capacity() * sizeof(int);
+    bytes += face_edges.capacity() * sizeof(std::array<index_t, 3>);
+    bytes += (interception_lists.edge_offsets.capacity() + interception_lists.face_offsets.capacity()) *
+             sizeof(size_t);
+    bytes += (interception_lists.edges.capacity() + interception_lists.faces.capacity()) * sizeof(Interception);
+    bytes += neighbor_offsets.capacity() * sizeof(size_t);
+    bytes += neighbors.capacity() * sizeof(index_t);
+    return bytes;
+}
+
+
+InterceptionLists Impl::compute_interception_list() {
+    InterceptionLists lists = compute_site_interceptions();
+    for (int round = 0; max_interceptions > 0 && round < max_steiner_rounds; ++round) {
+        if (!insert_steiner_sites(lists)) {
+            break;
+        }
+        lists = compute_site_interceptions();
+    }
+    if (remove_dominated) {
+        stats.num_dominated_interceptions = remove_dominated_interceptions(lists);
+    }
+
+    stats.num_steiner_sites = steiner_sites.size();
+    for (index_t s = 0; s < num_sites(); ++s) {
+        size_t length = lists.edge_offsets[s + 1] - lists.edge_offsets[s] + lists.face_offsets[s + 1] -
+                        lists.face_offsets[s];
+        stats.max_list_length = std::max(stats.max_list_length, length);
+    }
+    return lists;
+}
+
+bool Impl::insert_steiner_sites(const InterceptionLists &lists) {
+    const index_t nb_faces = triangles.size();
+    const int face_base = int(points.size() + edges.size());
+
+    // Every face in an over long list gets a site at the point of the face closest to the center of the region
+    // where the face is closer than the list's site. The query points around that center move into the cell of
+    // the new site, so the region shrinks, often enough to drop the face from the list.
+    std::vector<GEO::vec3> centers(nb_faces, GEO::vec3(0.0, 0.0, 0.0));
+    std::vector<int> counts(nb_faces, 0);
+    bool too_long = false;
+    for (index_t s = 0; s < num_sites(); ++s) {
+        size_t length = lists.edge_offsets[s + 1] - lists.edge_offsets[s] + lists.face_offsets[s + 1] -
+                        lists.face_offsets[s];
+        if (length <= max_interceptions) {
+            continue;
+        }
+        too_long = true;
+        for (size_t i = lists.face_offsets[s]; i < lists.face_offsets[s + 1]; ++i) {
+            const Interception &interception = lists.faces[i];
+            centers[interception.primitive] += interception.box.clamped_center(limit_cube_len);
+            counts[interception.primitive]++;
         }
     }
+    if (!too_long) {
+        return false;
+    }
 
-    faces.resize(triangles.size());
-    for (index_t f = 0; f < faces.size(); ++f) {
+    std::vector<std::vector<GEO::vec3>> face_sites(nb_faces);
+    for (size_t s = 0; s < steiner_sites.size(); ++s) {
+        face_sites[steiner_primitives[s] - face_base].push_back(steiner_sites[s]);
+    }
+
+    size_t first_new = steiner_sites.size();
+    for (index_t f = 0; f < nb_faces; ++f) {
+        if (counts[f] == 0) {
+            continue;
+        }
         auto [v0, v1, v2] = triangles[f];
         GEO::vec3 p0 = points[v0];
         GEO::vec3 p1 = points[v1];
         GEO::vec3 p2 = points[v2];
+        GEO::vec3 n = GEO::cross(p1 - p0, p2 - p0);
+        double area2 = GEO::length2(n);
+        // degenerate faces do not get sites, they could coincide with other sites
+        if (area2 == 0.0) {
+            continue;
+        }
 
-        GEO::vec3 n = GEO::normalize(GEO::cross(p1 - p0, p2 - p0));
+        // barycentric coordinates of the projected center, kept away from the edges of the face so the site
+        // does not coincide with the sites of the neighbouring faces
+        GEO::vec3 c = centers[f] / double(counts[f]);
+        double w[3] = {GEO::dot(GEO::cross(p2 - p1, c - p1), n) / area2,
+                       GEO::dot(GEO::cross(p0 - p2, c - p2), n) / area2,
+                       GEO::dot(GEO::cross(p1 - p0, c - p0), n) / area2};
+        const double min_weight = 0.05;
+        double sum = 0.0;
+        for (double &wi: w) {
+            wi = std::max(wi, min_weight);
+            sum += wi;
+        }
+        GEO::vec3 site_point = (w[0] * p0 + w[1] * p1 + w[2] * p2) / sum;
 
-        GEO::vec3 n0 = GEO::normalize(GEO::cross(p2 - p1, n));
-        GEO::vec3 n1 = GEO::normalize(GEO::cross(p0 - p2, n));
-        GEO::vec3 n2 = GEO::normalize(GEO::cross(p1 - p0, n));
+        // later rounds often end up close to a site of an earlier round, which would not shrink anything
+        bool duplicate = std::any_of(face_sites[f].begin(), face_sites[f].end(), [&](GEO::vec3 p) {
+            return GEO::distance2(p, site_point) < 1e-4 * std::sqrt(area2);
+        });
+        if (!duplicate) {
+            steiner_sites.push_back(site_point);
+            steiner_primitives.push_back(face_base + int(f));
+        }
+    }
+    return steiner_sites.size() > first_new;
+}
 
-        GEO::vec4 plane0 = to_vec4(-n0, GEO::dot(n0, p1));
-        GEO::vec4 plane1 = to_vec4(-n1, GEO::dot(n1, p2));
-        GEO::vec4 plane2 = to_vec4(-n2, GEO::dot(n2, p0));
+double Impl::primitive_distance(index_t primitive, bool is_face, GEO::vec3 q) const {
+    if (is_face) {
+        auto [v0, v1, v2] = triangles[primitive];
+        return std::sqrt(distance_to_triangle_squared(q, points[v0], points[v1], points[v2]));
+    }
+    return std::sqrt(distance_to_segment_squared(q, points[edges[primitive].start], points[edges[primitive].end]));
+}
+
+size_t Impl::remove_dominated_interceptions(InterceptionLists &lists) const {
+    const index_t nb_sites = num_sites();
+    // the box corners found by intersect are only accurate up to the tolerance of its bisection fallback
+    const double box_tolerance = 2e-5;
+
+    std::vector<char> removed(lists.edges.size() + lists.faces.size(), 0);
+    parallel_for(*executor, 0, nb_sites, [&](index_t s) {
+        const size_t num_edges = lists.edge_offsets[s + 1] - lists.edge_offsets[s];
+        const size_t num_faces = lists.face_offsets[s + 1] - lists.face_offsets[s];
+        // the edges of the list followed by its faces
+        auto entry = [&](size_t i) -> const Interception & {
+            return i < num_edges ? lists.edges[lists.edge_offsets[s] + i]
+                                 : lists.faces[lists.face_offsets[s] + i - num_edges];
+        };
+        auto removed_flag = [&](size_t i) -> char & {
+            return i < num_edges ? removed[lists.edge_offsets[s] + i]
+                                 : removed[lists.edges.size() + lists.face_offsets[s] + i - num_edges];
+        };
 
-        faces[f].face_plane = to_vec4(n, -GEO::dot(n, p0));
-        faces[f].clipping_planes[0] = plane0;
-        faces[f].clipping_planes[1] = plane1;
-        faces[f].clipping_planes[2] = plane2;
+        for (size_t i = 0; i < num_edges + num_faces; ++i) {
+            const BoundingBox &box = entry(i).box;
+            GEO::vec3 extent = box.upper - box.lower;
+            if (!std::isfinite(extent.x) || !std::isfinite(extent.y) || !std::isfinite(extent.z)) {
+                continue;
+            }
+            // The primitive is never the closest if another one is closer everywhere in the box. The distance to a
+            // primitive is convex, so the other primitive is farthest at a corner, while the distance to this one
+            // can only be smaller than at the center by the radius of the box.
+            GEO::vec3 center = 0.5 * (box.lower + box.upper);
+            double radius = 0.5 * GEO::length(extent) + box_tolerance;
+            double lower_bound = primitive_distance(entry(i).primitive, i >= num_edges, center) - radius;
+            if (lower_bound <= 0.0) {
+                continue;
+            }
 
-        faces[f].pt_on_plane = p0;
+            // the primitive closest to the center is the most likely one to be closer everywhere
+            size_t closest = i;
+            double closest_distance = DBL_MAX;
+            for (size_t j = 0; j < num_edges + num_faces; ++j) {
+                double distance = primitive_distance(entry(j).primitive, j >= num_edges, center);
+                if (j != i && distance < closest_distance) {
+                    closest = j;
+                    closest_distance = distance;
+                }
+            }
+            if (closest == i || closest_distance + radius >= lower_bound) {
+                continue;
+            }
 
-        auto &ed0 = edge_map[std::minmax(v0, v1)];
-        if(ed0.num_planes < 4) {
-            ed0.clipping_planes[ed0.num_planes++] = -plane2;
+            double upper_bound = 0.0;
+            for (int corner = 0; corner < 8; ++corner) {
+                GEO::vec3 p((corner & 1 ? box.upper : box.lower).x, (corner & 2 ? box.upper : box.lower).y,
+                            (corner & 4 ? box.upper : box.lower).z);
+                upper_bound = std::max(upper_bound, primitive_distance(entry(closest).primitive,
+                                                                       closest >= num_edges, p));
+            }
+            // the box tolerance also covers the rounding of the distances
+            if (upper_bound + box_tolerance < lower_bound) {
+                removed_flag(i) = 1;
+            }
         }
+    });
 
-        auto &ed1 = edge_map[std::minmax(v1, v2)];
-        if(ed1.num_planes < 4) {
-            ed1.clipping_planes[ed1.num_planes++] = -plane0;
+    // compact the lists, keeping their order
+    auto compact_lists = [](std::vector<size_t> &offsets, std::vector<Interception> &list, const char *flags) {
+        size_t num_kept = 0;
+        size_t begin = offsets[0];
+        for (size_t s = 0; s + 1 < offsets.size(); ++s) {
+            size_t end = offsets[s + 1];
+            for (size_t i = begin; i < end; ++i) {
+                if (!flags[i]) {
+                    list[num_kept++] = list[i];
+                }
+            }
+            begin = end;
+            offsets[s + 1] = num_kept;
         }
+        list.resize(num_kept);
+    };
+    size_t num_interceptions = lists.edges.size() + lists.faces.size();
+    size_t num_edge_interceptions = lists.edges.size();
+    compact_lists(lists.edge_offsets, lists.edges, removed.data());
+    compact_lists(lists.face_offsets, lists.faces, removed.data() + num_edge_interceptions);
+    return num_interceptions - lists.edges.size() - lists.faces.size();
+}
 
-        auto &ed2 = edge_map[std::minmax(v2, v0)];
-        if(ed2.num_planes < 4) {
-            ed2.clipping_planes[ed2.num_planes++] = -plane1;
-        }
+// for each voronoi cell, check every face of the mesh if the site corresponding to the cell
+// "intercepts" the face. This means that after trimming the cell by the face's edge planes, it is
+// contained in the convex region that is closer
+bool Impl::intercept_face(index_t v, index_t f, GEO::ConvexCell &C, Interception &interception) const {
+    for (const GEO::vec4 &clipping_plane: face_regions[f].clipping_planes) {
+        C.clip_by_plane(clipping_plane);
     }
-
-    edges.reserve(edge_map.size());
-    for (const auto &[key, edge]: edge_map) {
-        assert(edge.num_planes <= 4);
-        edges.push_back(edge);
-        edge_index[key] = edges.size() - 1;
+    if (C.empty()) {
+        return false;
+    }
+    C.compute_geometry();
+    auto dist_squared = [plane = faces[f].face_plane](GEO::vec3 p) {
+        return distance_to_plane_squared(p, plane);
+    };
+    BoundingBox box;
+    if (!check_and_create_bounding_box(C, site(v), dist_squared, box)) {
+        return false;
     }
+    interception = {f, box, C.volume()};
+    return true;
+}
 
-    compute_interception_list();
+bool Impl::intercept_edge(index_t v, index_t e, GEO::ConvexCell &C, Interception &interception) const {
+    for (int i = 0; i < edge_regions[e].num_planes; ++i) {
+        C.clip_by_plane(edge_regions[e].clipping_planes[i]);
+    }
+    if (C.empty()) {
+        return false;
+    }
+    C.compute_geometry();
+    GEO::vec3 l0 = points[edges[e].start];
+    GEO::vec3 l1 = points[edges[e].end];
+    auto dist_squared = [l0, l1](GEO::vec3 p) {
+        return distance_to_line_squared(p, l0, l1);
+    };
+    BoundingBox box;
+    if (!check_and_create_bounding_box(C, site(v), dist_squared, box)) {
+        return false;
+    }
+    interception = {e, box, C.volume()};
+    return true;
 }
 
+template<class Center, class Handle>
+void Impl::for_each_primitive(const GEO::PeriodicDelaunay3d &delaunay,
+                              const std::vector<GEO::ConvexCell> &voronoi_cells, index_t n, Center center_of,
+                              Handle handle) {
+    // The scratch space of the concurrent chunks, handed on to later chunks
+    std::mutex scratch_mutex;
+    std::vector<std::unique_ptr<SearchScratch>> free_scratch;
+    auto acquire_scratch = [&]() {
+        std::lock_guard<std::mutex> lock(scratch_mutex);
+        if (free_scratch.empty()) {
+            return std::make_unique<SearchScratch>();
+        }
+        std::unique_ptr<SearchScratch> scratch = std::move(free_scratch.back());
+        free_scratch.pop_back();
+        return scratch;
+    };
+    auto release_scratch = [&](std::unique_ptr<SearchScratch> scratch) {
+        std::lock_guard<std::mutex> lock(scratch_mutex);
+        free_scratch.push_back(std::move(scratch));
+    };
 
-// for each voronoi cell, check every face of the mesh if the vertex corresponding to the cell
-// "intercepts" the face. This means that after trimming the cell by the face's edge planes, it is
-// contained in the convex region that is closer
-void Impl::compute_interception_list() {
+    std::mutex stats_mutex;
+    if (!voronoi_cells.empty()) {
+        // small chunks balance the load, the costs of the primitives differ by orders of magnitude
+        size_t grain = std::max<size_t>(1, n / (64 * executor->num_threads()));
+        parallel_for_chunks(*executor, 0, n, grain, [&](size_t chunk_begin, size_t chunk_end) {
+            std::unique_ptr<SearchScratch> scratch = acquire_scratch();
+            for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                handle(index_t(i), [&voronoi_cells](index_t v) -> const GEO::ConvexCell & {
+                    return voronoi_cells[v];
+                }, *scratch);
+            }
+            release_scratch(std::move(scratch));
+        });
+        return;
+    }
+
+    std::vector<GEO::vec3> centers(n);
+    for (index_t i = 0; i < n; ++i) {
+        centers[i] = center_of(i);
+    }
+    std::vector<index_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    sort_spatially(order.data(), n, centers);
+
+    // few large chunks, every chunk starts with an empty cache
+    const size_t cache_budget = cell_memory_budget ? cell_memory_budget / executor->num_threads() : SIZE_MAX;
+    size_t grain = std::max<size_t>(1, n / (4 * executor->num_threads()));
+    size_t num_chunks = 0;
+    size_t chunk_peak_bytes = 0;
+    parallel_for_chunks(*executor, 0, n, grain, [&](size_t chunk_begin, size_t chunk_end) {
+        CellCache cache(delaunay, cache_budget);
+        std::unique_ptr<SearchScratch> scratch = acquire_scratch();
+        for (size_t i = chunk_begin; i < chunk_end; ++i) {
+            handle(order[i], [&cache](index_t v) -> const GEO::ConvexCell & {
+                return cache.get(v);
+            }, *scratch);
+        }
+        release_scratch(std::move(scratch));
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        num_chunks++;
+        chunk_peak_bytes = std::max(chunk_peak_bytes, cache.peak_bytes);
+        stats.num_cell_computations += cache.num_computed;
+    });
+    // the caches of the concurrent chunks can be full at the same time
+    size_t peak_bytes = chunk_peak_bytes * std::min(num_chunks, executor->num_threads());
+    stats.peak_cell_bytes = std::max(stats.peak_cell_bytes, peak_bytes);
+}
+
+template<class ForEach>
+InterceptionLists Impl::search_primitive_interceptions(const GEO::PeriodicDelaunay3d &delaunay,
+                                                       ForEach &for_each_primitive,
+                                                       const std::vector<index_t> &searched_faces,
+                                                       const std::vector<index_t> &searched_edges) {
     const index_t nb_points = points.size();
+    const index_t nb_sites = num_sites();
     const index_t nb_faces = triangles.size();
     const index_t nb_edges = edges.size();
 
+    // the steiner sites on each face, they seed the search for the sites intercepting the face
+    std::vector<std::vector<index_t>> face_steiner_sites(steiner_sites.empty() ? 0 : nb_faces);
+    for (index_t s = nb_points; s < nb_sites; ++s) {
+        face_steiner_sites[site_primitive(s) - nb_points - nb_edges].push_back(s);
+    }
+
+    // the sites intercepting the searched primitive i and their interceptions
+    std::vector<std::vector<index_t>> face_vertex(searched_faces.size());
+    std::vector<std::vector<Interception>> face_vertex_interceptions(searched_faces.size());
+
+    auto handle_face = [this, &delaunay, nb_sites, &searched_faces, &face_steiner_sites, &face_vertex,
+                        &face_vertex_interceptions](index_t i, auto cell_of, SearchScratch &scratch) {
+        index_t f = searched_faces[i];
+        scratch.begin_search(nb_sites);
+        scratch.visit(triangles[f][0]);
+        scratch.visit(triangles[f][1]);
+        scratch.visit(triangles[f][2]);
+        if (!face_steiner_sites.empty()) {
+            for (index_t s: face_steiner_sites[f]) {
+                scratch.visit(s);
+            }
+        }
+
+        while (scratch.head < scratch.queue.size()) {
+            index_t v = scratch.queue[scratch.head++];
+
+            GEO::ConvexCell &C = scratch.cell;
+            C = cell_of(v);
+            Interception interception;
+            if (intercept_face(v, f, C, interception)) {
+                face_vertex[i].push_back(v);
+                face_vertex_interceptions[i].push_back(interception);
+#ifdef DEBUG_MANTIS
+                vertex_face_cells[{v, f}] = C;
+#endif
+            } else {
+                continue;
+            }
+
+            delaunay.get_neighbors(v, scratch.neighbors);
+            for (index_t n: scratch.neighbors) {
+                if (n < nb_sites) {
+                    scratch.visit(n);
+                }
+            }
+        }
+    };
+
+    auto face_center = [this, &searched_faces](index_t i) {
+        const auto &t = triangles[searched_faces[i]];
+        return (points[t[0]] + points[t[1]] + points[t[2]]) / 3.0;
+    };
+    auto start = std::chrono::steady_clock::now();
+    for_each_primitive(index_t(searched_faces.size()), face_center, handle_face);
+    stats.face_interceptions_ms += milliseconds_since(start);
+
+    std::vector<std::vector<index_t>> edge_vertex(searched_edges.size());
+    std::vector<std::vector<Interception>> edge_vertex_interceptions(searched_edges.size());
+
+    auto handle_edge = [this, &delaunay, nb_sites, &searched_edges, &edge_vertex,
+                        &edge_vertex_interceptions](index_t i, auto cell_of, SearchScratch &scratch) {
+        index_t e = searched_edges[i];
+        scratch.begin_search(nb_sites);
+        scratch.visit(edges[e].start);
+        scratch.visit(edges[e].end);
+
+        while (scratch.head < scratch.queue.size()) {
+            index_t v = scratch.queue[scratch.head++];
+
+            GEO::ConvexCell &C = scratch.cell;
+            C = cell_of(v);
+            Interception interception;
+            if (intercept_edge(v, e, C, interception)) {
+                edge_vertex[i].push_back(v);
+                edge_vertex_interceptions[i].push_back(interception);
+#ifdef DEBUG_MANTIS
+                vertex_edge_cells[{v, e}] = C;
+#endif
+            } else {
+                continue;
+            }
+
+            delaunay.get_neighbors(v, scratch.neighbors);
+            for (index_t n: scratch.neighbors) {
+                if (n < nb_sites) {
+                    scratch.visit(n);
+                }
+            }
+        }
+    };
+
+    auto edge_center = [this, &searched_edges](index_t i) {
+        const EdgeData &e = edges[searched_edges[i]];
+        return 0.5 * (points[e.start] + points[e.end]);
+    };
+    start = std::chrono::steady_clock::now();
+    for_each_primitive(index_t(searched_edges.size()), edge_center, handle_edge);
+    stats.edge_interceptions_ms += milliseconds_since(start);
+
+    // transpose edge_vertex and face_vertex arrays into flat per vertex lists
+    start = std::chrono::steady_clock::now();
+    InterceptionLists lists;
+    lists.edge_offsets.assign(nb_sites + 1, 0);
+    lists.face_offsets.assign(nb_sites + 1, 0);
+    for (const std::vector<index_t> &sites: edge_vertex) {
+        for (index_t v: sites) {
+            lists.edge_offsets[v + 1]++;
+        }
+    }
+    for (const std::vector<index_t> &sites: face_vertex) {
+        for (index_t v: sites) {
+            lists.face_offsets[v + 1]++;
+        }
+    }
+    std::partial_sum(lists.edge_offsets.begin(), lists.edge_offsets.end(), lists.edge_offsets.begin());
+    std::partial_sum(lists.face_offsets.begin(), lists.face_offsets.end(), lists.face_offsets.begin());
+
+    lists.edges.resize(lists.edge_offsets.back());
+    lists.faces.resize(lists.face_offsets.back());
+    {
+        std::vector<size_t> edge_cursor(lists.edge_offsets.begin(), lists.edge_offsets.end() - 1);
+        for (size_t e = 0; e < edge_vertex.size(); ++e) {
+            for (size_t i = 0; i < edge_vertex[e].size(); ++i) {
+                lists.edges[edge_cursor[edge_vertex[e][i]]++] = edge_vertex_interceptions[e][i];
+            }
+        }
+        std::vector<size_t> face_cursor(lists.face_offsets.begin(), lists.face_offsets.end() - 1);
+        for (size_t f = 0; f < face_vertex.size(); ++f) {
+            for (size_t i = 0; i < face_vertex[f].size(); ++i) {
+                lists.faces[face_cursor[face_vertex[f][i]]++] = face_vertex_interceptions[f][i];
+            }
+        }
+    }
+    stats.transpose_ms += milliseconds_since(start);
+    return lists;
+}
+
+template<class ForEach>
+InterceptionLists Impl::propagate_site_interceptions(const GEO::PeriodicDelaunay3d &delaunay,
+                                                     ForEach &for_each_primitive) {
+    const index_t nb_points = points.size();
+    const index_t nb_sites = num_sites();
+    const index_t nb_edges = edges.size();
+
+    // The sites intercepting a primitive are connected through delaunay neighbors that intercept it as well,
+    // starting from the sites on the primitive. So in the first round every site tests the primitives it lies
+    // on, and in the following rounds the primitives its neighbors intercepted in the previous round, which
+    // are the same tests the searches from the primitives do.
+    std::vector<std::vector<index_t>> edge_seeds(nb_sites);
+    std::vector<std::vector<index_t>> face_seeds(nb_sites);
+    for (index_t e = 0; e < nb_edges; ++e) {
+        edge_seeds[edges[e].start].push_back(e);
+        edge_seeds[edges[e].end].push_back(e);
+    }
+    for (index_t f = 0; f < triangles.size(); ++f) {
+        for (index_t v: triangles[f]) {
+            face_seeds[v].push_back(f);
+        }
+    }
+    for (index_t s = nb_points; s < nb_sites; ++s) {
+        face_seeds[s].push_back(site_primitive(s) - nb_points - nb_edges);
+    }
+
+    // The searches continue from a site to its neighbors, so a site takes the primitives of the sites it is a
+    // neighbor of. The neighbor lists of geogram are not always symmetric in degenerate configurations.
+    std::vector<std::vector<index_t>> neighbor_of(nb_sites);
+    {
+        GEO::vector<index_t> neighbors;
+        for (index_t v = 0; v < nb_sites; ++v) {
+            delaunay.get_neighbors(v, neighbors);
+            for (index_t n: neighbors) {
+                if (n < nb_sites) {
+                    neighbor_of[n].push_back(v);
+                }
+            }
+        }
+    }
+
+    std::vector<std::vector<Interception>> site_edges(nb_sites);
+    std::vector<std::vector<Interception>> site_faces(nb_sites);
+    // the primitives every site tested already, sorted
+    std::vector<std::vector<index_t>> tested_edges(nb_sites);
+    std::vector<std::vector<index_t>> tested_faces(nb_sites);
+    // primitives intercepted in the previous round and in the current one
+    std::vector<std::vector<index_t>> edge_frontier = std::move(edge_seeds);
+    std::vector<std::vector<index_t>> face_frontier = std::move(face_seeds);
+    std::vector<std::vector<index_t>> next_edge_frontier(nb_sites);
+    std::vector<std::vector<index_t>> next_face_frontier(nb_sites);
+
+    // every site only writes its own lists and reads the frontiers of the previous round
+    auto handle_site = [&](index_t v, auto cell_of, SearchScratch &scratch, bool first_round) {
+        auto test = [&](const std::vector<std::vector<index_t>> &frontier, bool is_face) {
+            std::vector<index_t> &candidates = scratch.candidates;
+            candidates.clear();
+            if (first_round) {
+                candidates = frontier[v];
+            } else {
+                for (index_t n: neighbor_of[v]) {
+                    candidates.insert(candidates.end(), frontier[n].begin(), frontier[n].end());
+                }
+            }
+            take_untested(candidates, is_face ? tested_faces[v] : tested_edges[v]);
+            for (index_t primitive: candidates) {
+                GEO::ConvexCell &C = scratch.cell;
+                C = cell_of(v);
+                Interception interception;
+                if (is_face ? intercept_face(v, primitive, C, interception)
+                            : intercept_edge(v, primitive, C, interception)) {
+                    (is_face ? site_faces : site_edges)[v].push_back(interception);
+                    (is_face ? next_face_frontier : next_edge_frontier)[v].push_back(primitive);
+                }
+            }
+        };
+        test(edge_frontier, false);
+        test(face_frontier, true);
+    };
+
+    auto site_center = [this](index_t v) {
+        return site(v);
+    };
+    for (bool first_round = true;; first_round = false) {
+        for_each_primitive(nb_sites, site_center, [&](index_t v, auto cell_of, SearchScratch &scratch) {
+            handle_site(v, cell_of, scratch, first_round);
+        });
+
+        bool done = true;
+        for (index_t v = 0; v < nb_sites; ++v) {
+            done = done && next_edge_frontier[v].empty() && next_face_frontier[v].empty();
+            edge_frontier[v].clear();
+            face_frontier[v].clear();
+        }
+        if (done) {
+            break;
+        }
+        std::swap(edge_frontier, next_edge_frontier);
+        std::swap(face_frontier, next_face_frontier);
+    }
+
+    InterceptionLists lists;
+    lists.edge_offsets.assign(nb_sites + 1, 0);
+    lists.face_offsets.assign(nb_sites + 1, 0);
+    for (index_t v = 0; v < nb_sites; ++v) {
+        lists.edge_offsets[v + 1] = lists.edge_offsets[v] + site_edges[v].size();
+        lists.face_offsets[v + 1] = lists.face_offsets[v] + site_faces[v].size();
+    }
+    lists.edges.resize(lists.edge_offsets.back());
+    lists.faces.resize(lists.face_offsets.back());
+    parallel_for(*executor, 0, nb_sites, [&](index_t v) {
+        std::copy(site_edges[v].begin(), site_edges[v].end(), lists.edges.begin() + (long) lists.edge_offsets[v]);
+        std::copy(site_faces[v].begin(), site_faces[v].end(), lists.faces.begin() + (long) lists.face_offsets[v]);
+    });
+    return lists;
+}
+
+InterceptionLists Impl::compute_site_interceptions() {
+    std::vector<GEO::vec3> vertices;
+    GEO::SmartPointer<GEO::PeriodicDelaunay3d> delaunay = triangulate_sites(vertices);
+    if (supports_update()) {
+        store_site_neighbors(*delaunay);
+    }
+
+    InterceptionLists lists = intercept_primitives(*delaunay, nullptr, nullptr);
+    parallel_for(*executor, 0, num_sites(), [&lists](index_t v) {
+        sort_site_lists(lists, v);
+    });
+    return lists;
+}
+
+GEO::SmartPointer<GEO::PeriodicDelaunay3d> Impl::triangulate_sites(std::vector<GEO::vec3> &vertices) {
     double l = limit_cube_len * 2;
-    auto copy = points;
-    copy.emplace_back(l, l, l);
-    copy.emplace_back(-l, l, l);
-    copy.emplace_back(l, -l, l);
-    copy.emplace_back(l, l, -l);
-    copy.emplace_back(-l, -l, l);
-    copy.emplace_back(-l, l, -l);
-    copy.emplace_back(l, -l, -l);
-    copy.emplace_back(-l, -l, -l);
-
-    assert(check_points(copy));
-
+    vertices = points;
+    vertices.insert(vertices.end(), steiner_sites.begin(), steiner_sites.end());
+    vertices.emplace_back(l, l, l);
+    vertices.emplace_back(-l, l, l);
+    vertices.emplace_back(l, -l, l);
+    vertices.emplace_back(l, l, -l);
+    vertices.emplace_back(-l, -l, l);
+    vertices.emplace_back(-l, l, -l);
+    vertices.emplace_back(l, -l, -l);
+    vertices.emplace_back(-l, -l, -l);
+
+    assert(check_points(vertices));
+
+    auto start = std::chrono::steady_clock::now();
     GEO::SmartPointer<GEO::PeriodicDelaunay3d> delaunay = new GEO::PeriodicDelaunay3d(false, 1.0);
     delaunay->set_keeps_infinite(true);
     delaunay->set_stores_neighbors(true);
-    delaunay->set_vertices(copy.size(), (double *) copy.data());
-    delaunay->compute();
-
-    GEO::PeriodicDelaunay3d::IncidentTetrahedra W;
+    delaunay->set_vertices(vertices.size(), (double *) vertices.data());
+    {
+        // The thread count of geogram is global, so the triangulations of concurrent builds take turns. Its
+        // threads inherit the affinity of the calling thread.
+        static std::mutex geogram_mutex;
+        std::lock_guard<std::mutex> lock(geogram_mutex);
+        GEO::index_t geogram_threads = GEO::Process::max_threads();
+        if (num_threads > 0) {
+            GEO::Process::set_max_threads(GEO::index_t(std::min<size_t>(num_threads,
+                                                                        GEO::Process::number_of_cores())));
+        }
+        ScopedAffinity affinity(cpus);
+        delaunay->compute();
+        GEO::Process::set_max_threads(geogram_threads);
+    }
+    stats.delaunay_ms += milliseconds_since(start);
 
 #ifdef DEBUG_MANTIS
-    for (index_t v = 0; v < nb_points; ++v) {
-            GEO::vec3 site_p = points[v];
-            delaunay->copy_Laguerre_cell_from_Delaunay(v, C, W);
-            C.compute_geometry();
-            vor_cells[v] = C;
-        }
+    GEO::PeriodicDelaunay3d::IncidentTetrahedra W;
+    for (index_t v = 0; v < num_sites(); ++v) {
+        GEO::ConvexCell C;
+        delaunay->copy_Laguerre_cell_from_Delaunay(v, C, W);
+        C.compute_geometry();
+        vor_cells[v] = C;
+    }
 
-        for (index_t e = 0; e < nb_edges; ++e) {
-            GEO::ConvexCell clipped_cell;
-            clipped_cell.init_with_box(-l, -l, -l, l, l, l);
-            for (const GEO::vec4 &clipping_plane: edges[e].clipping_planes) {
-                clipped_cell.clip_by_plane(clipping_plane);
-            }
-            clipped_cell.compute_geometry();
-            edge_cells[e] = clipped_cell;
+    for (index_t e = 0; e < edges.size(); ++e) {
+        GEO::ConvexCell clipped_cell;
+        clipped_cell.init_with_box(-l, -l, -l, l, l, l);
+        for (int i = 0; i < edge_regions[e].num_planes; ++i) {
+            clipped_cell.clip_by_plane(edge_regions[e].clipping_planes[i]);
         }
+        clipped_cell.compute_geometry();
+        edge_cells[e] = clipped_cell;
+    }
 
-        for (index_t f = 0; f < nb_faces; ++f) {
-            GEO::ConvexCell clipped_cell;
-            clipped_cell.init_with_box(-l, -l, -l, l, l, l);
-            for (const GEO::vec4 &clipping_plane: faces[f].clipping_planes) {
-                clipped_cell.clip_by_plane(clipping_plane);
-            }
-            clipped_cell.compute_geometry();
-            face_cells[f] = clipped_cell;
+    for (index_t f = 0; f < triangles.size(); ++f) {
+        GEO::ConvexCell clipped_cell;
+        clipped_cell.init_with_box(-l, -l, -l, l, l, l);
+        for (const GEO::vec4 &clipping_plane: face_regions[f].clipping_planes) {
+            clipped_cell.clip_by_plane(clipping_plane);
         }
+        clipped_cell.compute_geometry();
+        face_cells[f] = clipped_cell;
+    }
 #endif
+    return delaunay;
+}
+
+void Impl::store_site_neighbors(const GEO::PeriodicDelaunay3d &delaunay) {
+    const index_t nb_sites = num_sites();
+    // geogram's neighbors include the corners of the limit cube
+    neighbor_offsets.assign(nb_sites + 1, 0);
+    parallel_for_chunks(*executor, 0, nb_sites, 256, [&](size_t chunk_begin, size_t chunk_end) {
+        GEO::vector<index_t> site_neighbors;
+        for (size_t v = chunk_begin; v < chunk_end; ++v) {
+            delaunay.get_neighbors(index_t(v), site_neighbors);
+            neighbor_offsets[v + 1] = std::count_if(site_neighbors.begin(), site_neighbors.end(),
+                                                    [nb_sites](index_t n) { return n < nb_sites; });
+        }
+    });
+    std::partial_sum(neighbor_offsets.begin(), neighbor_offsets.end(), neighbor_offsets.begin());
+    neighbors.resize(neighbor_offsets.back());
+    parallel_for_chunks(*executor, 0, nb_sites, 256, [&](size_t chunk_begin, size_t chunk_end) {
+        GEO::vector<index_t> site_neighbors;
+        for (size_t v = chunk_begin; v < chunk_end; ++v) {
+            delaunay.get_neighbors(index_t(v), site_neighbors);
+            auto end = std::copy_if(site_neighbors.begin(), site_neighbors.end(),
+                                    neighbors.begin() + (long) neighbor_offsets[v],
+                                    [nb_sites](index_t n) { return n < nb_sites; });
+            std::sort(neighbors.begin() + (long) neighbor_offsets[v], end);
+        }
+    });
+}
 
-    std::vector<GEO::ConvexCell> voronoi_cells(nb_points);
+InterceptionLists Impl::intercept_primitives(const GEO::PeriodicDelaunay3d &delaunay,
+                                             const std::vector<index_t> *searched_faces,
+                                             const std::vector<index_t> *searched_edges) {
+    const index_t nb_sites = num_sites();
+    const bool all_primitives = !searched_faces && !searched_edges;
+
+    // Without a memory budget the cells of all sites are computed up front, unless only some primitives are
+    // searched. Otherwise every thread computes them on demand and caches them, while processing the primitives
+    // in spatial order.
+    std::vector<GEO::ConvexCell> voronoi_cells;
+    if (cell_memory_budget == 0 && all_primitives) {
+        auto start = std::chrono::steady_clock::now();
+        voronoi_cells.resize(nb_sites);
+        parallel_for_chunks(*executor, 0, nb_sites, 64, [&voronoi_cells, &delaunay](size_t thread_begin, size_t thread_end) {
+            // the incident tetrahedra are scratch space of copy_Laguerre_cell_from_Delaunay, reused by the thread
+            GEO::PeriodicDelaunay3d::IncidentTetrahedra W;
+            for (size_t v = thread_begin; v < thread_end; ++v) {
+                delaunay.copy_Laguerre_cell_from_Delaunay(index_t(v), voronoi_cells[v], W);
+                voronoi_cells[v].compute_geometry();
+            }
+        });
+        stats.voronoi_cells_ms += milliseconds_since(start);
 
-    for (index_t v = 0; v < nb_points; ++v) {
-        delaunay->copy_Laguerre_cell_from_Delaunay(v, voronoi_cells[v], W);
-        voronoi_cells[v].compute_geometry();
+        size_t cell_bytes = 0;
+        for (const GEO::ConvexCell &C: voronoi_cells) {
+            cell_bytes += convex_cell_bytes(C);
+        }
+        stats.peak_cell_bytes = std::max(stats.peak_cell_bytes, cell_bytes);
+        stats.num_cell_computations += nb_sites;
     }
 
-    std::vector<std::vector<index_t>> face_vertex(nb_faces);
-    std::vector<std::vector<BoundingBox>> face_vertex_bb(nb_faces);
-
-    auto handle_face = [this, &voronoi_cells, delaunay, nb_points, &face_vertex, &face_vertex_bb](index_t f) {
-        auto dist_squared = [plane = faces[f].face_plane](GEO::vec3 p) {
-            return distance_to_plane_squared(p, plane);
-        };
-
-        std::unordered_set < index_t > visited = {triangles[f][0], triangles[f][1], triangles[f][2]};
-        std::queue<index_t> queue;
-        queue.push(triangles[f][0]);
-        queue.push(triangles[f][1]);
-        queue.push(triangles[f][2]);
+    auto for_each = [&](index_t n, auto center_of, auto handle) {
+        for_each_primitive(delaunay, voronoi_cells, n, center_of, handle);
+    };
+    if (!all_primitives) {
+        return search_primitive_interceptions(delaunay, for_each, *searched_faces, *searched_edges);
+    }
+    if (vertex_centric_build) {
+        auto start = std::chrono::steady_clock::now();
+        InterceptionLists lists = propagate_site_interceptions(delaunay, for_each);
+        stats.site_interceptions_ms += milliseconds_since(start);
+        return lists;
+    }
+    std::vector<index_t> all_faces(triangles.size());
+    std::vector<index_t> all_edges(edges.size());
+    std::iota(all_faces.begin(), all_faces.end(), 0);
+    std::iota(all_edges.begin(), all_edges.end(), 0);
+    return search_primitive_interceptions(delaunay, for_each, all_faces, all_edges);
+}
 
-        while (!queue.empty()) {
-            index_t v = queue.front();
-            queue.pop();
+bool Impl::update_interception_lists(const uint32_t *indices, size_t num_indices, const float *positions,
+                                     UpdateStats &update) {
+    assert(can_update());
+    const index_t nb_sites = num_sites();
+    const index_t nb_faces = triangles.size();
+    const index_t nb_edges = edges.size();
+    const BuildStats before = stats;
 
-            //delaunay->copy_Laguerre_cell_from_Delaunay(v, C, W);
-            GEO::ConvexCell C = voronoi_cells[v];
-            for (const GEO::vec4 &clipping_plane: faces[f].clipping_planes) {
-                C.clip_by_plane(clipping_plane);
-            }
-            if (C.empty()) {
-                continue;
+    std::vector<char> moved(nb_sites, 0);
+    for (size_t i = 0; i < num_indices; ++i) {
+        points[indices[i]] = {positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]};
+        moved[indices[i]] = 1;
+    }
+    update.num_moved_vertices = std::count(moved.begin(), moved.end(), 1);
+
+    // The faces at the moved vertices change their planes, and so do the regions of their edges, which contain
+    // the flipped edge planes of the first two adjacent faces.
+    std::vector<char> dirty_faces(nb_faces, 0);
+    std::vector<char> dirty_edges(nb_edges, 0);
+    parallel_for(*executor, 0, nb_faces, [&](index_t f) {
+        if (moved[triangles[f][0]] || moved[triangles[f][1]] || moved[triangles[f][2]]) {
+            dirty_faces[f] = 1;
+            compute_face_geometry(f);
+        }
+    });
+    for (index_t f = 0; f < nb_faces; ++f) {
+        if (dirty_faces[f]) {
+            for (index_t e: face_edges[f]) {
+                dirty_edges[e] = 1;
             }
-            C.compute_geometry();
-            BoundingBox box;
-            if (check_and_create_bounding_box(C, points[v], dist_squared, box)) {
-                face_vertex[f].push_back(v);
-                face_vertex_bb[f].push_back(box);
-#ifdef DEBUG_MANTIS
-                vertex_face_cells[{v, f}] = C;
-#endif
-            } else {
-                continue;
+        }
+    }
+    parallel_for(*executor, 0, nb_edges, [&](index_t e) {
+        if (dirty_edges[e]) {
+            compute_edge_end_planes(e);
+        }
+    });
+    // the faces of an edge in increasing order, as in the construction
+    for (index_t f = 0; f < nb_faces; ++f) {
+        for (index_t j = 0; j < 3; ++j) {
+            EdgeRegion &ed = edge_regions[face_edges[f][j]];
+            if (dirty_edges[face_edges[f][j]] && ed.num_planes < 4) {
+                ed.clipping_planes[ed.num_planes++] = -face_regions[f].clipping_planes[(j + 2) % 3];
             }
+        }
+    }
 
-            GEO::vector<index_t> neighbors;
-            delaunay->get_neighbors(v, neighbors);
-            for (index_t n: neighbors) {
-                if (n < nb_points && !visited.count(n)) {
-                    visited.insert(n);
-                    queue.push(n);
+    std::vector<size_t> old_offsets = std::move(neighbor_offsets);
+    std::vector<index_t> old_neighbors = std::move(neighbors);
+    std::vector<GEO::vec3> vertices;
+    GEO::SmartPointer<GEO::PeriodicDelaunay3d> delaunay = triangulate_sites(vertices);
+    store_site_neighbors(*delaunay);
+
+    // The voronoi cell of a site only depends on its position and the positions of its delaunay neighbors
+    std::vector<char> changed(nb_sites, 0);
+    parallel_for(*executor, 0, nb_sites, [&](index_t s) {
+        auto begin = neighbors.begin() + (long) neighbor_offsets[s];
+        auto end = neighbors.begin() + (long) neighbor_offsets[s + 1];
+        changed[s] = moved[s] || !std::equal(begin, end, old_neighbors.begin() + (long) old_offsets[s],
+                                             old_neighbors.begin() + (long) old_offsets[s + 1]) ||
+                     std::any_of(begin, end, [&moved](index_t n) { return moved[n]; });
+    });
+    update.num_changed_cells = std::count(changed.begin(), changed.end(), 1);
+
+    // Only the primitives at the moved vertices changed their regions and are searched again. The search of
+    // another primitive only reaches different sites at the changed cells, so the changed sites propagate the
+    // interceptions as in propagate_site_interceptions, starting from the primitives they lie on and the lists
+    // of the unchanged sites they are a neighbor of. The unchanged sites keep their lists, and join the
+    // propagation when a neighbor intercepts a primitive that is not in their list yet.
+    std::vector<index_t> changed_sites;
+    for (index_t s = 0; s < nb_sites; ++s) {
+        if (changed[s]) {
+            changed_sites.push_back(s);
+        }
+    }
+    std::vector<index_t> searched_faces;
+    std::vector<index_t> searched_edges;
+    for (index_t f = 0; f < nb_faces; ++f) {
+        if (dirty_faces[f]) {
+            searched_faces.push_back(f);
+        }
+    }
+    for (index_t e = 0; e < nb_edges; ++e) {
+        if (dirty_edges[e]) {
+            searched_edges.push_back(e);
+        }
+    }
+    bool rebuild = double(changed_sites.size()) > max_update_fraction * double(nb_sites);
+    update.num_recomputed_faces = rebuild ? nb_faces : searched_faces.size();
+    update.num_recomputed_edges = rebuild ? nb_edges : searched_edges.size();
+
+    auto start = std::chrono::steady_clock::now();
+    if (rebuild) {
+        interception_lists = intercept_primitives(*delaunay, nullptr, nullptr);
+        parallel_for(*executor, 0, nb_sites, [this](index_t v) {
+            sort_site_lists(interception_lists, v);
+        });
+    } else {
+        InterceptionLists found = intercept_primitives(*delaunay, &searched_faces, &searched_edges);
+        const InterceptionLists &old = interception_lists;
+
+        // the sites every site is a neighbor of
+        std::vector<size_t> reverse_offsets(nb_sites + 1, 0);
+        for (index_t n: neighbors) {
+            reverse_offsets[n + 1]++;
+        }
+        std::partial_sum(reverse_offsets.begin(), reverse_offsets.end(), reverse_offsets.begin());
+        std::vector<index_t> neighbor_of(reverse_offsets.back());
+        {
+            std::vector<size_t> cursor(reverse_offsets.begin(), reverse_offsets.end() - 1);
+            for (index_t v = 0; v < nb_sites; ++v) {
+                for (size_t i = neighbor_offsets[v]; i < neighbor_offsets[v + 1]; ++i) {
+                    neighbor_of[cursor[neighbors[i]]++] = v;
                 }
             }
         }
-    };
 
-    parallel_for(0, nb_faces, handle_face);
-
-    std::vector<std::vector<index_t>> edge_vertex(nb_edges);
-    std::vector<std::vector<BoundingBox>> edge_vertex_bb(nb_edges);
-
-    auto handle_edge = [this, &voronoi_cells, delaunay, nb_points, &edge_vertex, &edge_vertex_bb](index_t e) {
-        GEO::vec3 l0 = points[edges[e].start];
-        GEO::vec3 l1 = points[edges[e].end];
-        auto dist_squared = [l0, l1](GEO::vec3 p) {
-            return distance_to_line_squared(p, l0, l1);
-        };
-
-        std::unordered_set < index_t > visited = {edges[e].start, edges[e].end};
-        std::queue<index_t> queue;
-        queue.push(edges[e].start);
-        queue.push(edges[e].end);
-
-        while (!queue.empty()) {
-            index_t v = queue.front();
-            queue.pop();
-
-            //delaunay->copy_Laguerre_cell_from_Delaunay(v, C, W);
-            GEO::ConvexCell C = voronoi_cells[v];
-            for (size_t i = 0; i < edges[e].num_planes; ++i) {
-                C.clip_by_plane(edges[e].clipping_planes[i]);
-            }
-            if (C.empty()) {
-                continue;
+        // the sites taking part in the propagation, the changed ones first
+        const index_t no_slot = std::numeric_limits<index_t>::max();
+        std::vector<index_t> active_sites;
+        std::vector<index_t> slot(nb_sites, no_slot);
+        std::vector<std::vector<Interception>> site_edges;
+        std::vector<std::vector<Interception>> site_faces;
+        // the primitives every active site tested already, sorted
+        std::vector<std::vector<index_t>> tested_edges;
+        std::vector<std::vector<index_t>> tested_faces;
+        std::vector<std::vector<index_t>> edge_frontier;
+        std::vector<std::vector<index_t>> face_frontier;
+        std::vector<std::vector<index_t>> next_edge_frontier;
+        std::vector<std::vector<index_t>> next_face_frontier;
+        auto activate = [&](index_t v) {
+            slot[v] = active_sites.size();
+            active_sites.push_back(v);
+            site_edges.emplace_back();
+            site_faces.emplace_back();
+            tested_edges.emplace_back();
+            tested_faces.emplace_back();
+            edge_frontier.emplace_back();
+            face_frontier.emplace_back();
+            next_edge_frontier.emplace_back();
+            next_face_frontier.emplace_back();
+            if (changed[v]) {
+                return;
             }
-            C.compute_geometry();
-            BoundingBox box;
-            if (check_and_create_bounding_box(C, points[v], dist_squared, box)) {
-                edge_vertex[e].push_back(v);
-                edge_vertex_bb[e].push_back(box);
-#ifdef DEBUG_MANTIS
-                vertex_edge_cells[{v, e}] = C;
-#endif
-            } else {
-                continue;
+            for (size_t i = old.edge_offsets[v]; i < old.edge_offsets[v + 1]; ++i) {
+                if (!dirty_edges[old.edges[i].primitive]) {
+                    site_edges.back().push_back(old.edges[i]);
+                    tested_edges.back().push_back(old.edges[i].primitive);
+                }
             }
-
-            GEO::vector<index_t> neighbors;
-            delaunay->get_neighbors(v, neighbors);
-            for (index_t n: neighbors) {
-                if (n < nb_points && !visited.count(n)) {
-                    visited.insert(n);
-                    queue.push(n);
+            for (size_t i = old.face_offsets[v]; i < old.face_offsets[v + 1]; ++i) {
+                if (!dirty_faces[old.faces[i].primitive]) {
+                    site_faces.back().push_back(old.faces[i]);
+                    tested_faces.back().push_back(old.faces[i].primitive);
                 }
             }
+            std::sort(tested_edges.back().begin(), tested_edges.back().end());
+            std::sort(tested_faces.back().begin(), tested_faces.back().end());
+        };
+        for (index_t v: changed_sites) {
+            activate(v);
         }
-    };
-
-    parallel_for(0, nb_edges, handle_edge);
-
-    std::vector<std::vector<index_t>> intercepted_edges(nb_points);
-    std::vector<std::vector<BoundingBox>> intercepted_edges_bb(nb_points);
-    std::vector<std::vector<index_t>> intercepted_faces(nb_points);
-    std::vector<std::vector<BoundingBox>> intercepted_faces_bb(nb_points);
-
-    // transpose edge_vertex and face_vertex arrays
-    for (index_t e = 0; e < nb_edges; ++e) {
-        for (size_t i = 0; i < edge_vertex[e].size(); ++i) {
-            index_t v = edge_vertex[e][i];
-            intercepted_edges[v].push_back(e);
-            intercepted_edges_bb[v].push_back(edge_vertex_bb[e][i]);
+        for (index_t e = 0; e < nb_edges; ++e) {
+            for (index_t v: {edges[e].start, edges[e].end}) {
+                if (changed[v] && !dirty_edges[e]) {
+                    edge_frontier[slot[v]].push_back(e);
+                }
+            }
         }
-    }
-    for (index_t f = 0; f < nb_faces; ++f) {
-        for (size_t i = 0; i < face_vertex[f].size(); ++i) {
-            index_t v = face_vertex[f][i];
-            intercepted_faces[v].push_back(f);
-            intercepted_faces_bb[v].push_back(face_vertex_bb[f][i]);
+        for (index_t f = 0; f < nb_faces; ++f) {
+            for (index_t v: triangles[f]) {
+                if (changed[v] && !dirty_faces[f]) {
+                    face_frontier[slot[v]].push_back(f);
+                }
+            }
         }
-    }
-
-    intercepted_edges_packed.resize(nb_points);
-    intercepted_faces_packed.resize(nb_points);
-
-    // Pack data into simd friendly data structures
-    std::vector<int> order;
-    for (index_t v = 0; v < nb_points; ++v) {
-        // first reorder edges
-        order.resize(intercepted_edges[v].size());
-        std::iota(order.begin(), order.end(), 0);
-        std::sort(order.begin(), order.end(), [&](index_t a, index_t b) {
-            return intercepted_edges_bb[v][a].lower.x < intercepted_edges_bb[v][b].lower.x;
-        });
-
-        std::vector<index_t> new_intercepted_edges(intercepted_edges[v].size());
-        std::vector<BoundingBox> new_intercepted_edges_bb(intercepted_edges_bb[v].size());
-        for (index_t i = 0; i < order.size(); ++i) {
-            new_intercepted_edges[i] = intercepted_edges[v][order[i]];
-            new_intercepted_edges_bb[i] = intercepted_edges_bb[v][order[i]];
-        }
-
-        intercepted_edges[v] = std::move(new_intercepted_edges);
-        intercepted_edges_bb[v] = std::move(new_intercepted_edges_bb);
-
-        // round up number of edge batches
-        size_t num_edge_packed = (intercepted_edges[v].size() + SimdWidth - 1) / SimdWidth;
-        intercepted_edges_packed[v].resize(num_edge_packed);
-
-        for (size_t i = 0; i < num_edge_packed; ++i) {
-            PackedEdge packed{};
-            for (size_t j = 0; j < SimdWidth; ++j) {
-                if (i * SimdWidth + j < intercepted_edges[v].size()) {
-                    index_t e = intercepted_edges[v][i * SimdWidth + j];
-                    set(packed.min_x, j, (float) intercepted_edges_bb[v][i * SimdWidth + j].lower.x);
-                    for (size_t d = 0; d < 3; ++d) {
-                        set(packed.start[d], j, (float) points[edges[e].start][d]);
-                        set(packed.dir[d], j, float(points[edges[e].end][d] - points[edges[e].start][d]));
+        for (index_t v: changed_sites) {
+            for (size_t j = reverse_offsets[v]; j < reverse_offsets[v + 1]; ++j) {
+                index_t n = neighbor_of[j];
+                if (changed[n]) {
+                    continue;
+                }
+                for (size_t i = old.edge_offsets[n]; i < old.edge_offsets[n + 1]; ++i) {
+                    if (!dirty_edges[old.edges[i].primitive]) {
+                        edge_frontier[slot[v]].push_back(old.edges[i].primitive);
                     }
-                    set(packed.dir_len_squared, j, float(GEO::distance2(points[edges[e].end], points[edges[e].start])));
-                    set(packed.primitive_idx, j, int(e + nb_points));
-                } else {
-                    // duplicate last edge
-                    assert(j > 0);
-                    set(packed.min_x, j, get(packed.min_x, j - 1));
-                    for (size_t d = 0; d < 3; ++d) {
-                        set(packed.start[d], j, get(packed.start[d], j - 1));
-                        set(packed.dir[d], j, get(packed.dir[d], j - 1));
+                }
+                for (size_t i = old.face_offsets[n]; i < old.face_offsets[n + 1]; ++i) {
+                    if (!dirty_faces[old.faces[i].primitive]) {
+                        face_frontier[slot[v]].push_back(old.faces[i].primitive);
                     }
-                    set(packed.dir_len_squared, j, get(packed.dir_len_squared, j - 1));
-                    set(packed.primitive_idx, j, get(packed.primitive_idx, j - 1));
                 }
             }
-            intercepted_edges_packed[v][i] = packed;
         }
 
-        // then reorder faces
-        order.resize(intercepted_faces[v].size());
-        std::iota(order.begin(), order.end(), 0);
-        std::sort(order.begin(), order.end(), [&](index_t a, index_t b) {
-            return intercepted_faces_bb[v][a].lower.x < intercepted_faces_bb[v][b].lower.x;
-        });
-        std::vector<index_t> new_intercepted_faces(intercepted_faces[v].size());
-        std::vector<BoundingBox> new_intercepted_faces_bb(intercepted_faces_bb[v].size());
-        for (index_t i = 0; i < order.size(); ++i) {
-            new_intercepted_faces[i] = intercepted_faces[v][order[i]];
-            new_intercepted_faces_bb[i] = intercepted_faces_bb[v][order[i]];
-        }
-
-        intercepted_faces[v] = std::move(new_intercepted_faces);
-        intercepted_faces_bb[v] = std::move(new_intercepted_faces_bb);
-
-        // round up nb of face batches
-        size_t num_face_packed = (intercepted_faces[v].size() + SimdWidth - 1) / SimdWidth;
-        intercepted_faces_packed[v].resize(num_face_packed);
-        intercepted_faces_bb[v].resize(num_face_packed);
-
-        for (size_t i = 0; i < num_face_packed; ++i) {
-            PackedFace packed{};
-            for (size_t j = 0; j < SimdWidth; ++j) {
-                if (i * SimdWidth + j < intercepted_faces[v].size()) {
-                    index_t f = intercepted_faces[v][i * SimdWidth + j];
-                    set(packed.min_x, j, (float) intercepted_faces_bb[v][i * SimdWidth + j].lower.x);
-                    for (size_t d = 0; d < 4; ++d) {
-                        set(packed.face_plane[d], j, (float) faces[f].face_plane[d]);
-                        set(packed.edge_plane0[d], j, (float) faces[f].clipping_planes[0][d]);
-                        set(packed.edge_plane1[d], j, (float) faces[f].clipping_planes[1][d]);
-                        set(packed.edge_plane2[d], j, (float) faces[f].clipping_planes[2][d]);
-                    }
-                    set(packed.primitive_idx, j, int(f + nb_points + nb_edges));
+        auto handle_site = [&](index_t c, auto cell_of, SearchScratch &scratch, bool first_round) {
+            index_t v = active_sites[c];
+            auto test = [&](const std::vector<std::vector<index_t>> &frontier, bool is_face) {
+                std::vector<index_t> &candidates = scratch.candidates;
+                candidates.clear();
+                if (first_round) {
+                    candidates = frontier[c];
                 } else {
-                    // duplicate last face
-                    assert(j > 0);
-                    set(packed.min_x, j, get(packed.min_x, j - 1));
-                    for (size_t d = 0; d < 4; ++d) {
-                        set(packed.face_plane[d], j, get(packed.face_plane[d], j - 1));
-                        set(packed.edge_plane0[d], j, get(packed.edge_plane0[d], j - 1));
-                        set(packed.edge_plane1[d], j, get(packed.edge_plane1[d], j - 1));
-                        set(packed.edge_plane2[d], j, get(packed.edge_plane2[d], j - 1));
+                    for (size_t j = reverse_offsets[v]; j < reverse_offsets[v + 1]; ++j) {
+                        if (slot[neighbor_of[j]] != no_slot) {
+                            const std::vector<index_t> &primitives = frontier[slot[neighbor_of[j]]];
+                            candidates.insert(candidates.end(), primitives.begin(), primitives.end());
+                        }
                     }
                 }
-            }
-            intercepted_faces_packed[v][i] = packed;
-        }
-    }
-}
-
-Result Impl::calc_closest_point(GEO::vec3 q) {
-    auto [v, v_dist2] = bvh.closestPoint(q);
-
-    float32xN_t qx = dupf32((float) q.x);
-    float32xN_t qy = dupf32((float) q.y);
-    float32xN_t qz = dupf32((float) q.z);
-
-    float32xN_t best_d2 = dupf32(v_dist2);
-    int32xN_t best_idx = dupi32(v);
+                take_untested(candidates, is_face ? tested_faces[c] : tested_edges[c]);
+                for (index_t primitive: candidates) {
+                    GEO::ConvexCell &C = scratch.cell;
+                    C = cell_of(v);
+                    Interception interception;
+                    if (is_face ? intercept_face(v, primitive, C, interception)
+                                : intercept_edge(v, primitive, C, interception)) {
+                        (is_face ? site_faces : site_edges)[c].push_back(interception);
+                        (is_face ? next_face_frontier : next_edge_frontier)[c].push_back(primitive);
+                    }
+                }
+            };
+            test(edge_frontier, false);
+            test(face_frontier, true);
+        };
+        auto in_old_list = [&old](index_t v, index_t primitive, bool is_face) {
+            const std::vector<size_t> &offsets = is_face ? old.face_offsets : old.edge_offsets;
+            const std::vector<Interception> &list = is_face ? old.faces : old.edges;
+            return std::any_of(list.begin() + (long) offsets[v], list.begin() + (long) offsets[v + 1],
+                               [primitive](const Interception &interception) {
+                                   return interception.primitive == primitive;
+                               });
+        };
 
-    const auto &v_edges = intercepted_edges_packed[v];
-    for (const PackedEdge &pack: v_edges) {
-        if (q.x < get(pack.min_x, 0)) {
-            break;
+        std::vector<GEO::ConvexCell> no_cells;
+        auto site_center = [this, &active_sites](index_t c) {
+            return site(active_sites[c]);
+        };
+        for (bool first_round = true;; first_round = false) {
+            for_each_primitive(*delaunay, no_cells, index_t(active_sites.size()), site_center,
+                               [&](index_t c, auto cell_of, SearchScratch &scratch) {
+                handle_site(c, cell_of, scratch, first_round);
+            });
+
+            bool done = true;
+            const index_t num_active = active_sites.size();
+            for (index_t c = 0; c < num_active; ++c) {
+                done = done && next_edge_frontier[c].empty() && next_face_frontier[c].empty();
+                edge_frontier[c].clear();
+                face_frontier[c].clear();
+                index_t v = active_sites[c];
+                for (size_t i = neighbor_offsets[v]; i < neighbor_offsets[v + 1]; ++i) {
+                    index_t n = neighbors[i];
+                    if (slot[n] == no_slot &&
+                        (std::any_of(next_edge_frontier[c].begin(), next_edge_frontier[c].end(),
+                                     [&](index_t e) { return !in_old_list(n, e, false); }) ||
+                         std::any_of(next_face_frontier[c].begin(), next_face_frontier[c].end(),
+                                     [&](index_t f) { return !in_old_list(n, f, true); }))) {
+                        activate(n);
+                    }
+                }
+            }
+            if (done) {
+                break;
+            }
+            std::swap(edge_frontier, next_edge_frontier);
+            std::swap(face_frontier, next_face_frontier);
         }
 
-        float32xN_t apx = sub(qx, pack.start[0]);
-        float32xN_t apy = sub(qy, pack.start[1]);
-        float32xN_t apz = sub(qz, pack.start[2]);
-
-        float32xN_t t = div(dot(apx, apy, apz, pack.dir[0], pack.dir[1], pack.dir[2]), pack.dir_len_squared);
-
-        // the result is only valid if t is in [0, 1]
-        maskN_t mask = logical_and(leq(dupf32(0.0f), t), leq(t, dupf32(1.0f)));
-
-        // project onto segment
-        float32xN_t projectedx = fma(t, pack.dir[0], pack.start[0]);
-        float32xN_t projectedy = fma(t, pack.dir[1], pack.start[1]);
-        float32xN_t projectedz = fma(t, pack.dir[2], pack.start[2]);
-
-        float32xN_t d2_line = distance_squared(qx, qy, qz, projectedx, projectedy, projectedz);
-
-        mask = logical_and(mask, leq(d2_line, best_d2));
-        best_d2 = select_float(mask, d2_line, best_d2);
-        best_idx = select_int(mask, pack.primitive_idx, best_idx);
+        // the sites of the propagation take their propagated interceptions, the others keep theirs, and all of
+        // them take the interceptions of the searched primitives
+        auto merge = [&](std::vector<size_t> &offsets, std::vector<Interception> &list,
+                         const std::vector<std::vector<Interception>> &propagated,
+                         const std::vector<size_t> &found_offsets, const std::vector<Interception> &found_list,
+                         const std::vector<char> &dirty) {
+            auto kept = [&dirty](const Interception &interception) {
+                return !dirty[interception.primitive];
+            };
+            std::vector<size_t> merged_offsets(nb_sites + 1, 0);
+            parallel_for(*executor, 0, nb_sites, [&](index_t s) {
+                size_t length = slot[s] != no_slot ? propagated[slot[s]].size()
+                                                   : std::count_if(list.begin() + (long) offsets[s],
+                                                                   list.begin() + (long) offsets[s + 1], kept);
+                merged_offsets[s + 1] = length + found_offsets[s + 1] - found_offsets[s];
+            });
+            std::partial_sum(merged_offsets.begin(), merged_offsets.end(), merged_offsets.begin());
+            std::vector<Interception> merged(merged_offsets.back());
+            parallel_for(*executor, 0, nb_sites, [&](index_t s) {
+                auto out = merged.begin() + (long) merged_offsets[s];
+                if (slot[s] != no_slot) {
+                    out = std::copy(propagated[slot[s]].begin(), propagated[slot[s]].end(), out);
+                } else {
+                    out = std::copy_if(list.begin() + (long) offsets[s], list.begin() + (long) offsets[s + 1], out,
+                                       kept);
+                }
+                std::copy(found_list.begin() + (long) found_offsets[s],
+                          found_list.begin() + (long) found_offsets[s + 1], out);
+            });
+            offsets.swap(merged_offsets);
+            list.swap(merged);
+        };
+        merge(interception_lists.edge_offsets, interception_lists.edges, site_edges, found.edge_offsets,
+              found.edges, dirty_edges);
+        merge(interception_lists.face_offsets, interception_lists.faces, site_faces, found.face_offsets,
+              found.faces, dirty_faces);
+        parallel_for(*executor, 0, nb_sites, [&](index_t v) {
+            if (slot[v] != no_slot || found.edge_offsets[v + 1] > found.edge_offsets[v] ||
+                found.face_offsets[v + 1] > found.face_offsets[v]) {
+                sort_site_lists(interception_lists, v);
+            }
+        });
     }
-
-    const auto &v_faces = intercepted_faces_packed[v];
-    for (const PackedFace &pack: v_faces) {
-        if (q.x < get(pack.min_x, 0)) {
-            break;
-        }
-
-        // point is inside face region if it is on the positive side of all three planes
-        float32xN_t s0 = eval_plane(qx, qy, qz, pack.edge_plane0[0], pack.edge_plane0[1], pack.edge_plane0[2],
-                                    pack.edge_plane0[3]);
-        float32xN_t s1 = eval_plane(qx, qy, qz, pack.edge_plane1[0], pack.edge_plane1[1], pack.edge_plane1[2],
-                                    pack.edge_plane1[3]);
-        float32xN_t s2 = eval_plane(qx, qy, qz, pack.edge_plane2[0], pack.edge_plane2[1], pack.edge_plane2[2],
-                                    pack.edge_plane2[3]);
-
-        maskN_t mask = logical_and(logical_and(leq(dupf32(0.0f), s0), leq(dupf32(0.0f), s1)),
-                                      leq(dupf32(0.0f), s2));
-
-        float32xN_t d2 = eval_plane(qx, qy, qz, pack.face_plane[0], pack.face_plane[1], pack.face_plane[2],
-                                    pack.face_plane[3]);
-        d2 = mul(d2, d2);
-
-        mask = logical_and(mask, leq(d2, best_d2));
-        best_d2 = select_float(mask, d2, best_d2);
-        best_idx = select_int(mask, pack.primitive_idx, best_idx);
+    update.interceptions_ms = milliseconds_since(start);
+    update.delaunay_ms = stats.delaunay_ms - before.delaunay_ms;
+
+    stats.max_list_length = 0;
+    for (index_t s = 0; s < nb_sites; ++s) {
+        size_t length = interception_lists.edge_offsets[s + 1] - interception_lists.edge_offsets[s] +
+                        interception_lists.face_offsets[s + 1] - interception_lists.face_offsets[s];
+        stats.max_list_length = std::max(stats.max_list_length, length);
     }
+    return rebuild;
+}
 
-    Result result{get(best_d2, 0), get(best_idx, 0)};
-
-    // Find overall minimum distance and index
-    for (int j = 1; j < SimdWidth; ++j) {
-        if (get(best_d2, j) < result.distance_squared) {
-            result.distance_squared = get(best_d2, j);
-            result.primitive_index = get(best_idx, j);
-        }
-    }
+Result Impl::make_result(GEO::vec3 q, float distance_squared, int primitive) const {
+    Result result{distance_squared, primitive};
 
     GEO::vec3 cp;
     if (result.primitive_index < points.size()) {
@@ -1417,9 +2845,217 @@ Result Impl::calc_closest_point(GEO::vec3 q) {
     return result;
 }
 
+double Impl::face_distance_squared(index_t f, GEO::vec3 q) const {
+    auto [v0, v1, v2] = triangles[f];
+    GEO::vec3 p0 = points[v0];
+    GEO::vec3 p1 = points[v1];
+    GEO::vec3 p2 = points[v2];
+    const GEO::vec4 &plane = faces[f].face_plane;
+    GEO::vec3 n(plane.x, plane.y, plane.z);
+
+    // the same edge planes as in face_regions, only their sign matters
+    if (GEO::dot(GEO::cross(p2 - p1, n), p1 - q) < 0 || GEO::dot(GEO::cross(p0 - p2, n), p2 - q) < 0 ||
+        GEO::dot(GEO::cross(p1 - p0, n), p0 - q) < 0) {
+        return std::numeric_limits<double>::infinity();
+    }
+    double d = GEO::dot(n, q) + plane.w;
+    return d * d;
+}
+
+// ============================= SIMD KERNELS ===============================
+
+// The simd dependent code is compiled once per instruction set, each time into its own namespace.
+
+#ifdef MANTIS_KERNELS_NEON
+#define MANTIS_HAS_NEON
+namespace neon {
+#include "mantis_simd.inl"
+}
+#undef MANTIS_HAS_NEON
+#endif
+
+#ifdef MANTIS_KERNELS_SSE
+MANTIS_BEGIN_TARGET_SSE
+#define MANTIS_HAS_AVX
+#if defined(__FMA__) && !defined(MANTIS_RUNTIME_DISPATCH)
+#define MANTIS_HAS_FMA
+#endif
+namespace sse {
+#include "mantis_simd.inl"
+}
+#undef MANTIS_HAS_FMA
+#undef MANTIS_HAS_AVX
+MANTIS_END_TARGET
+#endif
+
+// every cpu supporting AVX2 also supports FMA3
+#ifdef MANTIS_KERNELS_AVX2
+MANTIS_BEGIN_TARGET_AVX2
+#define MANTIS_HAS_AVX
+#define MANTIS_HAS_AVX2
+#define MANTIS_HAS_FMA
+namespace avx2 {
+#include "mantis_simd.inl"
+}
+#undef MANTIS_HAS_FMA
+#undef MANTIS_HAS_AVX2
+#undef MANTIS_HAS_AVX
+MANTIS_END_TARGET
+#endif
+
+#ifdef MANTIS_KERNELS_AVX512
+MANTIS_BEGIN_TARGET_AVX512
+#define MANTIS_HAS_AVX
+#define MANTIS_HAS_AVX512
+#define MANTIS_HAS_FMA
+namespace avx512 {
+#include "mantis_simd.inl"
+}
+#undef MANTIS_HAS_FMA
+#undef MANTIS_HAS_AVX512
+#undef MANTIS_HAS_AVX
+MANTIS_END_TARGET
+#endif
+
+// ============================= DISPATCH ===============================
+
+bool cpu_supports(InstructionSet instruction_set) {
+#if defined(MANTIS_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool sse41 = info[2] & (1 << 19);
+    bool fma = info[2] & (1 << 12);
+    bool osxsave = info[2] & (1 << 27);
+    // the os has to save the ymm and zmm registers on context switches
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    bool avx2 = false, avx512 = false;
+    if (max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6;
+        avx512 = (info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;
+    }
+    switch (instruction_set) {
+        case InstructionSet::SSE: return sse41;
+        case InstructionSet::AVX2: return avx2 && fma;
+        case InstructionSet::AVX512: return avx512 && avx2 && fma;
+        default: return false;
+    }
+#elif defined(MANTIS_X86)
+    switch (instruction_set) {
+        case InstructionSet::SSE: return __builtin_cpu_supports("sse4.1");
+        case InstructionSet::AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case InstructionSet::AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+                   __builtin_cpu_supports("fma");
+        default: return false;
+    }
+#else
+    // without runtime dispatch the library only runs on cpus it was compiled for
+    return instruction_set == InstructionSet::NEON;
+#endif
+}
+
+bool is_compiled(InstructionSet instruction_set) {
+    switch (instruction_set) {
+#ifdef MANTIS_KERNELS_NEON
+        case InstructionSet::NEON: return true;
+#endif
+#ifdef MANTIS_KERNELS_SSE
+        case InstructionSet::SSE: return true;
+#endif
+#ifdef MANTIS_KERNELS_AVX2
+        case InstructionSet::AVX2: return true;
+#endif
+#ifdef MANTIS_KERNELS_AVX512
+        case InstructionSet::AVX512: return true;
+#endif
+        default: return false;
+    }
+}
+
+bool is_supported(InstructionSet instruction_set) {
+    if (instruction_set == InstructionSet::Auto) {
+        return true;
+    }
+#ifdef MANTIS_RUNTIME_DISPATCH
+    return is_compiled(instruction_set) && cpu_supports(instruction_set);
+#else
+    return is_compiled(instruction_set);
+#endif
+}
+
+Impl *create_impl(std::vector<GEO::vec3> points, std::vector<std::array<uint32_t, 3>> triangles,
+                  const BuildOptions &options) {
+    InstructionSet instruction_set = options.instruction_set;
+    if (instruction_set == InstructionSet::Auto) {
+        for (InstructionSet candidate: {InstructionSet::AVX512, InstructionSet::AVX2, InstructionSet::SSE,
+                                        InstructionSet::NEON}) {
+            if (is_supported(candidate)) {
+                instruction_set = candidate;
+                break;
+            }
+        }
+    }
+    if (instruction_set == InstructionSet::Auto || !is_supported(instruction_set)) {
+        throw std::runtime_error("Mantis: the requested instruction set is not supported by this cpu or build.");
+    }
+
+    switch (instruction_set) {
+#ifdef MANTIS_KERNELS_NEON
+        case InstructionSet::NEON: return new neon::SimdImpl(std::move(points), std::move(triangles), options);
+#endif
+#ifdef MANTIS_KERNELS_SSE
+        case InstructionSet::SSE: return new sse::SimdImpl(std::move(points), std::move(triangles), options);
+#endif
+#ifdef MANTIS_KERNELS_AVX2
+        case InstructionSet::AVX2: return new avx2::SimdImpl(std::move(points), std::move(triangles), options);
+#endif
+#ifdef MANTIS_KERNELS_AVX512
+        case InstructionSet::AVX512: return new avx512::SimdImpl(std::move(points), std::move(triangles), options);
+#endif
+        default: return nullptr;
+    }
+}
+
+// Reads the structure saved with the instruction set of the header. Returns null if this build or cpu cannot use
+// its packed lists, then nothing is read.
+Impl *load_impl(const FileHeader &header, std::vector<GEO::vec3> &points,
+                std::vector<std::array<uint32_t, 3>> &triangles, const BuildOptions &options, BinaryReader &in) {
+    auto instruction_set = InstructionSet(header.instruction_set);
+    if (in.swap_bytes || header.size_t_bytes != sizeof(size_t) || instruction_set == InstructionSet::Auto ||
+        !is_supported(instruction_set)) {
+        return nullptr;
+    }
+    switch (instruction_set) {
+#ifdef MANTIS_KERNELS_NEON
+        case InstructionSet::NEON:
+            if (header.simd_width != neon::SimdWidth) return nullptr;
+            return new neon::SimdImpl(std::move(points), std::move(triangles), options, in);
+#endif
+#ifdef MANTIS_KERNELS_SSE
+        case InstructionSet::SSE:
+            if (header.simd_width != sse::SimdWidth) return nullptr;
+            return new sse::SimdImpl(std::move(points), std::move(triangles), options, in);
+#endif
+#ifdef MANTIS_KERNELS_AVX2
+        case InstructionSet::AVX2:
+            if (header.simd_width != avx2::SimdWidth) return nullptr;
+            return new avx2::SimdImpl(std::move(points), std::move(triangles), options, in);
+#endif
+#ifdef MANTIS_KERNELS_AVX512
+        case InstructionSet::AVX512:
+            if (header.simd_width != avx512::SimdWidth) return nullptr;
+            return new avx512::SimdImpl(std::move(points), std::move(triangles), options, in);
+#endif
+        default: return nullptr;
+    }
+}
+
 AccelerationStructure::AccelerationStructure(const float *points, size_t num_points, const uint32_t *indices,
                                              size_t num_faces,
-                                             float limit_cube_len) {
+                                             const BuildOptions &options) {
     std::vector<GEO::vec3> points_vec(num_points);
     for (size_t i = 0; i < num_points; ++i) {
         points_vec[i] = {points[3 * i], points[3 * i + 1], points[3 * i + 2]};
@@ -1429,14 +3065,31 @@ AccelerationStructure::AccelerationStructure(const float *points, size_t num_poi
         faces_vec[i] = {indices[3 * i], indices[3 * i + 1], indices[3 * i + 2]};
     }
     deduplicate_points(points_vec, faces_vec);
-    impl = new Impl(points_vec, faces_vec, limit_cube_len);
+    impl = create_impl(std::move(points_vec), std::move(faces_vec), options);
 }
 
 AccelerationStructure::AccelerationStructure(const std::vector<std::array<float, 3>> &points,
                                              const std::vector<std::array<uint32_t, 3>> &triangles,
-                                             float limit_cube_len) :
+                                             const BuildOptions &options) :
         AccelerationStructure((const float *) points.data(), points.size(), (const uint32_t *) triangles.data(),
-                              triangles.size(), limit_cube_len) {}
+                              triangles.size(), options) {}
+
+// the options of the constructors that only take the size of the limit cube
+inline BuildOptions limit_cube_options(float limit_cube_len) {
+    BuildOptions options;
+    options.limit_cube_len = limit_cube_len;
+    return options;
+}
+
+AccelerationStructure::AccelerationStructure(const float *points, size_t num_points, const uint32_t *indices,
+                                             size_t num_faces,
+                                             float limit_cube_len) :
+        AccelerationStructure(points, num_points, indices, num_faces, limit_cube_options(limit_cube_len)) {}
+
+AccelerationStructure::AccelerationStructure(const std::vector<std::array<float, 3>> &points,
+                                             const std::vector<std::array<uint32_t, 3>> &triangles,
+                                             float limit_cube_len) :
+        AccelerationStructure(points, triangles, limit_cube_options(limit_cube_len)) {}
 
 AccelerationStructure::AccelerationStructure(AccelerationStructure &&other) noexcept {
     impl = other.impl;
@@ -1452,6 +3105,110 @@ AccelerationStructure &AccelerationStructure::operator=(AccelerationStructure &&
     return *this;
 }
 
+UpdateStats AccelerationStructure::update_positions(const uint32_t *indices, size_t num_indices,
+                                                    const float *positions) {
+    for (size_t i = 0; i < num_indices; ++i) {
+        if (indices[i] >= impl->points.size()) {
+            throw std::runtime_error("Mantis: update_positions got the vertex index " + std::to_string(indices[i]) +
+                                     ", but the mesh has " + std::to_string(impl->points.size()) + " vertices.");
+        }
+    }
+    if (impl->can_update()) {
+        return impl->update_positions(indices, num_indices, positions);
+    }
+
+    // rebuild from scratch, with the data of incremental updates unless the options rule them out
+    auto start = std::chrono::steady_clock::now();
+    UpdateStats update;
+    std::vector<GEO::vec3> points = impl->points;
+    std::vector<char> moved(points.size(), 0);
+    for (size_t i = 0; i < num_indices; ++i) {
+        points[indices[i]] = {positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]};
+        moved[indices[i]] = 1;
+    }
+    Impl *rebuilt = create_impl(std::move(points), impl->triangles, impl->build_options());
+    delete impl;
+    impl = rebuilt;
+
+    update.num_moved_vertices = std::count(moved.begin(), moved.end(), 1);
+    update.num_changed_cells = impl->num_sites();
+    update.num_recomputed_faces = impl->triangles.size();
+    update.num_recomputed_edges = impl->edges.size();
+    update.rebuilt = true;
+    update.delaunay_ms = impl->stats.delaunay_ms;
+    update.interceptions_ms = impl->stats.voronoi_cells_ms + impl->stats.face_interceptions_ms +
+                              impl->stats.edge_interceptions_ms + impl->stats.site_interceptions_ms +
+                              impl->stats.transpose_ms;
+    update.packing_ms = impl->stats.packing_ms;
+    update.total_ms = milliseconds_since(start);
+    return update;
+}
+
+UpdateStats AccelerationStructure::update_positions(const std::vector<uint32_t> &indices,
+                                                    const std::vector<std::array<float, 3>> &positions) {
+    if (indices.size() != positions.size()) {
+        throw std::runtime_error("Mantis: update_positions got " + std::to_string(indices.size()) + " indices and " +
+                                 std::to_string(positions.size()) + " positions.");
+    }
+    return update_positions(indices.data(), indices.size(), (const float *) positions.data());
+}
+
+void AccelerationStructure::save(const std::string &path) const {
+    BinaryWriter out(path);
+    impl->save(out);
+    out.finish();
+}
+
+// Reads the structure of a file written by AccelerationStructure::save, see AccelerationStructure::load
+Impl *read_impl(BinaryReader &in, const BuildOptions &options) {
+    FileHeader header{};
+    in.read_bytes(&header, sizeof(FileHeader));
+    in.check(std::memcmp(header.magic, FileMagic, sizeof(FileMagic)) == 0);
+    if (header.byte_order != FileByteOrder) {
+        std::reverse((char *) &header.byte_order, (char *) &header.byte_order + 4);
+        in.check(header.byte_order == FileByteOrder);
+        in.swap_bytes = true;
+        for (uint32_t *field: {&header.version, &header.instruction_set, &header.simd_width, &header.size_t_bytes}) {
+            std::reverse((char *) field, (char *) field + 4);
+        }
+    }
+    if (header.version != FileVersion) {
+        throw std::runtime_error("Mantis: " + in.path + " has the unsupported file version " +
+                                 std::to_string(header.version) + ".");
+    }
+
+    // the threads are the ones given, the other options the ones the structure was built with
+    BuildOptions file_options = options;
+    read_build_options(in, file_options);
+    file_options.instruction_set = InstructionSet(header.instruction_set);
+    std::vector<GEO::vec3> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    in.read_array<double>(points);
+    in.read_array<uint32_t>(triangles);
+
+    Impl *impl = load_impl(header, points, triangles, file_options, in);
+    if (!impl) {
+        // the packed lists cannot be used on this machine, rebuild them from the mesh
+        file_options.instruction_set = InstructionSet::Auto;
+        impl = create_impl(std::move(points), std::move(triangles), file_options);
+    }
+    return impl;
+}
+
+AccelerationStructure AccelerationStructure::load(const std::string &path, const BuildOptions &options) {
+    BinaryReader in(path);
+    AccelerationStructure result;
+    result.impl = read_impl(in, options);
+    return result;
+}
+
+AccelerationStructure AccelerationStructure::map(const std::string &path, const BuildOptions &options) {
+    BinaryReader in(path, true);
+    AccelerationStructure result;
+    result.impl = read_impl(in, options);
+    return result;
+}
+
 Result AccelerationStructure::calc_closest_point(float x, float y, float z) const {
     return impl->calc_closest_point({x, y, z});
 }
@@ -1460,22 +3217,22 @@ Result AccelerationStructure::calc_closest_point(std::array<float, 3> q) const {
     return impl->calc_closest_point({q[0], q[1], q[2]});
 }
 
-std::vector<std::array<uint32_t, 3>> AccelerationStructure::get_face_edges() const {
-    std::vector<std::array<uint32_t, 3>> result(num_faces());
-    std::vector<int> current_index(num_faces(), 0);
-
-    for (size_t i = 0; i < num_faces(); ++i) {
-        const auto &f = impl->faces[i];
-        for (size_t j = 0; j < 3; ++j) {
-            auto v0 = impl->triangles[i][j];
-            auto v1 = impl->triangles[i][(j + 1) % 3];
-            auto it = impl->edge_index.find(std::minmax(v0, v1));
-            assert(it != impl->edge_index.end());
-            auto idx = it->second;
-            result[i][current_index[i]++] = idx;
+void AccelerationStructure::calc_closest_points(const float *queries, size_t num_queries, Result *results) const {
+    parallel_for_chunks(*impl->executor, 0, num_queries, 1024, [this, queries, results](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            results[i] = impl->calc_closest_point({queries[3 * i], queries[3 * i + 1], queries[3 * i + 2]});
         }
-    }
-    return result;
+    });
+}
+
+std::vector<Result> AccelerationStructure::calc_closest_points(const std::vector<std::array<float, 3>> &queries) const {
+    std::vector<Result> results(queries.size());
+    calc_closest_points((const float *) queries.data(), queries.size(), results.data());
+    return results;
+}
+
+std::vector<std::array<uint32_t, 3>> AccelerationStructure::get_face_edges() const {
+    return impl->face_edges;
 }
 
 std::vector<std::pair<uint32_t, uint32_t>> AccelerationStructure::get_edge_vertices() const {
@@ -1517,6 +3274,29 @@ size_t AccelerationStructure::num_vertices() const {
     return impl->points.size();
 }
 
+size_t AccelerationStructure::memory_usage() const {
+    return impl->memory_usage();
+}
+
+InstructionSet AccelerationStructure::instruction_set() const {
+    return impl->instruction_set();
+}
+
+const BuildStats &AccelerationStructure::stats() const {
+    return impl->stats;
+}
+
+QueryStats AccelerationStructure::query_stats(const std::vector<std::array<float, 3>> &queries) const {
+    QueryStats stats;
+    for (const auto &q: queries) {
+        impl->calc_closest_point(GEO::vec3(q[0], q[1], q[2]), stats.num_packets_scanned);
+    }
+    stats.num_queries = queries.size();
+    stats.packets_scanned_per_query =
+            queries.empty() ? 0.0 : double(stats.num_packets_scanned) / double(queries.size());
+    return stats;
+}
+
 AccelerationStructure::~AccelerationStructure() {
     delete impl;
 }
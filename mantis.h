@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <vector>
 #include <array>
+#include <functional>
+#include <memory>
+#include <string>
 
 namespace mantis {
 
@@ -22,12 +25,263 @@ struct Result {
 
 struct Impl;
 
+// Instruction sets the query kernels can be compiled for
+enum class InstructionSet {
+    // the widest instruction set supported by the cpu
+    Auto,
+    NEON,
+    SSE,
+    AVX2,
+    AVX512
+};
+
+// Returns true if the kernels for the instruction set are part of this build and the cpu can execute them.
+bool is_supported(InstructionSet instruction_set);
+
+// Storage of the faces in the interception lists of the vertices
+enum class FaceStorage {
+    // The planes of every face are copied into the lists of all vertices that intercept it. Fastest queries.
+    Packed,
+    // The planes of every face are stored once in a shared table and only face indices are kept in the lists.
+    // The planes are gathered from the table during queries, which makes them slower, but the acceleration
+    // structure of large meshes shrinks considerably.
+    Shared,
+    // Like Packed, but the planes are stored in half precision relative to the vertex, which roughly halves
+    // the size of the face lists. The half precision tests are conservative and faces that could be the
+    // closest are verified in double precision, so the results stay exact.
+    Compressed
+};
+
+// Runs the parallel loops of the library, during construction and in calc_closest_points. Implement it to
+// run them on the scheduler of the application, e.g. with tbb:
+//
+//   struct TbbExecutor : mantis::Executor {
+//       void parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t)> &body) override {
+//           tbb::parallel_for(tbb::blocked_range<size_t>(0, n, grain),
+//                             [&](const tbb::blocked_range<size_t> &r) { body(r.begin(), r.end()); });
+//       }
+//       size_t num_threads() const override { return tbb::this_task_arena::max_concurrency(); }
+//   };
+struct Executor {
+    virtual ~Executor() = default;
+
+    // Calls body(chunk_begin, chunk_end) on disjoint chunks covering [0, n), possibly concurrently, and returns
+    // once all calls returned. The chunks should hold about grain indices, the calls use them to share scratch
+    // space. If a call throws, one of the exceptions has to be rethrown.
+    virtual void parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t)> &body) = 0;
+
+    // the maximum number of concurrent calls of body
+    virtual size_t num_threads() const = 0;
+};
+
+// The executor used if none is given: a work stealing pool with a thread per hardware thread, started on first
+// use and shared by all acceleration structures. The calling thread works on its loops as well.
+Executor &default_executor();
+
+// Creates a work stealing pool like the default executor with the given number of threads, including the
+// calling thread
+std::unique_ptr<Executor> create_thread_pool(size_t num_threads);
+
+// Order of the primitives in the interception lists
+enum class ListOrder {
+    // Sorted by the lower x coordinate of their interception regions, so a query can stop scanning a list at the
+    // first region that starts beyond it.
+    LowerX,
+    // Sorted by decreasing volume of their interception regions, so the primitives most likely to be the closest
+    // come first. A packet is skipped if its primitives are farther away than the closest one found, but without
+    // the early stop of LowerX the queries scan more packets: 10 to 25% more on the test meshes.
+    Volume
+};
+
+struct BuildOptions {
+    // Half the side length of the cube that bounds all voronoi cells. All queries have to lie inside this cube.
+    float limit_cube_len = 1e3f;
+
+    // Release all data that is only needed while building the acceleration structure (e.g. the clipping
+    // planes of the edge and face regions) once construction completes. Queries are not affected.
+    bool compact = false;
+
+    // Instruction set of the query kernels. Forcing a specific one is mainly useful for testing and
+    // benchmarking; construction throws std::runtime_error if it is not supported.
+    InstructionSet instruction_set = InstructionSet::Auto;
+
+    // How the faces in the interception lists are stored, see FaceStorage
+    FaceStorage face_storage = FaceStorage::Packed;
+
+    // Target length of the interception lists, zero disables it. The query time is dominated by the list of
+    // the nearest voronoi site, and vertices with huge voronoi cells (e.g. at concave creases or on the convex
+    // hull) can have lists that are several times longer than average. If a list is longer, additional voronoi
+    // sites are inserted on the faces it intercepts and all lists are recomputed, for at most
+    // max_steiner_rounds rounds. Every round costs about one more construction. The target is not a hard
+    // bound: cells that extend far away from the surface keep part of their lists, the first round removes
+    // most of what can be removed.
+    size_t max_interceptions = 0;
+    int max_steiner_rounds = 2;
+
+    // Interception lists with more primitives than this are searched with a small box tree over their packets
+    // instead of a linear scan, zero disables the trees. The primitives of such a list are grouped into packets
+    // by the location of their interception regions, so the tree can skip most of the packets.
+    size_t local_tree_threshold = 0;
+
+    // Order of the primitives in the interception lists, see ListOrder. Lists searched with a box tree are
+    // ordered spatially instead.
+    ListOrder list_order = ListOrder::LowerX;
+
+    // Remove the primitives from the interception lists that can never be the closest one, because another
+    // primitive is closer everywhere in the bounding box of their interception region. The test is
+    // conservative, so the results do not change.
+    bool remove_dominated = false;
+
+    // Memory budget in bytes for the voronoi cells held during construction, zero keeps the cells of all
+    // voronoi sites in memory at once. Otherwise the cells are computed on demand and every thread caches the
+    // most recently used ones within its share of the budget. The faces and edges are processed in spatial
+    // order, so most cells are reused while they are cached. Cache misses recompute cells, which makes the
+    // construction slower, but bounds the memory of the cells on large meshes. Every thread caches at least 1024
+    // cells (a few MB) whatever the budget, fewer cells make the construction recompute every cell dozens of
+    // times.
+    size_t cell_memory_budget = 0;
+
+    // Build the interception lists site by site instead of primitive by primitive. Every site tests the
+    // primitives intercepted by its delaunay neighbors, in rounds until no site intercepts a new primitive, and
+    // writes only its own lists, so the lists do not have to be transposed. The lists are the same.
+    bool vertex_centric_build = false;
+
+    // Keep the interception lists before packing and the delaunay neighbors of the sites after construction, so
+    // that update_positions can recompute only the interceptions that change. This about doubles the memory of
+    // the lists. Without it, update_positions rebuilds the structure from scratch.
+    bool keep_update_data = false;
+
+    // update_positions recomputes the interceptions of all faces and edges, like a new construction, once the
+    // voronoi cells of more than this fraction of the sites changed, and rebuilds the tree over the voronoi sites
+    // instead of refitting it. Zero always recomputes everything.
+    float max_update_fraction = 0.5f;
+
+    // Runs the parallel loops of the construction and of calc_closest_points, the default executor if null. It
+    // has to outlive the acceleration structure.
+    Executor *executor = nullptr;
+
+    // Number of threads of the construction, zero for one per hardware thread (or per cpu of the affinity
+    // set). Several builds with fewer threads can run side by side with predictable throughput. Unless an
+    // executor is given, a pool with these threads runs the construction and update_positions and is stopped
+    // afterwards, calc_closest_points runs on the default executor. The count applies to the delaunay triangulation of geogram as well.
+    size_t num_threads = 0;
+
+    // Cpus the threads of the construction may run on, empty for no restriction. Only supported on Linux.
+    std::vector<int> cpu_affinity;
+
+    // NUMA node whose cpus the threads of the construction run on, -1 for no preference. Memory is placed on
+    // the node of the thread touching it first, so most of the acceleration structure ends up on the node.
+    // Combined with cpu_affinity, the threads run on the cpus of both. Only supported on Linux.
+    int numa_node = -1;
+};
+
+// Statistics about the packed interception lists, collected during construction
+struct BuildStats {
+    // number of lanes of the full width packets, the remainder of a list can go into 4 lane tail packets
+    size_t simd_width = 0;
+
+    // total length of the interception lists of all vertices
+    size_t num_edge_interceptions = 0;
+    size_t num_face_interceptions = 0;
+
+    size_t num_edge_packets = 0;
+    size_t num_face_packets = 0;
+    size_t num_edge_tail_packets = 0;
+    size_t num_face_tail_packets = 0;
+
+    // fraction of all packet lanes that hold a primitive instead of padding
+    double lane_utilization = 0.0;
+
+    // bytes occupied by the packed interception lists
+    size_t interception_bytes = 0;
+
+    // bytes occupied by the shared face table, zero unless the faces are stored as FaceStorage::Shared
+    size_t face_table_bytes = 0;
+
+    // voronoi sites inserted on the faces of the mesh to bound the list lengths, see
+    // BuildOptions::max_interceptions
+    size_t num_steiner_sites = 0;
+
+    // length of the longest interception list (edges and faces) of a voronoi site
+    size_t max_list_length = 0;
+
+    // interceptions removed because another primitive is always closer, see BuildOptions::remove_dominated.
+    // The interception counts above do not include them.
+    size_t num_dominated_interceptions = 0;
+
+    // voronoi sites whose lists are searched with a box tree, see BuildOptions::local_tree_threshold, and
+    // the bytes occupied by the nodes of all those trees
+    size_t num_local_tree_sites = 0;
+    size_t local_tree_bytes = 0;
+
+    // wall clock time of the construction phases in milliseconds, summed over the steiner rounds and the calls of
+    // AccelerationStructure::update_positions: triangulating the voronoi sites, extracting their voronoi cells,
+    // intercepting the faces and the edges, and packing the lists (including the box trees). With a cell memory
+    // budget, and in incremental updates, the cells are extracted while intercepting the faces and edges. The
+    // vertex centric build intercepts faces and edges together (site_interceptions_ms) and skips transposing the
+    // lists (transpose_ms).
+    double delaunay_ms = 0.0;
+    double voronoi_cells_ms = 0.0;
+    double face_interceptions_ms = 0.0;
+    double edge_interceptions_ms = 0.0;
+    double site_interceptions_ms = 0.0;
+    double transpose_ms = 0.0;
+    double packing_ms = 0.0;
+
+    // threads of the parallel loops of the construction
+    size_t num_threads = 0;
+
+    // peak bytes of the voronoi cells held during construction, see BuildOptions::cell_memory_budget, and the
+    // number of cells computed from the delaunay triangulation
+    size_t peak_cell_bytes = 0;
+    size_t num_cell_computations = 0;
+};
+
+// Statistics about the packets scanned by a set of queries, see AccelerationStructure::query_stats
+struct QueryStats {
+    size_t num_queries = 0;
+
+    // packets whose primitives were tested, i.e. the query lies in the box of their interception regions and
+    // they could contain a primitive closer than the closest one found so far
+    size_t num_packets_scanned = 0;
+
+    double packets_scanned_per_query = 0.0;
+};
+
+// Statistics about a call of AccelerationStructure::update_positions
+struct UpdateStats {
+    size_t num_moved_vertices = 0;
+
+    // voronoi sites whose cell changed, i.e. that moved or whose delaunay neighbors changed or moved
+    size_t num_changed_cells = 0;
+
+    // faces and edges at the moved vertices, whose interceptions were searched again (all of them if rebuilt)
+    size_t num_recomputed_faces = 0;
+    size_t num_recomputed_edges = 0;
+
+    // all interception lists were recomputed, see BuildOptions::max_update_fraction and update_positions
+    bool rebuilt = false;
+
+    // wall clock time of the update and of its phases in milliseconds: triangulating the voronoi sites,
+    // recomputing the interceptions (including the voronoi cells), and refitting the tree over the sites and
+    // packing the lists
+    double total_ms = 0.0;
+    double delaunay_ms = 0.0;
+    double interceptions_ms = 0.0;
+    double packing_ms = 0.0;
+};
+
 struct AccelerationStructure {
     AccelerationStructure(const float *points, size_t num_points, const uint32_t *indices, size_t num_faces,
                    float limit_cube_len = 1e3f);
 
     AccelerationStructure(const std::vector<std::array<float, 3>>& points, const std::vector<std::array<uint32_t, 3>>& triangles, float limit_cube_len = 1e3f);
 
+    AccelerationStructure(const float *points, size_t num_points, const uint32_t *indices, size_t num_faces,
+                          const BuildOptions &options);
+
+    AccelerationStructure(const std::vector<std::array<float, 3>>& points, const std::vector<std::array<uint32_t, 3>>& triangles, const BuildOptions &options);
+
     // no copying
     AccelerationStructure(const AccelerationStructure&) = delete;
     AccelerationStructure& operator=(const AccelerationStructure&) = delete;
@@ -39,6 +293,12 @@ struct AccelerationStructure {
 
     Result calc_closest_point(std::array<float, 3> q) const;
 
+    // Runs the queries in parallel on the executor of the build options. queries holds num_queries x, y, z
+    // triples and results num_queries results.
+    void calc_closest_points(const float *queries, size_t num_queries, Result *results) const;
+
+    std::vector<Result> calc_closest_points(const std::vector<std::array<float, 3>> &queries) const;
+
     size_t num_edges() const;
     size_t num_faces() const;
     size_t num_vertices() const;
@@ -58,9 +318,61 @@ struct AccelerationStructure {
 
     std::pair<uint32_t, uint32_t> get_edge(size_t index) const;
 
+    // Returns the number of heap allocated bytes owned by the acceleration structure
+    size_t memory_usage() const;
+
+    // Returns the instruction set the query kernels of this acceleration structure use
+    InstructionSet instruction_set() const;
+
+    const BuildStats &stats() const;
+
+    // Runs the queries and counts the packets they scan. Slightly slower than calc_closest_point, meant for
+    // comparing build options on representative queries.
+    QueryStats query_stats(const std::vector<std::array<float, 3>> &queries) const;
+
+    // Moves the vertices indices[i] to (positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]), keeping the
+    // faces, and updates the acceleration structure, so the queries return the same results as a new construction
+    // on the moved mesh. The indices are the ones of get_positions, which merges duplicate vertices. The vertices
+    // have to stay distinct and inside the limit cube.
+    // Only the interceptions that can change are recomputed: the ones of the faces and edges at the moved vertices,
+    // and the ones of the voronoi cells that changed. The delaunay triangulation is
+    // recomputed as a whole, it is a small part of the construction. Past BuildOptions::max_update_fraction
+    // everything is recomputed. Only structures built with BuildOptions::keep_update_data keep the data of an
+    // incremental update, others are rebuilt from scratch. So are the ones built with compact, max_interceptions
+    // or remove_dominated, and loaded or mapped ones (loaded ones only on their first update). Throws
+    // std::runtime_error if an index is out of range.
+    UpdateStats update_positions(const uint32_t *indices, size_t num_indices, const float *positions);
+
+    UpdateStats update_positions(const std::vector<uint32_t> &indices,
+                                 const std::vector<std::array<float, 3>> &positions);
+
+    // Writes the acceleration structure to a binary file, see load. Throws std::runtime_error if the file cannot
+    // be written.
+    void save(const std::string &path) const;
+
+    // Reads an acceleration structure written by save, which takes milliseconds instead of a full construction.
+    // The file is stamped with the format version, the byte order and the instruction set and width of the
+    // packed interception lists. If this build or cpu cannot use the packed lists, they are rebuilt from the mesh
+    // stored in the file. Only the threads are taken from options (executor, num_threads, cpu_affinity and
+    // numa_node), all other options are the ones the structure was built with. Throws std::runtime_error if the
+    // file cannot be read, is not an acceleration structure file or has an unsupported version.
+    static AccelerationStructure load(const std::string &path, const BuildOptions &options = {});
+
+    // Like load, but the file is memory mapped and the packed interception lists and the tree over the voronoi
+    // sites are used in place instead of being copied. Only the mesh is copied, and processes mapping the same
+    // file share its pages in the page cache. Like load, map checks every index the queries follow: the primitives
+    // of all packets, the box trees of the lists and the nodes and leaves of the tree over the sites. This reads
+    // all pages of the file once while opening it, later the kernel can drop them and read them back on use. The
+    // file must not be modified while the structure exists. Without mmap (e.g. on Windows) the file is loaded
+    // instead.
+    static AccelerationStructure map(const std::string &path, const BuildOptions &options = {});
+
     ~AccelerationStructure();
 
     Impl *impl = nullptr;
+
+private:
+    AccelerationStructure() = default;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,2179 @@
+// Everything that depends on the simd instruction set: the vector types and helpers, the packed
+// interception lists, the vertex bvh and the query kernels.
+//
+// This file is not compiled on its own. mantis.cpp includes it once per supported instruction set, each
+// time into its own namespace (mantis::sse, mantis::avx2, ...) with the matching MANTIS_HAS_* macros
+// defined and, when dispatching at runtime, with the code generation target switched to that
+// instruction set. It therefore must not include any headers itself.
+
+#ifdef MANTIS_HAS_NEON
+// float32x4_t and int32x4_t are already defined in arm_neon.h
+using mask4_t = uint32x4_t;
+#endif
+
+#ifdef MANTIS_HAS_AVX
+using float32x4_t = __m128;
+using int32x4_t = __m128i;
+using mask4_t = __m128i;
+#endif
+
+#ifdef MANTIS_HAS_AVX2
+using float32x8_t = __m256;
+using int32x8_t = __m256i;
+using mask8_t = __m256i;
+#endif
+
+#ifdef MANTIS_HAS_AVX512
+using float32x16_t = __m512;
+using int32x16_t = __m512i;
+using mask16_t = __mmask16;
+#endif
+
+#ifdef MANTIS_HAS_AVX512
+constexpr size_t SimdWidth = 16;
+using float32xN_t = float32x16_t;
+using int32xN_t = int32x16_t;
+using maskN_t = mask16_t;
+#elif defined(MANTIS_HAS_AVX2)
+constexpr size_t SimdWidth = 8;
+using float32xN_t = float32x8_t;
+using int32xN_t = int32x8_t;
+using maskN_t = mask8_t;
+#else
+// For both SSE, AVX and NEON
+constexpr size_t SimdWidth = 4;
+using float32xN_t = float32x4_t;
+using int32xN_t = int32x4_t;
+using maskN_t = mask4_t;
+#endif
+
+// Every instruction set also provides 4 lane vectors. They are used for the tails of interception lists
+// that would leave most lanes of a full width packet empty.
+constexpr size_t TailWidth = 4;
+
+// Vector types by number of lanes
+template<size_t N>
+struct SimdTypes;
+
+template<>
+struct SimdTypes<4> {
+    using Float = float32x4_t;
+    using Int = int32x4_t;
+    using Mask = mask4_t;
+};
+
+#ifdef MANTIS_HAS_AVX2
+template<>
+struct SimdTypes<8> {
+    using Float = float32x8_t;
+    using Int = int32x8_t;
+    using Mask = mask8_t;
+};
+#endif
+
+#ifdef MANTIS_HAS_AVX512
+template<>
+struct SimdTypes<16> {
+    using Float = float32x16_t;
+    using Int = int32x16_t;
+    using Mask = mask16_t;
+};
+#endif
+
+// ============================= PACKETS ===============================
+
+// All structs holding simd vectors state their alignment explicitly. When the kernels are compiled for
+// a different target than the rest of the library, gcc only knows the alignment of the wide vector
+// types inside the target region, so e.g. std::vector would allocate them misaligned.
+constexpr size_t SimdAlignment = sizeof(float32xN_t);
+
+template<size_t N = SimdWidth>
+struct alignas(sizeof(typename SimdTypes<N>::Float)) PackedEdge {
+    // box of the interception regions, then the bounds of the primitives themselves, which bound the
+    // distances to all of them from below
+    PacketBox box;
+    PacketBox extent;
+    typename SimdTypes<N>::Float start[3];
+    typename SimdTypes<N>::Float dir[3];
+    // precomputed, so the kernel does not need to divide
+    typename SimdTypes<N>::Float inv_dir_len_squared;
+    typename SimdTypes<N>::Int primitive_idx;
+};
+
+template<size_t N = SimdWidth>
+struct alignas(sizeof(typename SimdTypes<N>::Float)) PackedFace {
+    PacketBox box;
+    PacketBox extent;
+    typename SimdTypes<N>::Float face_plane[4];
+    typename SimdTypes<N>::Float edge_plane0[4];
+    typename SimdTypes<N>::Float edge_plane1[4];
+    typename SimdTypes<N>::Float edge_plane2[4];
+    typename SimdTypes<N>::Int primitive_idx;
+};
+
+// Face packet of the compressed face layout. The normals of the face plane and the edge planes are stored in
+// half precision. Their offsets are relative to the vertex the list belongs to, divided by offset_scale and
+// then stored in half precision as well.
+template<size_t N = SimdWidth>
+struct alignas(sizeof(typename SimdTypes<N>::Float)) CompressedFace {
+    PacketBox box;
+    PacketBox extent;
+    // power of two bounding the magnitude of all plane offsets
+    float offset_scale;
+    // [plane][coefficient][lane], the face plane followed by the three edge planes
+    uint16_t planes[4][4][N];
+    typename SimdTypes<N>::Int primitive_idx;
+};
+
+// Face packet of the shared face layout. Only the rows of the faces in the shared face table are stored,
+// their planes are gathered during the query.
+template<size_t N = SimdWidth>
+struct alignas(sizeof(typename SimdTypes<N>::Float)) IndexedFace {
+    PacketBox box;
+    PacketBox extent;
+    typename SimdTypes<N>::Int face_idx;
+};
+
+// Storage unit of the packet arena. The simd type is wrapped in a struct, since its alignment
+// attribute is dropped when it is used as template argument of std::vector.
+struct alignas(SimdAlignment) SimdBlock {
+    float data[SimdWidth];
+};
+
+// Number of simd vectors occupied by num_packets consecutive packets, rounded up so the next group of
+// packets starts aligned
+template<class Packet>
+constexpr size_t num_blocks(size_t num_packets) {
+    return (num_packets * sizeof(Packet) + sizeof(SimdBlock) - 1) / sizeof(SimdBlock);
+}
+
+static_assert(sizeof(PackedEdge<>) % sizeof(SimdBlock) == 0);
+static_assert(sizeof(PackedFace<>) % sizeof(SimdBlock) == 0);
+static_assert(sizeof(IndexedFace<>) % sizeof(SimdBlock) == 0);
+static_assert(sizeof(CompressedFace<>) % sizeof(SimdBlock) == 0);
+
+// Interception lists are split into full width packets and a few 4 lane tail packets. The tail is only
+// used if it needs at most this many packets, otherwise padding one more full width packet is cheaper
+// to scan.
+constexpr size_t MaxTailPackets = SimdWidth / TailWidth / 2;
+
+// Returns the number of full width and tail packets for an interception list of length n
+inline std::pair<uint32_t, uint32_t> split_packets(size_t n) {
+    size_t num_full = n / SimdWidth;
+    size_t num_tail = (n % SimdWidth + TailWidth - 1) / TailWidth;
+    if (num_tail > MaxTailPackets) {
+        return {uint32_t(num_full + 1), 0};
+    }
+    return {uint32_t(num_full), uint32_t(num_tail)};
+}
+
+struct alignas(sizeof(float32x4_t)) Node {
+    float32x4_t minCorners[3]; // x, y, z minimum corners for 4 boxes
+    float32x4_t maxCorners[3]; // x, y, z maximum corners for 4 boxes
+    int32x4_t children;
+};
+
+// Stack size of the traversals of the box trees. A traversal keeps at most three children of every level of
+// nodes on the stack, plus the children of the current node, which bounds the height of the trees.
+constexpr int TreeStackSize = 64;
+constexpr int MaxTreeHeight = (TreeStackSize - 2) / 3;
+
+// ============================= SIMD ===============================
+
+#ifdef MANTIS_HAS_NEON
+
+// a*b + c
+float32x4_t fma(float32x4_t a, float32x4_t b, float32x4_t c) {
+    return vmlaq_f32(c, a, b);
+}
+
+float32x4_t min(float32x4_t a, float32x4_t b) {
+    return vminq_f32(a, b);
+}
+
+float32x4_t max(float32x4_t a, float32x4_t b) {
+    return vmaxq_f32(a, b);
+}
+
+float32x4_t sub(float32x4_t a, float32x4_t b) {
+    return vsubq_f32(a, b);
+}
+
+float32x4_t add(float32x4_t a, float32x4_t b) {
+    return vaddq_f32(a, b);
+}
+
+float32x4_t mul(float32x4_t a, float32x4_t b) {
+    return vmulq_f32(a, b);
+}
+
+float32x4_t div(float32x4_t a, float32x4_t b) {
+    return vdivq_f32(a, b);
+}
+
+uint32x4_t leq(float32x4_t a, float32x4_t b) {
+    return vcleq_f32(a, b);
+}
+
+uint32x4_t geq(float32x4_t a, float32x4_t b) {
+    return vcgeq_f32(a, b);
+}
+
+uint32x4_t logical_and(uint32x4_t a, uint32x4_t b) {
+    return vandq_u32(a, b);
+}
+
+int32x4_t select_int(int32x4_t condition, int32x4_t trueValue, int32x4_t falseValue) {
+    return vbslq_s32(condition, trueValue, falseValue);
+}
+
+float32x4_t select_float(uint32x4_t condition, float32x4_t trueValue, float32x4_t falseValue) {
+    return vbslq_f32(condition, trueValue, falseValue);
+}
+
+template<int N = SimdWidth>
+float32x4_t dupf32(float x) {
+    static_assert(N == 4);
+    return vdupq_n_f32(x);
+}
+
+template<int N = SimdWidth>
+int32x4_t dupi32(int32_t x) {
+    static_assert(N == 4);
+    return vdupq_n_s32(x);
+}
+
+// repeats the four lanes of x across a vector of width N
+template<int N = SimdWidth>
+float32x4_t dupf32x4(float32x4_t x) {
+    static_assert(N == 4);
+    return x;
+}
+
+template<int N = SimdWidth>
+int32x4_t dupi32x4(int32x4_t x) {
+    static_assert(N == 4);
+    return x;
+}
+
+int32x4_t add(int32x4_t a, int32x4_t b) {
+    return vaddq_s32(a, b);
+}
+
+// one bit per lane, lane 0 in the lowest bit
+int mask_bits(uint32x4_t mask) {
+    const uint32_t weights[4] = {1, 2, 4, 8};
+    return (int) vaddvq_u32(vandq_u32(mask, vld1q_u32(weights)));
+}
+
+// Loads N half precision values written by float_to_half
+template<int N = SimdWidth>
+float32x4_t load_half(const uint16_t *p) {
+    static_assert(N == 4);
+    return vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(p)));
+}
+
+// Loads the planes of the given rows of the shared face table, transposed so that planes[p][c] holds
+// coefficient c of plane p of every row.
+void gather_planes(const SharedFace *table, int32x4_t rows, float32x4_t *planes[4]) {
+    const SharedFace &f0 = table[vgetq_lane_s32(rows, 0)];
+    const SharedFace &f1 = table[vgetq_lane_s32(rows, 1)];
+    const SharedFace &f2 = table[vgetq_lane_s32(rows, 2)];
+    const SharedFace &f3 = table[vgetq_lane_s32(rows, 3)];
+    for (int p = 0; p < 4; ++p) {
+        float32x4x2_t t01 = vtrnq_f32(vld1q_f32(f0.planes[p]), vld1q_f32(f1.planes[p]));
+        float32x4x2_t t23 = vtrnq_f32(vld1q_f32(f2.planes[p]), vld1q_f32(f3.planes[p]));
+        planes[p][0] = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+        planes[p][1] = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+        planes[p][2] = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+        planes[p][3] = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+    }
+}
+
+#endif
+
+#ifdef MANTIS_HAS_AVX
+
+float32x4_t fma(float32x4_t a, float32x4_t b, float32x4_t c) {
+#ifdef MANTIS_HAS_FMA
+    return _mm_fmadd_ps(a, b, c);
+#else
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+float32x4_t min(float32x4_t a, float32x4_t b) {
+    return _mm_min_ps(a, b);
+}
+
+float32x4_t max(float32x4_t a, float32x4_t b) {
+    return _mm_max_ps(a, b);
+}
+
+float32x4_t sub(float32x4_t a, float32x4_t b) {
+    return _mm_sub_ps(a, b);
+}
+
+float32x4_t add(float32x4_t a, float32x4_t b) {
+    return _mm_add_ps(a, b);
+}
+
+float32x4_t mul(float32x4_t a, float32x4_t b) {
+    return _mm_mul_ps(a, b);
+}
+
+float32x4_t div(float32x4_t a, float32x4_t b) {
+    return _mm_div_ps(a, b);
+}
+
+mask4_t leq(float32x4_t a, float32x4_t b) {
+    return _mm_castps_si128(_mm_cmple_ps(a, b)); // Cast result to integer type
+}
+
+mask4_t geq(float32x4_t a, float32x4_t b) {
+    return _mm_castps_si128(_mm_cmpge_ps(a, b)); // Cast result to integer type
+}
+
+mask4_t logical_and(mask4_t a, mask4_t b) {
+    return _mm_and_si128(a, b);
+}
+
+int32x4_t select_int(int32x4_t condition, int32x4_t trueValue, int32x4_t falseValue) {
+    return _mm_blendv_epi8(falseValue, trueValue, condition);
+}
+
+float32x4_t select_float(mask4_t condition, float32x4_t trueValue, float32x4_t falseValue) {
+    __m128 conditionAsFloat = _mm_castsi128_ps(condition);
+    return _mm_blendv_ps(falseValue, trueValue, conditionAsFloat);
+}
+
+int32x4_t add(int32x4_t a, int32x4_t b) {
+    return _mm_add_epi32(a, b);
+}
+
+// one bit per lane, lane 0 in the lowest bit
+int mask_bits(mask4_t mask) {
+    return _mm_movemask_ps(_mm_castsi128_ps(mask));
+}
+
+// Loads four half precision values written by float_to_half. Those are never denormal, so moving the bits
+// into place and rebiasing the exponent with a multiplication is enough.
+float32x4_t load_half4(const uint16_t *p) {
+    __m128i h = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) p));
+    // the sign extension leaves copies of the sign bit between the sign and the exponent
+    __m128i bits = _mm_and_si128(_mm_slli_epi32(h, 13), _mm_set1_epi32(int(0x8fffffff)));
+    return _mm_mul_ps(_mm_castsi128_ps(bits), _mm_set1_ps(0x1p112f));
+}
+
+// Loads the planes of the given rows of the shared face table, transposed so that planes[p][c] holds
+// coefficient c of plane p of every row.
+void gather_planes(const SharedFace *table, int32x4_t rows, float32x4_t *planes[4]) {
+    const SharedFace &f0 = table[_mm_extract_epi32(rows, 0)];
+    const SharedFace &f1 = table[_mm_extract_epi32(rows, 1)];
+    const SharedFace &f2 = table[_mm_extract_epi32(rows, 2)];
+    const SharedFace &f3 = table[_mm_extract_epi32(rows, 3)];
+    for (int p = 0; p < 4; ++p) {
+        __m128 r0 = _mm_load_ps(f0.planes[p]);
+        __m128 r1 = _mm_load_ps(f1.planes[p]);
+        __m128 r2 = _mm_load_ps(f2.planes[p]);
+        __m128 r3 = _mm_load_ps(f3.planes[p]);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        planes[p][0] = r0;
+        planes[p][1] = r1;
+        planes[p][2] = r2;
+        planes[p][3] = r3;
+    }
+}
+
+#if !defined(MANTIS_HAS_AVX512) && !defined(MANTIS_HAS_AVX2)
+template<int N = SimdWidth>
+auto dupf32(float x) {
+    static_assert(N == 4);
+    return _mm_set1_ps(x);
+}
+
+template<int N = SimdWidth>
+auto dupi32(int32_t x) {
+    static_assert(N == 4);
+    return _mm_set1_epi32(x);
+}
+
+template<int N = SimdWidth>
+auto dupf32x4(float32x4_t x) {
+    static_assert(N == 4);
+    return x;
+}
+
+template<int N = SimdWidth>
+auto dupi32x4(int32x4_t x) {
+    static_assert(N == 4);
+    return x;
+}
+
+// Loads N half precision values written by float_to_half
+template<int N = SimdWidth>
+auto load_half(const uint16_t *p) {
+    static_assert(N == 4);
+    return load_half4(p);
+}
+#endif
+
+#endif
+
+#ifdef MANTIS_HAS_AVX2
+
+float32x8_t fma(float32x8_t a, float32x8_t b, float32x8_t c) {
+#ifdef MANTIS_HAS_FMA
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+float32x8_t min(float32x8_t a, float32x8_t b) {
+    return _mm256_min_ps(a, b);
+}
+
+float32x8_t max(float32x8_t a, float32x8_t b) {
+    return _mm256_max_ps(a, b);
+}
+
+float32x8_t sub(float32x8_t a, float32x8_t b) {
+    return _mm256_sub_ps(a, b);
+}
+
+float32x8_t add(float32x8_t a, float32x8_t b) {
+    return _mm256_add_ps(a, b);
+}
+
+float32x8_t mul(float32x8_t a, float32x8_t b) {
+    return _mm256_mul_ps(a, b);
+}
+
+float32x8_t div(float32x8_t a, float32x8_t b) {
+    return _mm256_div_ps(a, b);
+}
+
+mask8_t leq(float32x8_t a, float32x8_t b) {
+    return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); // Cast result to integer type
+}
+
+mask8_t geq(float32x8_t a, float32x8_t b) {
+    return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_GE_OQ)); // Cast result to integer type
+}
+
+mask8_t logical_and(mask8_t a, mask8_t b) {
+    return _mm256_and_si256(a, b);
+}
+
+int32x8_t select_int(mask8_t condition, int32x8_t trueValue, int32x8_t falseValue) {
+    return _mm256_blendv_epi8(falseValue, trueValue, condition);
+}
+
+float32x8_t select_float(mask8_t condition, float32x8_t trueValue, float32x8_t falseValue) {
+    __m256 conditionAsFloat = _mm256_castsi256_ps(condition);
+    return _mm256_blendv_ps(falseValue, trueValue, conditionAsFloat);
+}
+
+int32x8_t add(int32x8_t a, int32x8_t b) {
+    return _mm256_add_epi32(a, b);
+}
+
+int mask_bits(mask8_t mask) {
+    return _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+}
+
+void gather_planes(const SharedFace *table, int32x8_t rows, float32x8_t *planes[4]) {
+    const float *base = &table[0].planes[0][0];
+    // offsets of the rows in floats
+    __m256i offsets = _mm256_slli_epi32(rows, 4);
+    for (int p = 0; p < 4; ++p) {
+        for (int c = 0; c < 4; ++c) {
+            planes[p][c] = _mm256_i32gather_ps(base + 4 * p + c, offsets, 4);
+        }
+    }
+}
+
+template<int N = SimdWidth>
+auto dupf32(float x) {
+    if constexpr(N == 4) {
+        return _mm_set1_ps(x);
+    } else if constexpr(N == 8) {
+        return _mm256_set1_ps(x);
+    }
+}
+
+template<int N = SimdWidth>
+auto dupi32(int32_t x) {
+    if constexpr(N == 4) {
+        return _mm_set1_epi32(x);
+    } else if constexpr(N == 8) {
+        return _mm256_set1_epi32(x);
+    }
+}
+
+template<int N = SimdWidth>
+auto dupf32x4(float32x4_t x) {
+    if constexpr(N == 4) {
+        return x;
+    } else if constexpr(N == 8) {
+        return _mm256_set_m128(x, x);
+    }
+}
+
+template<int N = SimdWidth>
+auto dupi32x4(int32x4_t x) {
+    if constexpr(N == 4) {
+        return x;
+    } else if constexpr(N == 8) {
+        return _mm256_set_m128i(x, x);
+    }
+}
+
+// Loads N half precision values written by float_to_half, see load_half4
+template<int N = SimdWidth>
+auto load_half(const uint16_t *p) {
+    if constexpr(N == 4) {
+        return load_half4(p);
+    } else if constexpr(N == 8) {
+        __m256i h = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) p));
+        __m256i bits = _mm256_and_si256(_mm256_slli_epi32(h, 13), _mm256_set1_epi32(int(0x8fffffff)));
+        return _mm256_mul_ps(_mm256_castsi256_ps(bits), _mm256_set1_ps(0x1p112f));
+    }
+}
+
+void set(float32x8_t &v, size_t i, float x) {
+    assert(i < 8);
+    auto ptr = (float *) &v;
+    ptr[i] = x;
+}
+
+void set(int32x8_t &v, size_t i, int x) {
+    assert(i < 8);
+    std::memcpy((char *) &v + i * sizeof(int), &x, sizeof(int));
+}
+
+float get(const float32x8_t &v, size_t i) {
+    assert(i < 8);
+    auto ptr = (const float *) &v;
+    return ptr[i];
+}
+
+int get(const int32x8_t &v, size_t i) {
+    assert(i < 8);
+    int x;
+    std::memcpy(&x, (const char *) &v + i * sizeof(int), sizeof(int));
+    return x;
+}
+
+#endif
+
+#ifdef MANTIS_HAS_AVX512
+
+float32x16_t fma(float32x16_t a, float32x16_t b, float32x16_t c) {
+    return _mm512_fmadd_ps(a, b, c);
+}
+
+float32x16_t min(float32x16_t a, float32x16_t b) {
+    return _mm512_min_ps(a, b);
+}
+
+float32x16_t max(float32x16_t a, float32x16_t b) {
+    return _mm512_max_ps(a, b);
+}
+
+float32x16_t sub(float32x16_t a, float32x16_t b) {
+    return _mm512_sub_ps(a, b);
+}
+
+float32x16_t add(float32x16_t a, float32x16_t b) {
+    return _mm512_add_ps(a, b);
+}
+
+float32x16_t mul(float32x16_t a, float32x16_t b) {
+    return _mm512_mul_ps(a, b);
+}
+
+float32x16_t div(float32x16_t a, float32x16_t b) {
+    return _mm512_div_ps(a, b);
+}
+
+mask16_t leq(float32x16_t a, float32x16_t b) {
+    return _mm512_cmp_ps_mask(a, b, _CMP_LE_OS);
+}
+
+mask16_t geq(float32x16_t a, float32x16_t b) {
+    return _mm512_cmp_ps_mask(a, b, _CMP_GE_OS);
+}
+
+mask16_t logical_and(mask16_t a, mask16_t b) {
+    return _mm512_kand(a, b);
+}
+
+int32x16_t select_int(mask16_t condition, int32x16_t trueValue, int32x16_t falseValue) {
+    return _mm512_mask_blend_epi32(condition, falseValue, trueValue);
+}
+
+float32x16_t select_float(mask16_t condition, float32x16_t trueValue, float32x16_t falseValue) {
+    return _mm512_mask_blend_ps(condition, falseValue, trueValue);
+}
+
+int32x16_t add(int32x16_t a, int32x16_t b) {
+    return _mm512_add_epi32(a, b);
+}
+
+int mask_bits(mask16_t mask) {
+    return (int) mask;
+}
+
+void gather_planes(const SharedFace *table, int32x16_t rows, float32x16_t *planes[4]) {
+    const float *base = &table[0].planes[0][0];
+    // offsets of the rows in floats
+    __m512i offsets = _mm512_slli_epi32(rows, 4);
+    for (int p = 0; p < 4; ++p) {
+        for (int c = 0; c < 4; ++c) {
+            planes[p][c] = _mm512_i32gather_ps(offsets, base + 4 * p + c, 4);
+        }
+    }
+}
+
+template<int N = SimdWidth>
+auto dupf32(float x) {
+
+    if constexpr(N == 4) {
+        return _mm_set1_ps(x);
+    } else if constexpr(N == 16) {
+        return _mm512_set1_ps(x);
+    }
+}
+
+template<int N = SimdWidth>
+auto dupi32(int32_t x) {
+    if constexpr(N == 4) {
+        return _mm_set1_epi32(x);
+    } else if constexpr(N == 16) {
+        return _mm512_set1_epi32(x);
+    }
+}
+
+template<int N = SimdWidth>
+auto dupf32x4(float32x4_t x) {
+    if constexpr(N == 4) {
+        return x;
+    } else if constexpr(N == 16) {
+        return _mm512_broadcast_f32x4(x);
+    }
+}
+
+template<int N = SimdWidth>
+auto dupi32x4(int32x4_t x) {
+    if constexpr(N == 4) {
+        return x;
+    } else if constexpr(N == 16) {
+        return _mm512_broadcast_i32x4(x);
+    }
+}
+
+// Loads N half precision values written by float_to_half
+template<int N = SimdWidth>
+auto load_half(const uint16_t *p) {
+    if constexpr(N == 4) {
+        return load_half4(p);
+    } else if constexpr(N == 16) {
+        return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) p));
+    }
+}
+
+void set(float32x16_t &v, size_t i, float x) {
+    assert(i < 16);
+    auto ptr = (float *) &v;
+    ptr[i] = x;
+}
+
+void set(int32x16_t &v, size_t i, int x) {
+    assert(i < 16);
+    std::memcpy((char *) &v + i * sizeof(int), &x, sizeof(int));
+}
+
+float get(const float32x16_t &v, size_t i) {
+    assert(i < 16);
+    auto ptr = (const float *) &v;
+    return ptr[i];
+}
+
+int get(const int32x16_t &v, size_t i) {
+    assert(i < 16);
+    int x;
+    std::memcpy(&x, (const char *) &v + i * sizeof(int), sizeof(int));
+    return x;
+}
+
+#endif
+
+// Everything outside of this file is compiled for the baseline instruction set, and its legacy sse
+// instructions run much slower while the upper halves of the ymm/zmm registers are dirty. gcc does not
+// reliably clear them when leaving functions compiled through the target pragma, so this has to be called
+// before control returns to the common code.
+inline void clear_upper_registers() {
+#if defined(MANTIS_HAS_AVX2) || defined(MANTIS_HAS_AVX512)
+    _mm256_zeroupper();
+#endif
+}
+
+// ============================= SIMD MATH UTILS ===============================
+
+void set(float32x4_t &v, size_t i, float x) {
+    auto ptr = (float *) &v;
+    ptr[i] = x;
+}
+
+// The integer vector types of SSE and AVX are vectors of 64 bit integers, so accessing
+// individual lanes through an int pointer would violate strict aliasing.
+void set(int32x4_t &v, size_t i, int x) {
+    std::memcpy((char *) &v + i * sizeof(int), &x, sizeof(int));
+}
+
+float get(const float32x4_t &v, size_t i) {
+    auto ptr = (const float *) &v;
+    return ptr[i];
+}
+
+int get(const int32x4_t &v, size_t i) {
+    int x;
+    std::memcpy(&x, (const char *) &v + i * sizeof(int), sizeof(int));
+    return x;
+}
+
+template<class T>
+T dot(T ax, T ay, T az, T bx, T by, T bz) {
+    T result = mul(ax, bx);
+    result = fma(ay, by, result);
+    result = fma(az, bz, result);
+    return result;
+}
+
+template<class T>
+T length_squared(T x, T y, T z) {
+    T result = mul(x, x);
+    result = fma(y, y, result);
+    result = fma(z, z, result);
+    return result;
+}
+
+template<class T>
+T distance_squared(T ax, T ay, T az, T bx, T by, T bz) {
+    T dx = sub(ax, bx);
+    T dy = sub(ay, by);
+    T dz = sub(az, bz);
+    return length_squared(dx, dy, dz);
+}
+
+template<class T>
+T eval_plane(T px, T py, T pz, T plane_x, T plane_y, T plane_z, T plane_w) {
+    T result = mul(px, plane_x);
+    result = fma(py, plane_y, result);
+    result = fma(pz, plane_z, result);
+    return add(result, plane_w);
+}
+
+inline float32x4_t p2bbox(const Node &node, const float32x4_t qx, const float32x4_t qy, const float32x4_t qz) {
+    // Compute distances in x, y, z directions and clamp them to zero if they are negative
+    float32x4_t dx = max(sub(node.minCorners[0], qx), sub(qx, node.maxCorners[0]));
+    dx = max(dx, dupf32<4>(0.0f));
+    float32x4_t dy = max(sub(node.minCorners[1], qy), sub(qy, node.maxCorners[1]));
+    dy = max(dy, dupf32<4>(0.0f));
+    float32x4_t dz = max(sub(node.minCorners[2], qz), sub(qz, node.maxCorners[2]));
+    dz = max(dz, dupf32<4>(0.0f));
+    // Compute squared distances for each box
+    float32x4_t squaredDist = length_squared(dx, dy, dz);
+    return squaredDist;
+}
+
+// ============================= BVH ===============================
+
+struct alignas(SimdAlignment) LeafNode {
+    // user provided, so the constructor is compiled for the same target as the kernels
+    LeafNode() : x_coords(dupf32(FLT_MAX)), y_coords(dupf32(FLT_MAX)), z_coords(dupf32(FLT_MAX)),
+                 indices(dupi32(-1)) {}
+
+    float32xN_t x_coords;
+    float32xN_t y_coords;
+    float32xN_t z_coords;
+    int32xN_t indices;
+};
+
+#define cmin(a, b) get(distances,a) > get(distances,b) ? b : a
+#define cmax(a, b) get(distances,a) > get(distances,b) ? a : b
+
+#define cswap(a, b)  \
+    {int tmp = a;    \
+    a = cmax(a,b);   \
+    b = cmin(tmp, b);}
+
+#define nsort4(a, b, c, d) \
+    do                     \
+    {                      \
+        cswap(a, b);       \
+        cswap(c, d);       \
+        cswap(a, c);       \
+        cswap(b, d);       \
+        cswap(b, c);       \
+    } while (0)
+
+
+constexpr static long long NUM_PACKETS = 8;
+
+class Bvh {
+public:
+    void updateClosestPoint(const float32xN_t &pt_x,
+                            const float32xN_t &pt_y,
+                            const float32xN_t &pt_z,
+                            size_t firstPacket,
+                            size_t numPackets,
+                            float &bestDistSq,
+                            int &bestIdx) const {
+        float32xN_t minDist = dupf32(bestDistSq);
+        int32xN_t minIdx = dupi32(bestIdx);
+
+        for (size_t i = firstPacket; i < firstPacket + numPackets; ++i) {
+            // Compute squared distances for a batch of SimdWidth points
+            const auto &leaf = m_leaves[i];
+            float32xN_t dx = sub(pt_x, leaf.x_coords);
+            float32xN_t dy = sub(pt_y, leaf.y_coords);
+            float32xN_t dz = sub(pt_z, leaf.z_coords);
+            float32xN_t distSq = length_squared(dx, dy, dz);
+
+            // Comparison mask for distances
+            // if distSq >= minDist => keep minDist
+            maskN_t keepMinDist = geq(distSq, minDist);
+            minDist = min(minDist, distSq);
+
+            // Update the indices
+            minIdx = select_int(keepMinDist, minIdx, leaf.indices);
+        }
+
+        // Find overall minimum distance and index
+        for (size_t j = 0; j < SimdWidth; ++j) {
+            if (get(minDist, j) < bestDistSq) {
+                bestDistSq = get(minDist, j);
+                bestIdx = get(minIdx, j);
+            }
+        }
+    }
+
+    explicit Bvh(const std::vector<GEO::vec3> &points) {
+        // Create an index array for all points
+        std::vector<int> indices(points.size());
+        std::iota(indices.begin(), indices.end(), 0);
+
+        // Build the KD-tree. The points are only referenced during construction, queries solely
+        // rely on the single precision copies stored in the leaves.
+        BoundingBox box;
+        int node_idx = constructTree(points, indices, 0, indices.size(), 0, box);
+        assert(node_idx == 0 || node_idx < 0);
+    }
+
+    std::pair<int, float> closestPoint(const GEO::vec3 &q) const {
+        struct StackNode {
+            int nodeIndex;
+            float minDistSq;
+        };
+        StackNode stack[TreeStackSize];
+        int stackSize = 0;
+
+        float bestDistSq = std::numeric_limits<float>::max();
+        int bestIdx = -1;
+
+        // Broadcast query point coordinates to SIMD size
+        float32x4_t q_x4 = dupf32<4>(q.x);
+        float32x4_t q_y4 = dupf32<4>(q.y);
+        float32x4_t q_z4 = dupf32<4>(q.z);
+
+        float32xN_t q_xN = dupf32(q.x);
+        float32xN_t q_yN = dupf32(q.y);
+        float32xN_t q_zN = dupf32(q.z);
+
+        // Start with the root node
+        stack[stackSize++] = {0, 0.0f};
+        if (m_nodes.empty()) {
+            stack[0].nodeIndex = -1;
+        }
+
+        while (stackSize > 0) {
+            StackNode current = stack[--stackSize];
+            if (current.minDistSq >= bestDistSq) {
+                continue;  // Skip nodes that can't possibly contain a closer point
+            }
+            if (current.nodeIndex < 0) {
+                auto [begin, numPackets] = m_leafRange[-(current.nodeIndex + 1)];
+                updateClosestPoint(q_xN, q_yN, q_zN, begin, numPackets, bestDistSq, bestIdx);
+                continue;
+            }
+
+            const Node &node = m_nodes[current.nodeIndex];
+
+            // Compute distances to each child
+            float32x4_t distances = p2bbox(node, q_x4, q_y4, q_z4);
+            int childIndices[4] = {0, 1, 2, 3};
+
+            // Sort children by distance
+            nsort4(childIndices[0], childIndices[1], childIndices[2], childIndices[3]);
+
+            // push children that are internal
+            for (int idx: childIndices) {
+                int childIdx = get(node.children, idx);
+                float childDist = get(distances, idx);
+                if (childDist < bestDistSq) {
+                    assert(stackSize + 1 < TreeStackSize);
+                    stack[stackSize++] = {childIdx, childDist};
+                }
+            }
+        }
+
+        return {bestIdx, bestDistSq};
+    }
+
+    // Reads the tree written by save and checks it, so that the queries stay in bounds: the nodes are in
+    // preorder, so every child follows its parent, the tree is at most MaxTreeHeight nodes high, and the leaves
+    // hold the sites at their positions or padding. site_of(s) returns the position of site s. The arrays view a
+    // mapped file.
+    template<class SiteOf>
+    Bvh(BinaryReader &in, size_t num_sites, SiteOf site_of) {
+        in.map_array(m_nodes);
+        in.map_array(m_leaves);
+        in.map_array(m_leafRange);
+        in.check(!m_nodes.empty() || m_leafRange.size() == 1);
+        std::vector<int> height(m_nodes.size(), 1);
+        for (size_t n = m_nodes.size(); n-- > 0;) {
+            for (int i = 0; i < 4; ++i) {
+                int child = get(m_nodes[n].children, i);
+                if (child < 0) {
+                    in.check(size_t(-(child + 1)) < m_leafRange.size());
+                } else {
+                    in.check(size_t(child) > n && size_t(child) < m_nodes.size());
+                    height[n] = std::max(height[n], height[child] + 1);
+                }
+            }
+            in.check(height[n] <= MaxTreeHeight);
+        }
+        for (auto [begin, numPackets]: m_leafRange) {
+            in.check(begin >= 0 && numPackets >= 0 && size_t(begin) + size_t(numPackets) <= m_leaves.size());
+        }
+        for (const LeafNode &leaf: m_leaves) {
+            for (size_t j = 0; j < SimdWidth; ++j) {
+                int idx = get(leaf.indices, j);
+                in.check(idx >= -1 && idx < int(num_sites));
+                // the padding is farther away than every site
+                GEO::vec3 p = idx >= 0 ? site_of(index_t(idx)) : GEO::vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+                in.check(get(leaf.x_coords, j) == float(p.x) && get(leaf.y_coords, j) == float(p.y) &&
+                         get(leaf.z_coords, j) == float(p.z));
+            }
+        }
+    }
+
+    // Moves the leaves to the new positions of their points and recomputes the boxes of the nodes, keeping the
+    // tree. The queries stay exact, but the tree gets looser the farther the points move.
+    void refit(const std::vector<GEO::vec3> &points) {
+        for (size_t i = 0; i < m_leaves.size(); ++i) {
+            LeafNode &leaf = m_leaves[i];
+            for (size_t j = 0; j < SimdWidth; ++j) {
+                int idx = get(leaf.indices, j);
+                if (idx >= 0) {
+                    set(leaf.x_coords, j, (float) points[idx].x);
+                    set(leaf.y_coords, j, (float) points[idx].y);
+                    set(leaf.z_coords, j, (float) points[idx].z);
+                }
+            }
+        }
+        if (!m_nodes.empty()) {
+            refitNode(points, 0);
+        }
+    }
+
+    void save(BinaryWriter &out) const {
+        out.write_array(m_nodes);
+        out.write_array(m_leaves);
+        out.write_array(m_leafRange);
+    }
+
+    size_t memory_usage() const {
+        return m_nodes.capacity() * sizeof(Node) +
+               m_leaves.capacity() * sizeof(LeafNode) +
+               m_leafRange.capacity() * sizeof(std::pair<int, int>);
+    }
+
+private:
+    MappableVector<Node> m_nodes;
+    MappableVector<LeafNode> m_leaves;
+    MappableVector<std::pair<int, int>> m_leafRange;
+
+    // Recomputes the boxes of the subtree of the node or leaf and returns its box
+    BoundingBox refitNode(const std::vector<GEO::vec3> &points, int nodeIndex) {
+        BoundingBox box;
+        if (nodeIndex < 0) {
+            auto [firstLeaf, numPackets] = m_leafRange[-(nodeIndex + 1)];
+            for (int i = firstLeaf; i < firstLeaf + numPackets; ++i) {
+                for (size_t j = 0; j < SimdWidth; ++j) {
+                    int idx = get(m_leaves[i].indices, j);
+                    if (idx >= 0) {
+                        box.extend(points[idx]);
+                    }
+                }
+            }
+            return box;
+        }
+
+        Node &node = m_nodes[nodeIndex];
+        for (int j = 0; j < 4; ++j) {
+            BoundingBox childBox = refitNode(points, get(node.children, j));
+            for (int i = 0; i < 3; ++i) {
+                set(node.minCorners[i], j, (float) childBox.lower[i]);
+                set(node.maxCorners[i], j, (float) childBox.upper[i]);
+            }
+            box.extend(childBox);
+        }
+        return box;
+    }
+
+    int constructTree(const std::vector<GEO::vec3> &points, std::vector<int> &indices, size_t begin, size_t end,
+                      size_t depth, BoundingBox &box) {
+        if (end - begin <= NUM_PACKETS * SimdWidth) {
+            // Update the bounding box for this leaf node
+            box = BoundingBox();
+            for (size_t i = begin; i < end; ++i) {
+                int idx = indices[i];
+                box.extend(points[idx]);
+            }
+
+            int leafIdx = int(m_leafRange.size());
+            auto firstLeaf = int(m_leaves.size());
+            auto numPackets = int((end - begin + SimdWidth - 1) / SimdWidth);
+            m_leafRange.emplace_back(firstLeaf, numPackets);
+
+            for (int i = 0; i < numPackets; ++i) {
+                LeafNode leaf{};
+                for (size_t j = 0; j < SimdWidth; ++j) {
+                    size_t k = i * SimdWidth + j;
+                    if (k < end - begin) {
+                        set(leaf.x_coords, j, (float) points[indices[begin + k]].x);
+                        set(leaf.y_coords, j, (float) points[indices[begin + k]].y);
+                        set(leaf.z_coords, j, (float) points[indices[begin + k]].z);
+                        set(leaf.indices, j, (int) indices[begin + k]);
+                    }
+                }
+                m_leaves.push_back(leaf);
+            }
+
+            // Return negative index to indicate leaf node
+            return -(leafIdx + 1);
+        }
+
+        Node node{};
+
+        // Split dimensions: Choose different dimensions for each split
+        size_t primaryDim = depth % 3;
+        size_t secondaryDim = (primaryDim + 1) % 3; // Choose next dimension for secondary split
+
+        // Primary split
+        size_t primarySplit = (begin + end) / 2;
+        std::nth_element(indices.begin() + (long) begin, indices.begin() + (long) primarySplit,
+                         indices.begin() + (long) end,
+                         [primaryDim, &points](int i1, int i2) {
+                             return points[i1][primaryDim] < points[i2][primaryDim];
+                         });
+
+        // Secondary splits
+        size_t secondarySplit1 = (begin + primarySplit) / 2;
+        size_t secondarySplit2 = (primarySplit + end) / 2;
+
+        std::nth_element(indices.begin() + (long) begin, indices.begin() + (long) secondarySplit1,
+                         indices.begin() + (long) primarySplit,
+                         [secondaryDim, &points](int i1, int i2) {
+                             return points[i1][secondaryDim] < points[i2][secondaryDim];
+                         });
+
+        std::nth_element(indices.begin() + (long) primarySplit, indices.begin() + (long) secondarySplit2,
+                         indices.begin() + (long) end,
+                         [secondaryDim, &points](int i1, int i2) {
+                             return points[i1][secondaryDim] < points[i2][secondaryDim];
+                         });
+
+        BoundingBox childBoxes[4] = {};
+
+        auto node_idx = int(m_nodes.size());
+        m_nodes.emplace_back();
+
+        set(node.children, 0, constructTree(points, indices, begin, secondarySplit1, depth + 2, childBoxes[0]));
+        set(node.children, 1, constructTree(points, indices, secondarySplit1, primarySplit, depth + 2, childBoxes[1]));
+        set(node.children, 2, constructTree(points, indices, primarySplit, secondarySplit2, depth + 2, childBoxes[2]));
+        set(node.children, 3, constructTree(points, indices, secondarySplit2, end, depth + 2, childBoxes[3]));
+
+        // set bounding boxes of node
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                set(node.minCorners[i], j, (float) childBoxes[j].lower[i]);
+                set(node.maxCorners[i], j, (float) childBoxes[j].upper[i]);
+            }
+        }
+
+        // Combine bounding boxes from children
+        box = childBoxes[0];
+        for (int i = 1; i < 4; ++i) {
+            box.extend(childBoxes[i]);
+        }
+
+        m_nodes[node_idx] = node;
+        return node_idx;
+    }
+};
+
+// ============================= QUERY KERNELS ===============================
+
+// Updates best_d2 and best_idx lane wise with the distance to the edges in pack, if the closest point
+// on the edge's line lies inside the edge.
+template<size_t N>
+inline void closest_edge(const PackedEdge<N> &pack, typename SimdTypes<N>::Float qx,
+                         typename SimdTypes<N>::Float qy, typename SimdTypes<N>::Float qz,
+                         typename SimdTypes<N>::Float &best_d2, typename SimdTypes<N>::Int &best_idx) {
+    using Float = typename SimdTypes<N>::Float;
+    using Mask = typename SimdTypes<N>::Mask;
+
+    Float apx = sub(qx, pack.start[0]);
+    Float apy = sub(qy, pack.start[1]);
+    Float apz = sub(qz, pack.start[2]);
+
+    Float t = mul(dot(apx, apy, apz, pack.dir[0], pack.dir[1], pack.dir[2]), pack.inv_dir_len_squared);
+
+    // the result is only valid if t is in [0, 1]
+    Mask mask = logical_and(leq(dupf32<N>(0.0f), t), leq(t, dupf32<N>(1.0f)));
+
+    // project onto segment
+    Float projectedx = fma(t, pack.dir[0], pack.start[0]);
+    Float projectedy = fma(t, pack.dir[1], pack.start[1]);
+    Float projectedz = fma(t, pack.dir[2], pack.start[2]);
+
+    Float d2_line = distance_squared(qx, qy, qz, projectedx, projectedy, projectedz);
+
+    mask = logical_and(mask, leq(d2_line, best_d2));
+    best_d2 = select_float(mask, d2_line, best_d2);
+    best_idx = select_int(mask, pack.primitive_idx, best_idx);
+}
+
+// Updates best_d2 and best_idx lane wise with the distance to the faces in pack, if the projection
+// onto the face's plane lies inside the face.
+template<size_t N>
+inline void closest_face(const PackedFace<N> &pack, typename SimdTypes<N>::Float qx,
+                         typename SimdTypes<N>::Float qy, typename SimdTypes<N>::Float qz,
+                         typename SimdTypes<N>::Float &best_d2, typename SimdTypes<N>::Int &best_idx) {
+    using Float = typename SimdTypes<N>::Float;
+    using Mask = typename SimdTypes<N>::Mask;
+
+    // point is inside face region if it is on the positive side of all three planes
+    Float s0 = eval_plane(qx, qy, qz, pack.edge_plane0[0], pack.edge_plane0[1], pack.edge_plane0[2],
+                          pack.edge_plane0[3]);
+    Float s1 = eval_plane(qx, qy, qz, pack.edge_plane1[0], pack.edge_plane1[1], pack.edge_plane1[2],
+                          pack.edge_plane1[3]);
+    Float s2 = eval_plane(qx, qy, qz, pack.edge_plane2[0], pack.edge_plane2[1], pack.edge_plane2[2],
+                          pack.edge_plane2[3]);
+
+    Mask mask = logical_and(logical_and(leq(dupf32<N>(0.0f), s0), leq(dupf32<N>(0.0f), s1)),
+                            leq(dupf32<N>(0.0f), s2));
+
+    Float d2 = eval_plane(qx, qy, qz, pack.face_plane[0], pack.face_plane[1], pack.face_plane[2],
+                          pack.face_plane[3]);
+    d2 = mul(d2, d2);
+
+    mask = logical_and(mask, leq(d2, best_d2));
+    best_d2 = select_float(mask, d2, best_d2);
+    best_idx = select_int(mask, pack.primitive_idx, best_idx);
+}
+
+// The query point and how the scans over the packets of its interception list prune them
+struct PacketScan {
+    float q[3];
+    // the packets are sorted by the lower x coordinate of their boxes, see ListOrder::LowerX, so a scan can stop
+    // at the first box starting beyond q
+    bool sorted_by_x = true;
+    // counts the packets whose primitives are tested, may be null
+    size_t *num_scanned = nullptr;
+
+    // Returns true if the primitives of a packet have to be tested: q lies in the box of their interception
+    // regions, and they could be closer than the closest primitive of some lane so far.
+    template<size_t N>
+    bool needs_scan(const PacketBox &box, const PacketBox &extent,
+                    const typename SimdTypes<N>::Float &best_d2) const {
+        if (!box.contains(q[0], q[1], q[2])) {
+            return false;
+        }
+        // slightly lowered, the kernels round differently
+        float lower_bound = extent.distance_squared(q) * (1.f - 0x1p-20f);
+        if (mask_bits(leq(best_d2, dupf32<N>(lower_bound))) == (1 << N) - 1) {
+            return false;
+        }
+        if (num_scanned) {
+            ++*num_scanned;
+        }
+        return true;
+    }
+};
+
+// Scans the packets of an interception list
+template<size_t N>
+inline void closest_edge_packets(const PackedEdge<N> *packets, size_t num_packets, const PacketScan &scan,
+                                 typename SimdTypes<N>::Float &best_d2, typename SimdTypes<N>::Int &best_idx) {
+    typename SimdTypes<N>::Float qx = dupf32<N>(scan.q[0]);
+    typename SimdTypes<N>::Float qy = dupf32<N>(scan.q[1]);
+    typename SimdTypes<N>::Float qz = dupf32<N>(scan.q[2]);
+
+    for (size_t i = 0; i < num_packets; ++i) {
+        const PackedEdge<N> &pack = packets[i];
+        if (scan.sorted_by_x && scan.q[0] < pack.box.lower[0]) {
+            break;
+        }
+        if (scan.needs_scan<N>(pack.box, pack.extent, best_d2)) {
+            closest_edge<N>(pack, qx, qy, qz, best_d2, best_idx);
+        }
+    }
+}
+
+template<size_t N>
+inline void closest_face_packets(const PackedFace<N> *packets, size_t num_packets, const PacketScan &scan,
+                                 typename SimdTypes<N>::Float &best_d2, typename SimdTypes<N>::Int &best_idx) {
+    typename SimdTypes<N>::Float qx = dupf32<N>(scan.q[0]);
+    typename SimdTypes<N>::Float qy = dupf32<N>(scan.q[1]);
+    typename SimdTypes<N>::Float qz = dupf32<N>(scan.q[2]);
+
+    for (size_t i = 0; i < num_packets; ++i) {
+        const PackedFace<N> &pack = packets[i];
+        if (scan.sorted_by_x && scan.q[0] < pack.box.lower[0]) {
+            break;
+        }
+        if (scan.needs_scan<N>(pack.box, pack.extent, best_d2)) {
+            closest_face<N>(pack, qx, qy, qz, best_d2, best_idx);
+        }
+    }
+}
+
+// Like closest_face_packets, but the planes of the faces are gathered from the shared face table.
+// face_base is the primitive index of the first face.
+template<size_t N>
+inline void closest_indexed_face_packets(const IndexedFace<N> *packets, size_t num_packets,
+                                         const SharedFace *table, int32_t face_base, const PacketScan &scan,
+                                         typename SimdTypes<N>::Float &best_d2,
+                                         typename SimdTypes<N>::Int &best_idx) {
+    typename SimdTypes<N>::Float qx = dupf32<N>(scan.q[0]);
+    typename SimdTypes<N>::Float qy = dupf32<N>(scan.q[1]);
+    typename SimdTypes<N>::Float qz = dupf32<N>(scan.q[2]);
+    typename SimdTypes<N>::Int base = dupi32<N>(face_base);
+
+    for (size_t i = 0; i < num_packets; ++i) {
+        const IndexedFace<N> &pack = packets[i];
+        if (scan.sorted_by_x && scan.q[0] < pack.box.lower[0]) {
+            break;
+        }
+        if (scan.needs_scan<N>(pack.box, pack.extent, best_d2)) {
+            PackedFace<N> face;
+            typename SimdTypes<N>::Float *planes[4] = {face.face_plane, face.edge_plane0, face.edge_plane1,
+                                                       face.edge_plane2};
+            gather_planes(table, pack.face_idx, planes);
+            face.primitive_idx = add(pack.face_idx, base);
+            closest_face<N>(face, qx, qy, qz, best_d2, best_idx);
+        }
+    }
+}
+
+// Like closest_face_packets for compressed faces, whose planes are relative to origin. The half precision
+// tests are widened by a bound on their error, and every face that could improve a lane is verified in double
+// precision with mesh.face_distance_squared at the exact query point.
+template<size_t N>
+inline void closest_compressed_face_packets(const CompressedFace<N> *packets, size_t num_packets,
+                                            const PacketScan &scan, const float origin[3], const Impl &mesh,
+                                            GEO::vec3 query, int32_t face_base, typename SimdTypes<N>::Float &best_d2,
+                                            typename SimdTypes<N>::Int &best_idx) {
+    using Float = typename SimdTypes<N>::Float;
+    using Mask = typename SimdTypes<N>::Mask;
+
+    const float *q = scan.q;
+    const float r[3] = {q[0] - origin[0], q[1] - origin[1], q[2] - origin[2]};
+    Float rx = dupf32<N>(r[0]);
+    Float ry = dupf32<N>(r[1]);
+    Float rz = dupf32<N>(r[2]);
+    const float r_norm = std::abs(r[0]) + std::abs(r[1]) + std::abs(r[2]);
+    // rounding of the query point and of r
+    const float q_error = 0x1p-22f * (std::abs(q[0]) + std::abs(q[1]) + std::abs(q[2]) + r_norm);
+    const Float zero = dupf32<N>(0.0f);
+
+    for (size_t i = 0; i < num_packets; ++i) {
+        const CompressedFace<N> &pack = packets[i];
+        if (scan.sorted_by_x && q[0] < pack.box.lower[0]) {
+            break;
+        }
+        if (!scan.needs_scan<N>(pack.box, pack.extent, best_d2)) {
+            continue;
+        }
+
+        // Every normal and scaled offset is off by at most 2^-12 after decoding, see float_to_half. Twice
+        // that also covers the rounding of the plane evaluation.
+        const float error = 0x1p-11f * (r_norm + pack.offset_scale) + q_error;
+        const Float scale = dupf32<N>(pack.offset_scale);
+        Float d[4];
+        for (int p = 0; p < 4; ++p) {
+            d[p] = eval_plane(rx, ry, rz, load_half<N>(pack.planes[p][0]), load_half<N>(pack.planes[p][1]),
+                              load_half<N>(pack.planes[p][2]), mul(load_half<N>(pack.planes[p][3]), scale));
+        }
+
+        // inside the face region if it could be on the positive side of all three edge planes
+        const Float neg_error = dupf32<N>(-error);
+        Mask mask = logical_and(logical_and(leq(neg_error, d[1]), leq(neg_error, d[2])), leq(neg_error, d[3]));
+
+        // lower bound of the distance to the face plane
+        Float lower = max(sub(max(d[0], sub(zero, d[0])), dupf32<N>(error)), zero);
+        mask = logical_and(mask, leq(mul(lower, lower), best_d2));
+
+        for (int bits = mask_bits(mask), j = 0; bits; bits >>= 1, ++j) {
+            if (!(bits & 1)) {
+                continue;
+            }
+            int primitive = get(pack.primitive_idx, j);
+            float d2 = (float) mesh.face_distance_squared(primitive - face_base, query);
+            if (d2 <= get(best_d2, j)) {
+                set(best_d2, j, d2);
+                set(best_idx, j, primitive);
+            }
+        }
+    }
+}
+
+// Returns true if all lanes of the packets, e.g. their primitive indices, are in [lower, upper)
+template<size_t N, class Packet, class Lanes>
+inline bool lanes_in_range(const Packet *packets, size_t num_packets, Lanes Packet::*lanes, int lower, int upper) {
+    for (size_t i = 0; i < num_packets; ++i) {
+        for (size_t j = 0; j < N; ++j) {
+            int lane = get(packets[i].*lanes, j);
+            if (lane < lower || lane >= upper) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// ============================= DISTANCE TO MESH ===============================
+
+#if defined(MANTIS_HAS_NEON)
+constexpr InstructionSet Isa = InstructionSet::NEON;
+#elif defined(MANTIS_HAS_AVX512)
+constexpr InstructionSet Isa = InstructionSet::AVX512;
+#elif defined(MANTIS_HAS_AVX2)
+constexpr InstructionSet Isa = InstructionSet::AVX2;
+#else
+constexpr InstructionSet Isa = InstructionSet::SSE;
+#endif
+
+struct SimdImpl final : Impl {
+
+    SimdImpl(std::vector<GEO::vec3> points_, std::vector<std::array<uint32_t, 3>> triangles_,
+             const BuildOptions &options)
+            : Impl(std::move(points_), std::move(triangles_), options), bvh(points),
+              face_storage(options.face_storage), list_order(options.list_order),
+              local_tree_threshold(options.local_tree_threshold) {
+        // the calling thread works on the parallel loops as well
+        ScopedAffinity affinity(cpus);
+        clear_upper_registers();
+        InterceptionLists lists = compute_interception_list();
+        if (!steiner_sites.empty()) {
+            // the nearest site has to be found among the steiner sites as well
+            std::vector<GEO::vec3> sites = points;
+            sites.insert(sites.end(), steiner_sites.begin(), steiner_sites.end());
+            bvh = Bvh(sites);
+            clear_upper_registers();
+        }
+        auto start = std::chrono::steady_clock::now();
+        pack_interception_lists(lists);
+        stats.packing_ms = milliseconds_since(start);
+        if (options.compact) {
+            compact();
+        } else if (supports_update()) {
+            interception_lists = std::move(lists);
+        }
+        release_build_pool();
+    }
+
+    // Reads the structure written by save, the build options and the mesh are read already. The packed arrays
+    // view the file if it is mapped.
+    SimdImpl(std::vector<GEO::vec3> points_, std::vector<std::array<uint32_t, 3>> triangles_,
+             const BuildOptions &options, BinaryReader &in)
+            : Impl(std::move(points_), std::move(triangles_), options, in),
+              bvh(in, num_sites(), [this](index_t s) { return site(s); }),
+              face_storage(options.face_storage), list_order(options.list_order),
+              local_tree_threshold(options.local_tree_threshold) {
+        in.map_array(interception_data);
+        in.map_array(packet_ranges);
+        in.map_array(face_table);
+        in.map_array(local_tree);
+        in.map_array(local_tree_roots);
+        check_loaded(in);
+    }
+
+    // Checks every index of a loaded structure that the queries follow: the packet ranges, the primitives of the
+    // packets and the box trees
+    void check_loaded(const BinaryReader &in) const;
+
+    // Returns true if the primitives of n full width or tail face packets at offset are faces
+    template<size_t N>
+    bool face_lanes_in_range(size_t offset, size_t n) const;
+
+    void save(BinaryWriter &out) const override;
+
+    UpdateStats update_positions(const uint32_t *indices, size_t num_indices, const float *positions) override;
+
+    BuildOptions build_options() const override;
+
+    // Pack data into simd friendly data structures
+    void pack_interception_lists(const InterceptionLists &lists);
+
+    void pack_vertex(const InterceptionLists &lists, index_t v);
+
+    size_t memory_usage() const override;
+
+    Result calc_closest_point(GEO::vec3 q) const override;
+
+    Result calc_closest_point(GEO::vec3 q, size_t &num_packets_scanned) const override;
+
+    // the query, counting the scanned packets if num_packets_scanned is not null
+    Result closest_point(GEO::vec3 q, size_t *num_packets_scanned) const;
+
+    // Reduces the lanes to the closest primitive and builds the result
+    Result reduce_closest(GEO::vec3 q, const float32xN_t &best_d2, const int32xN_t &best_idx) const;
+
+    InstructionSet instruction_set() const override {
+        return Isa;
+    }
+
+    Bvh bvh;
+
+    // The packed interception lists of all vertices stored back to back in a single allocation. For
+    // every vertex the full width edge packets are followed by its edge tail packets, then the full width
+    // and tail face packets. The type of the face packets depends on the face storage.
+    MappableVector<SimdBlock> interception_data;
+    MappableVector<PacketRange> packet_ranges;
+
+    FaceStorage face_storage = FaceStorage::Packed;
+
+    // planes of all faces, only used with FaceStorage::Shared
+    MappableVector<SharedFace> face_table;
+
+    ListOrder list_order = ListOrder::LowerX;
+
+    // Box trees over the packets of the long interception lists, see BuildOptions::local_tree_threshold. A
+    // negative child is a leaf, -(child + 1) indexes the full width packets of the site, edge packets first.
+    // Unused children have an empty box. Sites without a tree have the root -1, and their lists keep tail packets.
+    size_t local_tree_threshold = 0;
+    MappableVector<Node> local_tree;
+    MappableVector<int32_t> local_tree_roots;
+
+    bool uses_local_tree(size_t num_edges, size_t num_faces) const {
+        return local_tree_threshold > 0 && num_edges + num_faces > local_tree_threshold;
+    }
+
+    // Builds the box tree over the packed lists of site v and returns its root
+    int32_t build_local_tree(index_t v);
+
+    // Scans the packets of site v whose boxes contain q, found with its box tree
+    void closest_in_local_tree(index_t v, GEO::vec3 q, const PacketScan &scan, float32xN_t &best_d2,
+                               int32xN_t &best_idx) const;
+
+    // number of simd vectors occupied by n full width or tail face packets
+    template<size_t N>
+    size_t num_face_blocks(size_t n) const {
+        switch (face_storage) {
+            case FaceStorage::Shared: return num_blocks<IndexedFace<N>>(n);
+            case FaceStorage::Compressed: return num_blocks<CompressedFace<N>>(n);
+            default: return num_blocks<PackedFace<N>>(n);
+        }
+    }
+
+    // offsets of the packet groups of vertex v in units of simd vectors
+    size_t edge_tail_offset(index_t v) const {
+        return packet_ranges[v].offset + num_blocks<PackedEdge<>>(packet_ranges[v].num_edge_packets);
+    }
+
+    size_t face_offset(index_t v) const {
+        return edge_tail_offset(v) + num_blocks<PackedEdge<TailWidth>>(packet_ranges[v].num_edge_tails);
+    }
+
+    size_t face_tail_offset(index_t v) const {
+        return face_offset(v) + num_face_blocks<SimdWidth>(packet_ranges[v].num_face_packets);
+    }
+
+    template<class Packet>
+    Packet *get_packets(size_t offset) {
+        return reinterpret_cast<Packet *>(interception_data.data() + offset);
+    }
+
+    template<class Packet>
+    const Packet *get_packets(size_t offset) const {
+        return reinterpret_cast<const Packet *>(interception_data.data() + offset);
+    }
+
+    // Packs num_packets * N primitives of the list into packets of width N. Missing lanes of the last
+    // packet duplicate its last primitive.
+    template<size_t N>
+    void pack_edges(const Interception *list, size_t num_edges, PackedEdge<N> *packets, size_t num_packets) const;
+
+    template<size_t N>
+    void pack_faces(const Interception *list, size_t num_faces, PackedFace<N> *packets, size_t num_packets) const;
+
+    template<size_t N>
+    void pack_faces(const Interception *list, size_t num_faces, IndexedFace<N> *packets, size_t num_packets) const;
+
+    // the planes are stored relative to origin, rounded to float
+    template<size_t N>
+    void pack_faces(const Interception *list, size_t num_faces, CompressedFace<N> *packets, size_t num_packets,
+                    const GEO::vec3 &origin) const;
+
+    // Packs the faces of the list of vertex v in the packet type of the face storage and stores them at offset
+    template<size_t N>
+    void pack_face_list(const Interception *list, size_t num_faces, size_t offset, size_t num_packets, index_t v);
+
+    // Scans num_packets face packets of width N of vertex v, stored at offset
+    template<size_t N>
+    void closest_faces(size_t offset, size_t num_packets, index_t v, GEO::vec3 q, const PacketScan &scan,
+                       typename SimdTypes<N>::Float &best_d2, typename SimdTypes<N>::Int &best_idx) const;
+};
+
+template<size_t N>
+void SimdImpl::pack_edges(const Interception *list, size_t num_edges, PackedEdge<N> *packets,
+                          size_t num_packets) const {
+    const index_t nb_points = points.size();
+    for (size_t i = 0; i < num_packets; ++i) {
+        PackedEdge<N> packed{};
+        for (size_t j = 0; j < N; ++j) {
+            if (i * N + j < num_edges) {
+                const Interception &interception = list[i * N + j];
+                index_t e = interception.primitive;
+                packed.box.extend(interception.box.lower, interception.box.upper);
+                packed.extent.extend(points[edges[e].start]);
+                packed.extent.extend(points[edges[e].end]);
+                for (size_t d = 0; d < 3; ++d) {
+                    set(packed.start[d], j, (float) points[edges[e].start][d]);
+                    set(packed.dir[d], j, float(points[edges[e].end][d] - points[edges[e].start][d]));
+                }
+                set(packed.inv_dir_len_squared, j,
+                    float(1.0 / GEO::distance2(points[edges[e].end], points[edges[e].start])));
+                set(packed.primitive_idx, j, int(e + nb_points));
+            } else {
+                // duplicate last edge
+                assert(j > 0);
+                for (size_t d = 0; d < 3; ++d) {
+                    set(packed.start[d], j, get(packed.start[d], j - 1));
+                    set(packed.dir[d], j, get(packed.dir[d], j - 1));
+                }
+                set(packed.inv_dir_len_squared, j, get(packed.inv_dir_len_squared, j - 1));
+                set(packed.primitive_idx, j, get(packed.primitive_idx, j - 1));
+            }
+        }
+        packets[i] = packed;
+    }
+}
+
+template<size_t N>
+void SimdImpl::pack_faces(const Interception *list, size_t num_faces, PackedFace<N> *packets,
+                          size_t num_packets) const {
+    const index_t nb_points = points.size();
+    const index_t nb_edges = edges.size();
+    for (size_t i = 0; i < num_packets; ++i) {
+        PackedFace<N> packed{};
+        for (size_t j = 0; j < N; ++j) {
+            if (i * N + j < num_faces) {
+                const Interception &interception = list[i * N + j];
+                index_t f = interception.primitive;
+                packed.box.extend(interception.box.lower, interception.box.upper);
+                for (index_t corner: triangles[f]) {
+                    packed.extent.extend(points[corner]);
+                }
+                for (size_t d = 0; d < 4; ++d) {
+                    set(packed.face_plane[d], j, (float) faces[f].face_plane[d]);
+                    set(packed.edge_plane0[d], j, (float) face_regions[f].clipping_planes[0][d]);
+                    set(packed.edge_plane1[d], j, (float) face_regions[f].clipping_planes[1][d]);
+                    set(packed.edge_plane2[d], j, (float) face_regions[f].clipping_planes[2][d]);
+                }
+                set(packed.primitive_idx, j, int(f + nb_points + nb_edges));
+            } else {
+                // duplicate last face
+                assert(j > 0);
+                for (size_t d = 0; d < 4; ++d) {
+                    set(packed.face_plane[d], j, get(packed.face_plane[d], j - 1));
+                    set(packed.edge_plane0[d], j, get(packed.edge_plane0[d], j - 1));
+                    set(packed.edge_plane1[d], j, get(packed.edge_plane1[d], j - 1));
+                    set(packed.edge_plane2[d], j, get(packed.edge_plane2[d], j - 1));
+                }
+                set(packed.primitive_idx, j, get(packed.primitive_idx, j - 1));
+            }
+        }
+        packets[i] = packed;
+    }
+}
+
+template<size_t N>
+void SimdImpl::pack_faces(const Interception *list, size_t num_faces, IndexedFace<N> *packets,
+                          size_t num_packets) const {
+    for (size_t i = 0; i < num_packets; ++i) {
+        IndexedFace<N> packed{};
+        for (size_t j = 0; j < N; ++j) {
+            if (i * N + j < num_faces) {
+                const Interception &interception = list[i * N + j];
+                packed.box.extend(interception.box.lower, interception.box.upper);
+                for (index_t corner: triangles[interception.primitive]) {
+                    packed.extent.extend(points[corner]);
+                }
+                set(packed.face_idx, j, int(interception.primitive));
+            } else {
+                // duplicate last face
+                assert(j > 0);
+                set(packed.face_idx, j, get(packed.face_idx, j - 1));
+            }
+        }
+        packets[i] = packed;
+    }
+}
+
+template<size_t N>
+void SimdImpl::pack_faces(const Interception *list, size_t num_faces, CompressedFace<N> *packets,
+                          size_t num_packets, const GEO::vec3 &origin) const {
+    const index_t nb_points = points.size();
+    const index_t nb_edges = edges.size();
+    // the kernel subtracts the origin in single precision
+    const GEO::vec3 o((float) origin.x, (float) origin.y, (float) origin.z);
+    for (size_t i = 0; i < num_packets; ++i) {
+        CompressedFace<N> packed{};
+        GEO::vec4 planes[N][4];
+        double max_offset = 0.0;
+        for (size_t j = 0; j < N; ++j) {
+            // missing lanes duplicate the last face
+            assert(i * N + j < num_faces || j > 0);
+            const Interception &interception = list[std::min(i * N + j, num_faces - 1)];
+            index_t f = interception.primitive;
+            if (i * N + j < num_faces) {
+                packed.box.extend(interception.box.lower, interception.box.upper);
+                for (index_t corner: triangles[f]) {
+                    packed.extent.extend(points[corner]);
+                }
+            }
+            planes[j][0] = faces[f].face_plane;
+            for (size_t k = 0; k < 3; ++k) {
+                planes[j][k + 1] = face_regions[f].clipping_planes[k];
+            }
+            for (GEO::vec4 &plane: planes[j]) {
+                plane.w += plane.x * o.x + plane.y * o.y + plane.z * o.z;
+                max_offset = std::max(max_offset, std::abs(plane.w));
+            }
+            set(packed.primitive_idx, j, int(f + nb_points + nb_edges));
+        }
+
+        // a power of two, so scaling the offsets is exact
+        int exponent = 0;
+        std::frexp(max_offset, &exponent);
+        packed.offset_scale = max_offset > 0.0 ? std::ldexp(1.0f, exponent) : 1.0f;
+        for (size_t j = 0; j < N; ++j) {
+            for (size_t p = 0; p < 4; ++p) {
+                packed.planes[p][0][j] = float_to_half((float) planes[j][p].x);
+                packed.planes[p][1][j] = float_to_half((float) planes[j][p].y);
+                packed.planes[p][2][j] = float_to_half((float) planes[j][p].z);
+                packed.planes[p][3][j] = float_to_half((float) (planes[j][p].w / packed.offset_scale));
+            }
+        }
+        packets[i] = packed;
+    }
+}
+
+template<size_t N>
+void SimdImpl::pack_face_list(const Interception *list, size_t num_faces, size_t offset, size_t num_packets,
+                              index_t v) {
+    switch (face_storage) {
+        case FaceStorage::Shared:
+            pack_faces(list, num_faces, get_packets<IndexedFace<N>>(offset), num_packets);
+            break;
+        case FaceStorage::Compressed:
+            pack_faces(list, num_faces, get_packets<CompressedFace<N>>(offset), num_packets, site(v));
+            break;
+        default:
+            pack_faces(list, num_faces, get_packets<PackedFace<N>>(offset), num_packets);
+            break;
+    }
+}
+
+template<size_t N>
+void SimdImpl::closest_faces(size_t offset, size_t num_packets, index_t v, GEO::vec3 q, const PacketScan &scan,
+                             typename SimdTypes<N>::Float &best_d2, typename SimdTypes<N>::Int &best_idx) const {
+    const int32_t face_base = int32_t(points.size() + edges.size());
+    switch (face_storage) {
+        case FaceStorage::Shared:
+            closest_indexed_face_packets(get_packets<IndexedFace<N>>(offset), num_packets, face_table.data(),
+                                         face_base, scan, best_d2, best_idx);
+            break;
+        case FaceStorage::Compressed: {
+            GEO::vec3 o = site(v);
+            const float origin[3] = {(float) o.x, (float) o.y, (float) o.z};
+            closest_compressed_face_packets(get_packets<CompressedFace<N>>(offset), num_packets, scan, origin,
+                                            *this, q, face_base, best_d2, best_idx);
+            break;
+        }
+        default:
+            closest_face_packets(get_packets<PackedFace<N>>(offset), num_packets, scan, best_d2, best_idx);
+            break;
+    }
+}
+
+void SimdImpl::pack_interception_lists(const InterceptionLists &lists) {
+    const index_t nb_sites = num_sites();
+
+    // the counts describe the packed lists, update_positions packs them again
+    stats.num_edge_interceptions = stats.num_face_interceptions = 0;
+    stats.num_edge_packets = stats.num_face_packets = 0;
+    stats.num_edge_tail_packets = stats.num_face_tail_packets = 0;
+    stats.num_local_tree_sites = 0;
+    local_tree.clear();
+
+    // lay out the packets of all sites back to back, edges first
+    packet_ranges.resize(nb_sites);
+    size_t num_vectors = 0;
+    for (index_t v = 0; v < nb_sites; ++v) {
+        size_t num_edges = lists.edge_offsets[v + 1] - lists.edge_offsets[v];
+        size_t num_faces = lists.face_offsets[v + 1] - lists.face_offsets[v];
+        PacketRange &range = packet_ranges[v];
+        range.offset = num_vectors;
+        auto [num_edge_packets, num_edge_tails] = split_packets(num_edges);
+        auto [num_face_packets, num_face_tails] = split_packets(num_faces);
+        if (uses_local_tree(num_edges, num_faces)) {
+            // the tree only holds full width packets
+            num_edge_packets = uint32_t((num_edges + SimdWidth - 1) / SimdWidth);
+            num_face_packets = uint32_t((num_faces + SimdWidth - 1) / SimdWidth);
+            num_edge_tails = num_face_tails = 0;
+        }
+        assert(num_edge_packets < (1u << 24) && num_face_packets < (1u << 24));
+        range.num_edge_packets = num_edge_packets;
+        range.num_edge_tails = num_edge_tails;
+        range.num_face_packets = num_face_packets;
+        range.num_face_tails = num_face_tails;
+        num_vectors += num_blocks<PackedEdge<>>(range.num_edge_packets) +
+                       num_blocks<PackedEdge<TailWidth>>(range.num_edge_tails) +
+                       num_face_blocks<SimdWidth>(range.num_face_packets) +
+                       num_face_blocks<TailWidth>(range.num_face_tails);
+
+        stats.num_edge_interceptions += num_edges;
+        stats.num_face_interceptions += num_faces;
+        stats.num_edge_packets += range.num_edge_packets;
+        stats.num_edge_tail_packets += range.num_edge_tails;
+        stats.num_face_packets += range.num_face_packets;
+        stats.num_face_tail_packets += range.num_face_tails;
+    }
+    interception_data.resize(num_vectors);
+
+    size_t num_lanes = (stats.num_edge_packets + stats.num_face_packets) * SimdWidth +
+                       (stats.num_edge_tail_packets + stats.num_face_tail_packets) * TailWidth;
+    stats.simd_width = SimdWidth;
+    stats.lane_utilization = num_lanes ? double(stats.num_edge_interceptions + stats.num_face_interceptions) /
+                                         double(num_lanes) : 1.0;
+    stats.interception_bytes = num_vectors * sizeof(SimdBlock);
+
+    if (face_storage == FaceStorage::Shared) {
+        face_table.resize(faces.size());
+        for (size_t f = 0; f < faces.size(); ++f) {
+            for (size_t d = 0; d < 4; ++d) {
+                face_table[f].planes[0][d] = (float) faces[f].face_plane[d];
+                for (size_t i = 0; i < 3; ++i) {
+                    face_table[f].planes[i + 1][d] = (float) face_regions[f].clipping_planes[i][d];
+                }
+            }
+        }
+        stats.face_table_bytes = face_table.size() * sizeof(SharedFace);
+    }
+
+    parallel_for(*executor, 0, nb_sites, [this, &lists](index_t v) {
+        pack_vertex(lists, v);
+    });
+
+    if (local_tree_threshold > 0) {
+        local_tree_roots.assign(nb_sites, -1);
+        for (index_t v = 0; v < nb_sites; ++v) {
+            size_t num_edges = lists.edge_offsets[v + 1] - lists.edge_offsets[v];
+            size_t num_faces = lists.face_offsets[v + 1] - lists.face_offsets[v];
+            if (uses_local_tree(num_edges, num_faces)) {
+                local_tree_roots[v] = build_local_tree(v);
+                stats.num_local_tree_sites++;
+            }
+        }
+        stats.local_tree_bytes = local_tree.size() * sizeof(Node);
+    }
+}
+
+void SimdImpl::pack_vertex(const InterceptionLists &lists, index_t v) {
+    const PacketRange &range = packet_ranges[v];
+
+    // the full width packets take the front of the list, the tail packets the rest
+    const Interception *v_edges = lists.edges.data() + lists.edge_offsets[v];
+    size_t num_edges = lists.edge_offsets[v + 1] - lists.edge_offsets[v];
+    const Interception *v_faces = lists.faces.data() + lists.face_offsets[v];
+    size_t num_faces = lists.face_offsets[v + 1] - lists.face_offsets[v];
+
+    // the packets of a list searched with a box tree group nearby interception regions instead
+    std::vector<Interception> sorted_edges, sorted_faces;
+    if (uses_local_tree(num_edges, num_faces)) {
+        sorted_edges.assign(v_edges, v_edges + num_edges);
+        sorted_faces.assign(v_faces, v_faces + num_faces);
+        sort_spatially(sorted_edges.data(), num_edges, SimdWidth, limit_cube_len);
+        sort_spatially(sorted_faces.data(), num_faces, SimdWidth, limit_cube_len);
+        v_edges = sorted_edges.data();
+        v_faces = sorted_faces.data();
+    } else if (list_order == ListOrder::Volume) {
+        // The tail packets are scanned first, so they take the largest regions. The full width packets
+        // follow with the rest in order.
+        size_t num_tail_edges = num_edges - std::min(num_edges, range.num_edge_packets * SimdWidth);
+        size_t num_tail_faces = num_faces - std::min(num_faces, range.num_face_packets * SimdWidth);
+        auto by_volume = [](const Interception &a, const Interception &b) {
+            return a.volume > b.volume;
+        };
+        sorted_edges.assign(v_edges, v_edges + num_edges);
+        sorted_faces.assign(v_faces, v_faces + num_faces);
+        std::stable_sort(sorted_edges.begin(), sorted_edges.end(), by_volume);
+        std::stable_sort(sorted_faces.begin(), sorted_faces.end(), by_volume);
+        std::rotate(sorted_edges.begin(), sorted_edges.begin() + long(num_tail_edges), sorted_edges.end());
+        std::rotate(sorted_faces.begin(), sorted_faces.begin() + long(num_tail_faces), sorted_faces.end());
+        v_edges = sorted_edges.data();
+        v_faces = sorted_faces.data();
+    }
+
+    size_t num_full_edges = std::min(num_edges, range.num_edge_packets * SimdWidth);
+    pack_edges(v_edges, num_full_edges, get_packets<PackedEdge<>>(range.offset), range.num_edge_packets);
+    pack_edges(v_edges + num_full_edges, num_edges - num_full_edges,
+               get_packets<PackedEdge<TailWidth>>(edge_tail_offset(v)), range.num_edge_tails);
+
+    size_t num_full_faces = std::min(num_faces, range.num_face_packets * SimdWidth);
+    pack_face_list<SimdWidth>(v_faces, num_full_faces, face_offset(v), range.num_face_packets, v);
+    pack_face_list<TailWidth>(v_faces + num_full_faces, num_faces - num_full_faces, face_tail_offset(v),
+                              range.num_face_tails, v);
+
+    // runs on the worker threads of parallel_for
+    clear_upper_registers();
+}
+
+size_t SimdImpl::memory_usage() const {
+    size_t bytes = sizeof(*this) + Impl::memory_usage();
+    bytes += bvh.memory_usage();
+    bytes += interception_data.capacity() * sizeof(SimdBlock);
+    bytes += packet_ranges.capacity() * sizeof(PacketRange);
+    bytes += face_table.capacity() * sizeof(SharedFace);
+    bytes += local_tree.capacity() * sizeof(Node);
+    bytes += local_tree_roots.capacity() * sizeof(int32_t);
+    return bytes;
+}
+
+void SimdImpl::check_loaded(const BinaryReader &in) const {
+    in.check(packet_ranges.size() == num_sites());
+    in.check(face_storage != FaceStorage::Shared || face_table.size() == triangles.size());
+    in.check(local_tree_roots.empty() || local_tree_roots.size() == num_sites());
+    const int edge_base = int(points.size());
+    const int face_base = int(points.size() + edges.size());
+    for (index_t v = 0; v < num_sites(); ++v) {
+        const PacketRange &range = packet_ranges[v];
+        in.check(range.offset <= interception_data.size());
+        size_t end = face_tail_offset(v) + num_face_blocks<TailWidth>(range.num_face_tails);
+        in.check(end <= interception_data.size());
+        in.check(lanes_in_range<SimdWidth>(get_packets<PackedEdge<>>(range.offset), range.num_edge_packets,
+                                           &PackedEdge<>::primitive_idx, edge_base, face_base));
+        in.check(lanes_in_range<TailWidth>(get_packets<PackedEdge<TailWidth>>(edge_tail_offset(v)),
+                                           range.num_edge_tails, &PackedEdge<TailWidth>::primitive_idx, edge_base,
+                                           face_base));
+        in.check(face_lanes_in_range<SimdWidth>(face_offset(v), range.num_face_packets));
+        in.check(face_lanes_in_range<TailWidth>(face_tail_offset(v), range.num_face_tails));
+    }
+
+    // The box trees of the sites follow each other in site order, and every tree is built bottom up, so the
+    // children of a node precede it. The leaves index the full width packets of the site. Children with an empty
+    // box are never visited, they fill the unused slots of a node.
+    size_t tree_begin = 0;
+    std::vector<int> height(local_tree.size(), 1);
+    for (index_t v = 0; v < local_tree_roots.size(); ++v) {
+        int32_t root = local_tree_roots[v];
+        in.check(root >= -1 && root < int32_t(local_tree.size()));
+        if (root < 0) {
+            continue;
+        }
+        in.check(size_t(root) >= tree_begin);
+        const size_t num_packets = packet_ranges[v].num_edge_packets + packet_ranges[v].num_face_packets;
+        for (size_t n = tree_begin; n <= size_t(root); ++n) {
+            const Node &node = local_tree[n];
+            for (int j = 0; j < 4; ++j) {
+                bool empty = false;
+                for (int d = 0; d < 3; ++d) {
+                    empty = empty || !(get(node.minCorners[d], j) <= get(node.maxCorners[d], j));
+                }
+                int32_t child = get(node.children, j);
+                if (empty) {
+                    continue;
+                }
+                if (child < 0) {
+                    in.check(size_t(-(child + 1)) < num_packets);
+                } else {
+                    in.check(size_t(child) >= tree_begin && size_t(child) < n);
+                    height[n] = std::max(height[n], height[child] + 1);
+                }
+            }
+            in.check(height[n] <= MaxTreeHeight);
+        }
+        tree_begin = size_t(root) + 1;
+    }
+}
+
+template<size_t N>
+bool SimdImpl::face_lanes_in_range(size_t offset, size_t n) const {
+    const int face_base = int(points.size() + edges.size());
+    switch (face_storage) {
+        case FaceStorage::Shared:
+            return lanes_in_range<N>(get_packets<IndexedFace<N>>(offset), n, &IndexedFace<N>::face_idx, 0,
+                                     int(face_table.size()));
+        case FaceStorage::Compressed:
+            return lanes_in_range<N>(get_packets<CompressedFace<N>>(offset), n, &CompressedFace<N>::primitive_idx,
+                                     face_base, face_base + int(triangles.size()));
+        default:
+            return lanes_in_range<N>(get_packets<PackedFace<N>>(offset), n, &PackedFace<N>::primitive_idx,
+                                     face_base, face_base + int(triangles.size()));
+    }
+}
+
+UpdateStats SimdImpl::update_positions(const uint32_t *indices, size_t num_indices, const float *positions) {
+    auto start = std::chrono::steady_clock::now();
+    // the threads of the build options, and the calling thread works on the parallel loops as well
+    ScopedBuildPool pool(*this);
+    ScopedAffinity affinity(cpus);
+    clear_upper_registers();
+    UpdateStats update;
+    update.rebuilt = update_interception_lists(indices, num_indices, positions, update);
+
+    auto packing_start = std::chrono::steady_clock::now();
+    clear_upper_registers();
+    if (update.rebuilt) {
+        bvh = Bvh(points);
+    } else {
+        bvh.refit(points);
+    }
+    clear_upper_registers();
+    pack_interception_lists(interception_lists);
+    update.packing_ms = milliseconds_since(packing_start);
+    stats.packing_ms += update.packing_ms;
+    update.total_ms = milliseconds_since(start);
+    return update;
+}
+
+BuildOptions SimdImpl::build_options() const {
+    BuildOptions options;
+    options.limit_cube_len = float(limit_cube_len);
+    options.compact = face_regions.empty() && !triangles.empty();
+    options.instruction_set = Isa;
+    options.face_storage = face_storage;
+    options.max_interceptions = max_interceptions;
+    options.max_steiner_rounds = max_steiner_rounds;
+    options.local_tree_threshold = local_tree_threshold;
+    options.list_order = list_order;
+    options.remove_dominated = remove_dominated;
+    options.cell_memory_budget = cell_memory_budget;
+    options.vertex_centric_build = vertex_centric_build;
+    options.keep_update_data = keep_update_data;
+    options.max_update_fraction = float(max_update_fraction);
+    // a structure with its own threads is rebuilt with the same ones
+    if (options_executor) {
+        options.executor = options_executor;
+    } else {
+        options.num_threads = num_threads;
+        options.cpu_affinity = cpus;
+    }
+    return options;
+}
+
+void SimdImpl::save(BinaryWriter &out) const {
+    write_file_header(out, Isa, SimdWidth);
+    write_build_options(out, build_options());
+    out.write_array(points);
+    out.write_array(triangles);
+
+    save_tables(out);
+    bvh.save(out);
+    out.write_array(interception_data);
+    out.write_array(packet_ranges);
+    out.write_array(face_table);
+    out.write_array(local_tree);
+    out.write_array(local_tree_roots);
+}
+
+int32_t SimdImpl::build_local_tree(index_t v) {
+    const PacketRange &range = packet_ranges[v];
+
+    // the boxes of the packets, edges first
+    std::vector<PacketBox> boxes;
+    const PackedEdge<> *edge_packets = get_packets<PackedEdge<>>(range.offset);
+    for (size_t i = 0; i < range.num_edge_packets; ++i) {
+        boxes.push_back(edge_packets[i].box);
+    }
+    for (size_t i = 0; i < range.num_face_packets; ++i) {
+        size_t offset = face_offset(v) + num_face_blocks<SimdWidth>(i);
+        switch (face_storage) {
+            case FaceStorage::Shared: boxes.push_back(get_packets<IndexedFace<>>(offset)->box); break;
+            case FaceStorage::Compressed: boxes.push_back(get_packets<CompressedFace<>>(offset)->box); break;
+            default: boxes.push_back(get_packets<PackedFace<>>(offset)->box); break;
+        }
+    }
+    std::vector<int32_t> children(boxes.size());
+    for (size_t i = 0; i < children.size(); ++i) {
+        children[i] = -int32_t(i + 1);
+    }
+
+    // The packets are in spatial order already, so the tree is built bottom up from groups of four
+    // consecutive children. There is at least one node, even for a single packet.
+    do {
+        std::vector<PacketBox> parent_boxes;
+        std::vector<int32_t> parents;
+        for (size_t i = 0; i < children.size(); i += 4) {
+            Node node{};
+            PacketBox box;
+            for (int j = 0; j < 4; ++j) {
+                PacketBox child_box;
+                int32_t child = 0;
+                if (i + j < children.size()) {
+                    child_box = boxes[i + j];
+                    child = children[i + j];
+                }
+                for (int d = 0; d < 3; ++d) {
+                    set(node.minCorners[d], j, child_box.lower[d]);
+                    set(node.maxCorners[d], j, child_box.upper[d]);
+                    box.lower[d] = std::min(box.lower[d], child_box.lower[d]);
+                    box.upper[d] = std::max(box.upper[d], child_box.upper[d]);
+                }
+                set(node.children, j, child);
+            }
+            parents.push_back(int32_t(local_tree.size()));
+            parent_boxes.push_back(box);
+            local_tree.push_back(node);
+        }
+        children = std::move(parents);
+        boxes = std::move(parent_boxes);
+    } while (children.size() > 1);
+
+    clear_upper_registers();
+    return children[0];
+}
+
+void SimdImpl::closest_in_local_tree(index_t v, GEO::vec3 q, const PacketScan &scan, float32xN_t &best_d2,
+                                     int32xN_t &best_idx) const {
+    const PacketRange &range = packet_ranges[v];
+    const PackedEdge<> *edge_packets = get_packets<PackedEdge<>>(range.offset);
+
+    float32x4_t qx4 = dupf32<4>(scan.q[0]);
+    float32x4_t qy4 = dupf32<4>(scan.q[1]);
+    float32x4_t qz4 = dupf32<4>(scan.q[2]);
+    float32xN_t qx = dupf32(scan.q[0]);
+    float32xN_t qy = dupf32(scan.q[1]);
+    float32xN_t qz = dupf32(scan.q[2]);
+
+    int32_t stack[TreeStackSize];
+    int stack_size = 0;
+    stack[stack_size++] = local_tree_roots[v];
+
+    while (stack_size > 0) {
+        const Node &node = local_tree[stack[--stack_size]];
+        SimdTypes<4>::Mask inside = logical_and(geq(qx4, node.minCorners[0]), leq(qx4, node.maxCorners[0]));
+        inside = logical_and(inside, logical_and(geq(qy4, node.minCorners[1]), leq(qy4, node.maxCorners[1])));
+        inside = logical_and(inside, logical_and(geq(qz4, node.minCorners[2]), leq(qz4, node.maxCorners[2])));
+
+        for (int bits = mask_bits(inside), j = 0; bits; bits >>= 1, ++j) {
+            if (!(bits & 1)) {
+                continue;
+            }
+            int32_t child = get(node.children, j);
+            if (child >= 0) {
+                assert(stack_size < TreeStackSize);
+                stack[stack_size++] = child;
+                continue;
+            }
+            size_t packet = size_t(-(child + 1));
+            if (packet < range.num_edge_packets) {
+                const PackedEdge<> &pack = edge_packets[packet];
+                if (scan.needs_scan<SimdWidth>(pack.box, pack.extent, best_d2)) {
+                    closest_edge<SimdWidth>(pack, qx, qy, qz, best_d2, best_idx);
+                }
+            } else {
+                size_t offset = face_offset(v) + num_face_blocks<SimdWidth>(packet - range.num_edge_packets);
+                closest_faces<SimdWidth>(offset, 1, v, q, scan, best_d2, best_idx);
+            }
+        }
+    }
+}
+
+Result SimdImpl::calc_closest_point(GEO::vec3 q) const {
+    return closest_point(q, nullptr);
+}
+
+Result SimdImpl::calc_closest_point(GEO::vec3 q, size_t &num_packets_scanned) const {
+    return closest_point(q, &num_packets_scanned);
+}
+
+Result SimdImpl::closest_point(GEO::vec3 q, size_t *num_packets_scanned) const {
+    auto [v, v_dist2] = bvh.closestPoint(q);
+
+    const PacketRange &range = packet_ranges[v];
+    const bool has_tree = !local_tree_roots.empty() && local_tree_roots[v] >= 0;
+    const PacketScan scan{{(float) q.x, (float) q.y, (float) q.z}, list_order == ListOrder::LowerX && !has_tree,
+                          num_packets_scanned};
+
+    if (has_tree) {
+        float32xN_t best_d2 = dupf32(v_dist2);
+        int32xN_t best_idx = dupi32(site_primitive(v));
+        closest_in_local_tree(v, q, scan, best_d2, best_idx);
+        return reduce_closest(q, best_d2, best_idx);
+    }
+
+    // The tail packets are scanned first with 4 lanes. Their lanes are then repeated across the full
+    // width, which the min reduction at the end does not mind, so only one reduction is needed.
+    float32x4_t tail_d2 = dupf32<TailWidth>(v_dist2);
+    // a steiner site lies on a face, which is the closest primitive unless a closer one is found
+    int32x4_t tail_idx = dupi32<TailWidth>(site_primitive(v));
+    if constexpr (SimdWidth > TailWidth) {
+        closest_edge_packets(get_packets<PackedEdge<TailWidth>>(edge_tail_offset(v)), range.num_edge_tails, scan,
+                             tail_d2, tail_idx);
+        closest_faces<TailWidth>(face_tail_offset(v), range.num_face_tails, v, q, scan, tail_d2, tail_idx);
+    }
+
+    float32xN_t best_d2 = dupf32x4(tail_d2);
+    int32xN_t best_idx = dupi32x4(tail_idx);
+    closest_edge_packets(get_packets<PackedEdge<>>(range.offset), range.num_edge_packets, scan, best_d2, best_idx);
+    closest_faces<SimdWidth>(face_offset(v), range.num_face_packets, v, q, scan, best_d2, best_idx);
+
+    return reduce_closest(q, best_d2, best_idx);
+}
+
+Result SimdImpl::reduce_closest(GEO::vec3 q, const float32xN_t &best_d2, const int32xN_t &best_idx) const {
+    float distance_squared = get(best_d2, 0);
+    int primitive = get(best_idx, 0);
+
+    // Find overall minimum distance and index
+    for (size_t j = 1; j < SimdWidth; ++j) {
+        if (get(best_d2, j) < distance_squared) {
+            distance_squared = get(best_d2, j);
+            primitive = get(best_idx, j);
+        }
+    }
+
+    clear_upper_registers();
+    return make_result(q, distance_squared, primitive);
+}
+
+#undef cmin
+#undef cmax
+#undef cswap
+#undef nsort4
+
+// Lets tools that are compiled together with mantis.cpp (e.g. the micro-benchmarks) add code that is
+// compiled once per instruction set, next to the kernels.
+#ifdef MANTIS_SIMD_EXTENSION
+#include MANTIS_SIMD_EXTENSION
+#endif
@@ -5,6 +5,13 @@
 #include <Model.h> // original p2m implementation
 
 #include <random>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <numeric>
+#include <thread>
 
 void load_obj(const std::string &path,
               std::vector<std::array<float, 3>> &points,
@@ -212,6 +219,55 @@ void run_test_case(const std::string& name, size_t num_samples, double eps) {
     check_random_samples(accelerator, model, num_samples, eps);
 }
 
+void load_mesh(const std::string &name, std::vector<std::array<float, 3>> &points,
+               std::vector<std::array<uint32_t, 3>> &triangles) {
+    load_obj(std::string(ASSETS_DIR) + name, points, triangles);
+}
+
+mantis::BuildOptions test_options() {
+    mantis::BuildOptions options;
+    options.limit_cube_len = limit_cube_len;
+    return options;
+}
+
+std::vector<std::array<float, 3>> random_queries(size_t n) {
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+    std::vector<std::array<float, 3>> queries(n);
+    for (auto &q: queries) {
+        q = {dist(gen), dist(gen), dist(gen)};
+    }
+    return queries;
+}
+
+// Calls f(instruction_set) for every instruction set compiled into the library that this cpu can run
+template<class F>
+void for_each_supported_isa(F f) {
+    for (auto instruction_set: {mantis::InstructionSet::NEON, mantis::InstructionSet::SSE,
+                                mantis::InstructionSet::AVX2, mantis::InstructionSet::AVX512}) {
+        if (mantis::is_supported(instruction_set)) {
+            f(instruction_set);
+        }
+    }
+}
+
+// Checks that other returns the distances of accelerator up to eps, and also the same primitives if eps is zero
+void check_same_distances(const mantis::AccelerationStructure &accelerator,
+                          const mantis::AccelerationStructure &other, double eps,
+                          const std::vector<std::array<float, 3>> &queries = random_queries(10000)) {
+    for (const auto &q: queries) {
+        auto expected = accelerator.calc_closest_point(q);
+        auto result = other.calc_closest_point(q);
+        if (eps == 0.0) {
+            CHECK_EQ(result.distance_squared, expected.distance_squared);
+            CHECK_EQ(result.primitive_index, expected.primitive_index);
+            CHECK_EQ(result.type, expected.type);
+        } else {
+            CHECK_EQ(result.distance_squared, doctest::Approx(expected.distance_squared).epsilon(eps));
+        }
+    }
+}
+
 
 // TODO: crashes geogram for some reason
 //TEST_CASE("eba") {
@@ -240,4 +296,670 @@ TEST_CASE("fandisk") {
 
 TEST_CASE("crank_pin") {
     run_test_case("crank_pin.obj", 1e4, 1e-6);
-}
\ No newline at end of file
+}
+
+TEST_CASE("compact") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("dragon.obj", points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    mantis::AccelerationStructure accelerator(points, triangles, options);
+
+    options.compact = true;
+    mantis::AccelerationStructure compact_accelerator(points, triangles, options);
+
+    size_t full_bytes = accelerator.memory_usage();
+    size_t compact_bytes = compact_accelerator.memory_usage();
+    MESSAGE("dragon: " << full_bytes << " bytes, compact: " << compact_bytes << " bytes");
+
+    // at least the region planes of every face and edge have to be released
+    size_t region_bytes = accelerator.num_faces() * 3 * 4 * sizeof(double) +
+                          accelerator.num_edges() * 4 * 4 * sizeof(double);
+    CHECK_LE(compact_bytes + region_bytes, full_bytes);
+
+    CHECK_EQ(compact_accelerator.get_face_edges(), accelerator.get_face_edges());
+    check_same_distances(accelerator, compact_accelerator, 0.0);
+}
+
+TEST_CASE("face_edges") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("fandisk.obj", points, triangles);
+
+    mantis::AccelerationStructure accelerator(points, triangles, test_options());
+    auto faces = accelerator.get_faces();
+    auto face_edges = accelerator.get_face_edges();
+    auto edge_vertices = accelerator.get_edge_vertices();
+
+    // the edges are unique and ordered by their vertices
+    for (size_t e = 0; e < edge_vertices.size(); ++e) {
+        CHECK_LT(edge_vertices[e].first, edge_vertices[e].second);
+        if (e > 0) {
+            CHECK_LT(edge_vertices[e - 1], edge_vertices[e]);
+        }
+    }
+
+    // edge i of a face connects its vertices i and i + 1, and every edge borders a face
+    std::vector<int> num_faces(edge_vertices.size(), 0);
+    REQUIRE_EQ(face_edges.size(), faces.size());
+    for (size_t f = 0; f < faces.size(); ++f) {
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE_LT(face_edges[f][i], edge_vertices.size());
+            auto [v0, v1] = std::minmax(faces[f][i], faces[f][(i + 1) % 3]);
+            CHECK_EQ(edge_vertices[face_edges[f][i]], std::pair{v0, v1});
+            ++num_faces[face_edges[f][i]];
+        }
+    }
+    CHECK(std::all_of(num_faces.begin(), num_faces.end(), [](int n) { return n > 0; }));
+}
+
+TEST_CASE("instruction_sets") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+    auto model = build_p2m(points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    mantis::AccelerationStructure accelerator(points, triangles, options);
+    CHECK(mantis::is_supported(accelerator.instruction_set()));
+
+    // every instruction set compiled into the library that this cpu can run has to give correct results
+    for_each_supported_isa([&](mantis::InstructionSet instruction_set) {
+        options.instruction_set = instruction_set;
+        mantis::AccelerationStructure forced_accelerator(points, triangles, options);
+        CHECK_EQ(forced_accelerator.instruction_set(), instruction_set);
+        check_random_samples(forced_accelerator, model, 1e4, 1e-6);
+    });
+}
+
+TEST_CASE("build_stats") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    for_each_supported_isa([&](mantis::InstructionSet instruction_set) {
+        options.instruction_set = instruction_set;
+        mantis::AccelerationStructure accelerator(points, triangles, options);
+        const mantis::BuildStats &stats = accelerator.stats();
+
+        size_t num_interceptions = stats.num_edge_interceptions + stats.num_face_interceptions;
+        size_t num_lanes = (stats.num_edge_packets + stats.num_face_packets) * stats.simd_width +
+                           (stats.num_edge_tail_packets + stats.num_face_tail_packets) * 4;
+        MESSAGE("simd width " << stats.simd_width << ": lane utilization " << stats.lane_utilization << ", "
+                              << stats.interception_bytes << " bytes");
+
+        CHECK_GT(num_interceptions, 0);
+        CHECK_GE(num_lanes, num_interceptions);
+        CHECK_EQ(stats.lane_utilization, doctest::Approx(double(num_interceptions) / double(num_lanes)));
+        // every list pads less than one full width packet
+        CHECK_LT(num_lanes - num_interceptions, 2 * accelerator.num_vertices() * stats.simd_width);
+        CHECK_LE(stats.interception_bytes, accelerator.memory_usage());
+
+        MESSAGE("delaunay " << stats.delaunay_ms << " ms, voronoi cells " << stats.voronoi_cells_ms
+                            << " ms, faces " << stats.face_interceptions_ms << " ms, edges "
+                            << stats.edge_interceptions_ms << " ms, packing " << stats.packing_ms << " ms");
+        CHECK_GT(stats.delaunay_ms, 0.0);
+        CHECK_GT(stats.voronoi_cells_ms, 0.0);
+        CHECK_GT(stats.face_interceptions_ms, 0.0);
+        CHECK_GT(stats.edge_interceptions_ms, 0.0);
+        CHECK_GT(stats.packing_ms, 0.0);
+    });
+}
+
+TEST_CASE("face_storage") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+    auto model = build_p2m(points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    for_each_supported_isa([&](mantis::InstructionSet instruction_set) {
+        options.instruction_set = instruction_set;
+        options.face_storage = mantis::FaceStorage::Packed;
+        mantis::AccelerationStructure accelerator(points, triangles, options);
+        CHECK_EQ(accelerator.stats().face_table_bytes, 0);
+
+        for (auto face_storage: {mantis::FaceStorage::Shared, mantis::FaceStorage::Compressed}) {
+            options.face_storage = face_storage;
+            mantis::AccelerationStructure other_accelerator(points, triangles, options);
+
+            MESSAGE("simd width " << accelerator.stats().simd_width << ": " << accelerator.memory_usage()
+                                  << " bytes, face storage " << int(face_storage) << ": "
+                                  << other_accelerator.memory_usage() << " bytes");
+            CHECK_LT(other_accelerator.memory_usage(), accelerator.memory_usage());
+            check_random_samples(other_accelerator, model, 1e4, 1e-6);
+            if (face_storage == mantis::FaceStorage::Shared) {
+                CHECK_EQ(other_accelerator.stats().face_table_bytes, accelerator.num_faces() * 16 * sizeof(float));
+                // the planes are the same floats in both layouts, so the results have to match exactly
+                check_same_distances(accelerator, other_accelerator, 0.0);
+            } else {
+                // compressed faces are verified in double precision
+                check_same_distances(accelerator, other_accelerator, 1e-5);
+            }
+        }
+    });
+}
+
+TEST_CASE("steiner_sites") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+    auto model = build_p2m(points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    mantis::AccelerationStructure accelerator(points, triangles, options);
+    CHECK_EQ(accelerator.stats().num_steiner_sites, 0);
+    CHECK_GT(accelerator.stats().max_list_length, 0);
+
+    options.max_interceptions = accelerator.stats().max_list_length / 2;
+    mantis::AccelerationStructure bounded_accelerator(points, triangles, options);
+    const mantis::BuildStats &stats = bounded_accelerator.stats();
+    MESSAGE("longest list " << accelerator.stats().max_list_length << ", with " << stats.num_steiner_sites
+                            << " steiner sites " << stats.max_list_length);
+    CHECK_GT(stats.num_steiner_sites, 0);
+    CHECK_LT(stats.max_list_length, accelerator.stats().max_list_length);
+
+    check_random_samples(bounded_accelerator, model, 1e4, 1e-6);
+    check_same_distances(accelerator, bounded_accelerator, 1e-6);
+}
+
+TEST_CASE("local_tree") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+    auto model = build_p2m(points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    for_each_supported_isa([&](mantis::InstructionSet instruction_set) {
+        options.instruction_set = instruction_set;
+        for (auto face_storage: {mantis::FaceStorage::Packed, mantis::FaceStorage::Shared,
+                                 mantis::FaceStorage::Compressed}) {
+            options.face_storage = face_storage;
+            options.local_tree_threshold = 0;
+            mantis::AccelerationStructure accelerator(points, triangles, options);
+            CHECK_EQ(accelerator.stats().num_local_tree_sites, 0);
+            CHECK_EQ(accelerator.stats().local_tree_bytes, 0);
+
+            options.local_tree_threshold = 32;
+            mantis::AccelerationStructure tree_accelerator(points, triangles, options);
+            const mantis::BuildStats &stats = tree_accelerator.stats();
+            MESSAGE("simd width " << stats.simd_width << ", face storage " << int(face_storage) << ": "
+                                  << stats.num_local_tree_sites << " box trees, " << stats.local_tree_bytes
+                                  << " bytes");
+            CHECK_GT(stats.num_local_tree_sites, 0);
+            CHECK_LT(stats.num_local_tree_sites, accelerator.num_vertices());
+            CHECK_GT(stats.local_tree_bytes, 0);
+
+            check_random_samples(tree_accelerator, model, 1e4, 1e-6);
+            check_same_distances(accelerator, tree_accelerator, 1e-6);
+        }
+    });
+}
+
+TEST_CASE("list_order") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+    auto model = build_p2m(points, triangles);
+    std::vector<std::array<float, 3>> queries = random_queries(10000);
+
+    mantis::BuildOptions options = test_options();
+    for_each_supported_isa([&](mantis::InstructionSet instruction_set) {
+        options.instruction_set = instruction_set;
+        for (auto face_storage: {mantis::FaceStorage::Packed, mantis::FaceStorage::Shared,
+                                 mantis::FaceStorage::Compressed}) {
+            options.face_storage = face_storage;
+            options.list_order = mantis::ListOrder::LowerX;
+            mantis::AccelerationStructure accelerator(points, triangles, options);
+            options.list_order = mantis::ListOrder::Volume;
+            mantis::AccelerationStructure volume_accelerator(points, triangles, options);
+
+            mantis::QueryStats stats = accelerator.query_stats(queries);
+            mantis::QueryStats volume_stats = volume_accelerator.query_stats(queries);
+            // only reported, neither order scans fewer packets for every mesh and query distribution
+            MESSAGE("simd width " << accelerator.stats().simd_width << ", face storage " << int(face_storage)
+                                  << ": " << stats.packets_scanned_per_query << " packets per query, by volume "
+                                  << volume_stats.packets_scanned_per_query);
+            CHECK_EQ(stats.num_queries, queries.size());
+            CHECK_GT(stats.num_packets_scanned, 0);
+            CHECK_EQ(stats.packets_scanned_per_query,
+                     doctest::Approx(double(stats.num_packets_scanned) / double(queries.size())));
+            CHECK_GT(volume_stats.num_packets_scanned, 0);
+
+            check_random_samples(volume_accelerator, model, 1e4, 1e-6);
+            check_same_distances(accelerator, volume_accelerator, 1e-6, queries);
+        }
+    });
+}
+
+TEST_CASE("dominated_primitives") {
+    for (std::string mesh: {"bunny.obj", "fandisk.obj"}) {
+        std::vector<std::array<float, 3>> points;
+        std::vector<std::array<uint32_t, 3>> triangles;
+        load_mesh(mesh, points, triangles);
+        auto model = build_p2m(points, triangles);
+
+        // the triangulation of geogram is only reproducible on one thread
+        mantis::BuildOptions options = test_options();
+        options.num_threads = 1;
+        mantis::AccelerationStructure accelerator(points, triangles, options);
+        options.remove_dominated = true;
+        mantis::AccelerationStructure dominated_accelerator(points, triangles, options);
+
+        const mantis::BuildStats &stats = accelerator.stats();
+        const mantis::BuildStats &dominated_stats = dominated_accelerator.stats();
+        size_t num_interceptions = stats.num_edge_interceptions + stats.num_face_interceptions;
+        size_t num_kept = dominated_stats.num_edge_interceptions + dominated_stats.num_face_interceptions;
+        MESSAGE(mesh << ": " << num_interceptions << " interceptions, " << dominated_stats.num_dominated_interceptions
+                     << " dominated, longest list " << stats.max_list_length << " -> "
+                     << dominated_stats.max_list_length);
+        CHECK_EQ(stats.num_dominated_interceptions, 0);
+        CHECK_EQ(num_kept + dominated_stats.num_dominated_interceptions, num_interceptions);
+        CHECK_LE(dominated_stats.max_list_length, stats.max_list_length);
+
+        check_random_samples(dominated_accelerator, model, 1e4, 1e-6);
+        check_same_distances(accelerator, dominated_accelerator, 1e-6);
+    }
+}
+
+TEST_CASE("cell_memory_budget") {
+    for (std::string mesh: {"bunny.obj", "fandisk.obj"}) {
+        std::vector<std::array<float, 3>> points;
+        std::vector<std::array<uint32_t, 3>> triangles;
+        load_mesh(mesh, points, triangles);
+        auto model = build_p2m(points, triangles);
+
+        // the triangulation of geogram is only reproducible on one thread
+        mantis::BuildOptions options = test_options();
+        options.num_threads = 1;
+        mantis::AccelerationStructure accelerator(points, triangles, options);
+        options.cell_memory_budget = 1 << 20;
+        mantis::AccelerationStructure budget_accelerator(points, triangles, options);
+
+        const mantis::BuildStats &stats = accelerator.stats();
+        const mantis::BuildStats &budget_stats = budget_accelerator.stats();
+        MESSAGE(mesh << ": peak cell memory " << stats.peak_cell_bytes << " bytes, with a budget of "
+                     << options.cell_memory_budget << " bytes " << budget_stats.peak_cell_bytes << " bytes, "
+                     << budget_stats.num_cell_computations << " cells computed for "
+                     << stats.num_cell_computations << " sites");
+        CHECK_EQ(stats.num_cell_computations, accelerator.num_vertices());
+        // the caches keep at least 1024 cells whatever the budget, so all cells of the bunny, but the number of
+        // computations stays bounded
+        CHECK_LE(budget_stats.peak_cell_bytes, stats.peak_cell_bytes);
+        if (accelerator.num_vertices() > 1024) {
+            CHECK_LT(budget_stats.peak_cell_bytes, stats.peak_cell_bytes);
+        }
+        CHECK_LE(budget_stats.num_cell_computations, 10 * stats.num_cell_computations);
+        CHECK_EQ(budget_stats.num_edge_interceptions, stats.num_edge_interceptions);
+        CHECK_EQ(budget_stats.num_face_interceptions, stats.num_face_interceptions);
+
+        check_random_samples(budget_accelerator, model, 1e4, 1e-6);
+        check_same_distances(accelerator, budget_accelerator, 0.0);
+    }
+}
+
+TEST_CASE("vertex_centric_build") {
+    for (std::string mesh: {"bunny.obj", "fandisk.obj"}) {
+        std::vector<std::array<float, 3>> points;
+        std::vector<std::array<uint32_t, 3>> triangles;
+        load_mesh(mesh, points, triangles);
+        auto model = build_p2m(points, triangles);
+
+        for (size_t max_interceptions: {0, 64}) {
+            mantis::BuildOptions options = test_options();
+            options.max_interceptions = max_interceptions;
+            mantis::AccelerationStructure accelerator(points, triangles, options);
+            options.vertex_centric_build = true;
+            mantis::AccelerationStructure vertex_accelerator(points, triangles, options);
+            options.cell_memory_budget = 1 << 20;
+            mantis::AccelerationStructure budget_accelerator(points, triangles, options);
+
+            const mantis::BuildStats &stats = accelerator.stats();
+            const mantis::BuildStats &vertex_stats = vertex_accelerator.stats();
+            MESSAGE(mesh << ", " << stats.num_steiner_sites << " steiner sites: faces " << stats.face_interceptions_ms
+                         << " ms, edges " << stats.edge_interceptions_ms << " ms, transpose " << stats.transpose_ms
+                         << " ms, vertex centric " << vertex_stats.site_interceptions_ms << " ms");
+            // the delaunay triangulation of cospherical sites is not unique, so the lists of two builds can
+            // differ slightly
+            for (const mantis::BuildStats *other: {&vertex_stats, &budget_accelerator.stats()}) {
+                CHECK_EQ(other->num_steiner_sites, stats.num_steiner_sites);
+                CHECK_EQ(double(other->num_edge_interceptions),
+                         doctest::Approx(double(stats.num_edge_interceptions)).epsilon(1e-3));
+                CHECK_EQ(double(other->num_face_interceptions),
+                         doctest::Approx(double(stats.num_face_interceptions)).epsilon(1e-3));
+                CHECK_EQ(other->transpose_ms, 0.0);
+                CHECK_GT(other->site_interceptions_ms, 0.0);
+            }
+
+            check_random_samples(vertex_accelerator, model, 1e4, 1e-6);
+            check_same_distances(accelerator, vertex_accelerator, 1e-6);
+            check_same_distances(accelerator, budget_accelerator, 1e-6);
+        }
+    }
+}
+
+// runs the chunks serially in reverse order
+struct ReverseExecutor : mantis::Executor {
+    void parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t)> &body) override {
+        size_t num_chunks = (n + grain - 1) / grain;
+        for (size_t c = num_chunks; c-- > 0;) {
+            body(c * grain, std::min(n, (c + 1) * grain));
+            num_calls++;
+        }
+    }
+
+    size_t num_threads() const override {
+        return 1;
+    }
+
+    size_t num_calls = 0;
+};
+
+TEST_CASE("executor") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+    auto model = build_p2m(points, triangles);
+    std::vector<std::array<float, 3>> queries = random_queries(10000);
+
+    mantis::BuildOptions options = test_options();
+    mantis::AccelerationStructure accelerator(points, triangles, options);
+
+    std::unique_ptr<mantis::Executor> pool = mantis::create_thread_pool(4);
+    CHECK_EQ(pool->num_threads(), 4);
+    ReverseExecutor reverse;
+    for (mantis::Executor *executor: {pool.get(), (mantis::Executor *) &reverse}) {
+        options.executor = executor;
+        mantis::AccelerationStructure executor_accelerator(points, triangles, options);
+        check_random_samples(executor_accelerator, model, 1e4, 1e-6);
+        check_same_distances(accelerator, executor_accelerator, 1e-6, queries);
+
+        // the batch queries run on the executor as well
+        std::vector<mantis::Result> results = executor_accelerator.calc_closest_points(queries);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            CHECK_EQ(results[i].distance_squared,
+                     executor_accelerator.calc_closest_point(queries[i]).distance_squared);
+        }
+    }
+    CHECK_GT(reverse.num_calls, 0);
+
+    // every index is visited once, also by nested loops, and exceptions reach the caller
+    std::vector<std::atomic<int>> visits(10000);
+    pool->parallel_for(100, 3, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            pool->parallel_for(100, 7, [&](size_t nested_begin, size_t nested_end) {
+                for (size_t j = nested_begin; j < nested_end; ++j) {
+                    visits[100 * i + j]++;
+                }
+            });
+        }
+    });
+    CHECK(std::all_of(visits.begin(), visits.end(), [](const std::atomic<int> &v) { return v == 1; }));
+
+    // a loop of another pool nested in a loop of the pool runs in parallel: its two chunks wait for each other
+    std::unique_ptr<mantis::Executor> other_pool = mantis::create_thread_pool(2);
+    std::atomic<int> num_met{0};
+    pool->parallel_for(4, 1, [&](size_t, size_t) {
+        std::atomic<int> num_started{0};
+        other_pool->parallel_for(2, 1, [&](size_t, size_t) {
+            num_started++;
+            auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (num_started < 2 && std::chrono::steady_clock::now() < timeout) {
+                std::this_thread::yield();
+            }
+        });
+        if (num_started == 2) {
+            num_met++;
+        }
+    });
+    CHECK_EQ(num_met, 4);
+
+    // loops started by two threads at once run side by side: the chunks of each wait for a chunk of the other
+    std::atomic<int> num_started[2] = {{0}, {0}};
+    std::atomic<int> num_waited[2] = {{0}, {0}};
+    std::vector<std::thread> callers;
+    for (int caller = 0; caller < 2; ++caller) {
+        callers.emplace_back([&, caller] {
+            pool->parallel_for(2, 1, [&](size_t, size_t) {
+                num_started[caller]++;
+                auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+                while (num_started[1 - caller] == 0 && std::chrono::steady_clock::now() < timeout) {
+                    std::this_thread::yield();
+                }
+                if (num_started[1 - caller] > 0) {
+                    num_waited[caller]++;
+                }
+            });
+        });
+    }
+    for (std::thread &caller: callers) {
+        caller.join();
+    }
+    CHECK_EQ(num_waited[0], 2);
+    CHECK_EQ(num_waited[1], 2);
+
+    CHECK_THROWS_AS(pool->parallel_for(100, 1, [](size_t begin, size_t) {
+        if (begin == 50) {
+            throw std::runtime_error("chunk 50");
+        }
+    }), std::runtime_error);
+}
+
+TEST_CASE("build_threads") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+    auto model = build_p2m(points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    options.num_threads = 2;
+    mantis::AccelerationStructure accelerator(points, triangles, options);
+    CHECK_EQ(accelerator.stats().num_threads, 2);
+    check_random_samples(accelerator, model, 1e4, 1e-6);
+
+#ifdef __linux__
+    options.num_threads = 0;
+    options.cpu_affinity = {0};
+    mantis::AccelerationStructure pinned_accelerator(points, triangles, options);
+    CHECK_EQ(pinned_accelerator.stats().num_threads, 1);
+    check_random_samples(pinned_accelerator, model, 1e4, 1e-6);
+
+    // node 0 exists on every linux machine that reports NUMA nodes
+    options.cpu_affinity.clear();
+    options.numa_node = 0;
+    std::ifstream node("/sys/devices/system/node/node0/cpulist");
+    if (node) {
+        mantis::AccelerationStructure node_accelerator(points, triangles, options);
+        CHECK_GE(node_accelerator.stats().num_threads, 1);
+        check_random_samples(node_accelerator, model, 1e4, 1e-6);
+    }
+    options.numa_node = 1 << 20;
+    CHECK_THROWS_AS(mantis::AccelerationStructure(points, triangles, options), std::runtime_error);
+#endif
+}
+
+TEST_CASE("save_load") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    mantis::BuildOptions shared_options = options;
+    shared_options.face_storage = mantis::FaceStorage::Shared;
+    shared_options.local_tree_threshold = 32;
+    shared_options.max_interceptions = 64;
+    shared_options.compact = true;
+
+    std::string file = (std::filesystem::temp_directory_path() / "bunny.mantis").string();
+    for (const auto &build_options: {options, shared_options}) {
+        mantis::AccelerationStructure accelerator(points, triangles, build_options);
+        accelerator.save(file);
+        auto loaded = mantis::AccelerationStructure::load(file);
+        CHECK_EQ(loaded.instruction_set(), accelerator.instruction_set());
+        CHECK_LE(loaded.memory_usage(), accelerator.memory_usage());
+        CHECK_EQ(loaded.stats().num_steiner_sites, accelerator.stats().num_steiner_sites);
+        CHECK_EQ(loaded.get_face_edges(), accelerator.get_face_edges());
+        check_same_distances(accelerator, loaded, 0.0);
+
+        auto mapped = mantis::AccelerationStructure::map(file);
+        check_same_distances(accelerator, mapped, 0.0);
+#if defined(__unix__) || defined(__APPLE__)
+        // the packed lists stay in the file
+        CHECK_LT(mapped.memory_usage(), loaded.memory_usage());
+#endif
+    }
+
+    std::ifstream in(file, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    auto write_file = [&file](const std::vector<char> &data) {
+        std::ofstream out(file, std::ios::binary);
+        out.write(data.data(), std::streamsize(data.size()));
+    };
+
+    // packed lists of an instruction set this machine cannot run are rebuilt from the mesh in the file
+    mantis::AccelerationStructure accelerator(points, triangles, shared_options);
+    for (auto instruction_set: {mantis::InstructionSet::NEON, mantis::InstructionSet::SSE,
+                                mantis::InstructionSet::AVX2, mantis::InstructionSet::AVX512}) {
+        if (!mantis::is_supported(instruction_set)) {
+            std::vector<char> other_isa = bytes;
+            uint32_t value = uint32_t(instruction_set);
+            std::memcpy(other_isa.data() + 16, &value, sizeof(value));
+            write_file(other_isa);
+            auto rebuilt = mantis::AccelerationStructure::load(file);
+            CHECK(mantis::is_supported(rebuilt.instruction_set()));
+            check_same_distances(accelerator, rebuilt, 0.0);
+            break;
+        }
+    }
+
+    // corrupt, truncated and newer files are rejected
+    std::vector<char> corrupt = bytes;
+    corrupt[0] = 'X';
+    write_file(corrupt);
+    CHECK_THROWS_AS(mantis::AccelerationStructure::load(file), std::runtime_error);
+    write_file(std::vector<char>(bytes.begin(), bytes.begin() + bytes.size() / 2));
+    CHECK_THROWS_AS(mantis::AccelerationStructure::load(file), std::runtime_error);
+    CHECK_THROWS_AS(mantis::AccelerationStructure::map(file), std::runtime_error);
+    std::vector<char> newer = bytes;
+    newer[12] += 1;
+    write_file(newer);
+    CHECK_THROWS_AS(mantis::AccelerationStructure::load(file), std::runtime_error);
+    CHECK_THROWS_AS(mantis::AccelerationStructure::load(file + ".missing"), std::runtime_error);
+
+    // A flipped byte anywhere past the header is either rejected, or only changes coordinates and the queries
+    // stay in bounds. Most of the file are the packed lists, whose indices are checked on load, as are the sites
+    // in the leaves of the tree over the sites.
+    size_t num_flips = 0;
+    size_t num_rejected = 0;
+    std::vector<std::array<float, 3>> queries = random_queries(100);
+    for (size_t i = 64; i < bytes.size(); i += 997, ++num_flips) {
+        std::vector<char> flipped = bytes;
+        flipped[i] = char(~flipped[i]);
+        write_file(flipped);
+        try {
+            auto loaded = mantis::AccelerationStructure::load(file);
+            for (const auto &q: queries) {
+                mantis::Result result = loaded.calc_closest_point(q);
+                size_t num_primitives = result.type == mantis::PrimitiveType::Vertex ? points.size()
+                                      : result.type == mantis::PrimitiveType::Edge ? loaded.get_edge_vertices().size()
+                                                                                     : triangles.size();
+                CHECK_LT(result.primitive_index, num_primitives);
+            }
+        } catch (const std::runtime_error &) {
+            num_rejected++;
+        }
+    }
+    MESSAGE(num_rejected << " of " << num_flips << " flipped bytes rejected");
+    CHECK_GT(10 * num_rejected, num_flips);
+    std::remove(file.c_str());
+}
+
+TEST_CASE("update_positions") {
+    std::vector<std::array<float, 3>> points;
+    std::vector<std::array<uint32_t, 3>> triangles;
+    load_mesh("bunny.obj", points, triangles);
+
+    mantis::BuildOptions options = test_options();
+    options.keep_update_data = true;
+    mantis::AccelerationStructure accelerator(points, triangles, options);
+
+    // a patch of vertices around vertex 0, moved a little at every step
+    auto positions = accelerator.get_positions();
+    std::vector<uint32_t> patch(positions.size());
+    std::iota(patch.begin(), patch.end(), 0);
+    std::sort(patch.begin(), patch.end(), [&](uint32_t a, uint32_t b) {
+        return distp2p(positions[a], positions[0]) < distp2p(positions[b], positions[0]);
+    });
+    patch.resize(10);
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> offset(-2e-3f, 2e-3f);
+    auto move_patch = [&]() {
+        std::vector<std::array<float, 3>> moved;
+        for (uint32_t v: patch) {
+            positions[v] = {positions[v][0] + offset(gen), positions[v][1] + offset(gen),
+                            positions[v][2] + offset(gen)};
+            moved.push_back(positions[v]);
+        }
+        return moved;
+    };
+
+    auto check_same_results = [&](const mantis::AccelerationStructure &updated) {
+        mantis::AccelerationStructure rebuilt(positions, accelerator.get_faces(), options);
+        CHECK_EQ(updated.get_positions(), positions);
+        // half of the queries next to the patch
+        std::vector<std::array<float, 3>> queries = random_queries(10000);
+        for (size_t i = 1; i < queries.size(); i += 2) {
+            const auto &p = positions[patch[i % patch.size()]];
+            const auto &q = queries[i];
+            queries[i] = {p[0] + 0.01f * q[0], p[1] + 0.01f * q[1], p[2] + 0.01f * q[2]};
+        }
+        check_same_distances(rebuilt, updated, 1e-6, queries);
+    };
+
+    for (int step = 0; step < 3; ++step) {
+        mantis::UpdateStats update = accelerator.update_positions(patch, move_patch());
+        MESSAGE("moved " << update.num_moved_vertices << " vertices: " << update.num_changed_cells
+                         << " changed cells, " << update.num_recomputed_faces << " faces and "
+                         << update.num_recomputed_edges << " edges searched, " << update.total_ms << " ms");
+        CHECK_FALSE(update.rebuilt);
+        CHECK_EQ(update.num_moved_vertices, patch.size());
+        CHECK_GE(update.num_changed_cells, patch.size());
+        CHECK_LT(update.num_recomputed_faces, triangles.size());
+        check_same_results(accelerator);
+    }
+
+    // everything is recomputed past the threshold, and without the data of an update
+    mantis::BuildOptions always_rebuild = options;
+    always_rebuild.max_update_fraction = 0.f;
+    mantis::BuildOptions compact = options;
+    compact.compact = true;
+    for (const auto &build_options: {always_rebuild, compact, test_options()}) {
+        mantis::AccelerationStructure other(positions, accelerator.get_faces(), build_options);
+        mantis::UpdateStats update = other.update_positions(patch, move_patch());
+        CHECK(update.rebuilt);
+        CHECK_EQ(update.num_recomputed_faces, triangles.size());
+        check_same_results(other);
+    }
+    std::vector<std::array<float, 3>> patch_positions;
+    for (uint32_t v: patch) {
+        patch_positions.push_back(positions[v]);
+    }
+    accelerator.update_positions(patch, patch_positions);
+
+    // a loaded structure is rebuilt on its first update only
+    std::string file = (std::filesystem::temp_directory_path() / "update.mantis").string();
+    accelerator.save(file);
+    auto loaded = mantis::AccelerationStructure::load(file);
+    std::remove(file.c_str());
+    CHECK(loaded.update_positions(patch, move_patch()).rebuilt);
+    check_same_results(loaded);
+    CHECK_FALSE(loaded.update_positions(patch, move_patch()).rebuilt);
+    check_same_results(loaded);
+
+    std::vector<uint32_t> out_of_range = {uint32_t(positions.size())};
+    CHECK_THROWS_AS(loaded.update_positions(out_of_range, {{0.f, 0.f, 0.f}}), std::runtime_error);
+    CHECK_THROWS_AS(loaded.update_positions(patch, {{0.f, 0.f, 0.f}}), std::runtime_error);
+}